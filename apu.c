@@ -0,0 +1,552 @@
+#include "apu.h"
+#include "cpu.h"
+
+#include <math.h>
+#include <xmmintrin.h>
+#include <stdlib.h>
+#include <string.h>
+
+static const u8 length_table[32] = {
+    10, 254, 20, 2,  40, 4,  80, 6,  160, 8,  60, 10, 14, 12, 26, 14,
+    12, 16,  24, 18, 48, 20, 96, 22, 192, 24, 72, 26, 16, 28, 32, 30,
+};
+
+// one bit per step of each duty cycle, 12.5%, 25%, 50% and 25% inverted.
+static const u8 duty_table[4] = {0x02, 0x06, 0x1E, 0xF9};
+
+static const u8 triangle_table[32] = {
+    15, 14, 13, 12, 11, 10, 9,  8,  7,  6,  5,  4,  3,  2,  1,  0,
+    0,  1,  2,  3,  4,  5,  6,  7,  8,  9,  10, 11, 12, 13, 14, 15,
+};
+
+// in cpu cycles, like every period here.
+static const u16 noise_periods[16] = {
+    4, 8, 16, 32, 64, 96, 128, 160, 202, 254, 380, 508, 762, 1016, 2034, 4068,
+};
+
+static const u16 dmc_periods[16] = {
+    428, 380, 340, 320, 286, 254, 226, 214,
+    190, 160, 142, 128, 106, 84,  72,  54,
+};
+
+// the frame counter's steps, in cpu cycles into the sequence, and how long
+// each sequence is before it starts over.
+static const int frame_times[2][5] = {
+    {7457, 14913, 22371, 29829},
+    {7457, 14913, 22371, 29829, 37281},
+};
+static const int frame_steps[2] = {4, 5};
+static const int frame_periods[2] = {29830, 37282};
+
+void apu_reset(ApuState *apu) {
+  memset(apu, 0, sizeof(ApuState));
+  apu->pulse[0].countdown = 2;
+  apu->pulse[1].countdown = 2;
+  apu->triangle.countdown = 1;
+  apu->noise.shift = 1;
+  apu->noise.countdown = noise_periods[0];
+  apu->dmc.sample_address = 0xC000;
+  apu->dmc.sample_length = 1;
+  apu->dmc.silence = 1;
+  apu->dmc.bits = 8;
+  apu->dmc.countdown = dmc_periods[0];
+}
+
+/// THE BUFFER
+AudioBuffer *make_audio_buffer(u32 sample_rate) {
+  AudioBuffer *audio = (AudioBuffer *)calloc(1, sizeof(AudioBuffer));
+  audio->sample_rate = sample_rate;
+  audio->ratio = (double)sample_rate / APU_CLOCK;
+  audio->dc_pole = expf(-2 * (float)M_PI * 20 / sample_rate);
+
+  // the hardware's mixer, which isn't linear. see the nesdev wiki's apu
+  // mixer page, these are its lookup tables.
+  for (int i = 1; i < 31; i++)
+    audio->pulse_mix[i] = 95.52 / (8128.0 / i + 100);
+  for (int i = 1; i < 203; i++)
+    audio->tnd_mix[i] = 163.67 / (24329.0 / i + 100);
+
+  // a blackman windowed sinc, cut off a little under nyquist. each phase is
+  // the impulse for a step that far into a sample, centered BLEP_TAPS / 2
+  // samples later, and scaled to sum to 1 so a step is exactly its height
+  // once it's integrated.
+  for (int phase = 0; phase < BLEP_PHASES; phase++) {
+    double fraction = (phase + 0.5) / BLEP_PHASES, sum = 0;
+    for (int t = 0; t < BLEP_TAPS; t++) {
+      double x = t - (BLEP_TAPS / 2 - 1) - fraction;
+      double w = M_PI * x / (BLEP_TAPS / 2);
+      double window = 0.42 + 0.5 * cos(w) + 0.08 * cos(2 * w);
+      double sinc = x == 0 ? 1 : sin(M_PI * 0.9 * x) / (M_PI * 0.9 * x);
+      audio->kernel[phase][t] = sinc * window;
+      sum += sinc * window;
+    }
+    for (int t = 0; t < BLEP_TAPS; t++)
+      audio->kernel[phase][t] /= sum;
+  }
+  return audio;
+}
+
+void clean_audio_buffer(AudioBuffer *audio) { free(audio); }
+
+// a rewind or a load can move the clock anywhere. whatever was between the
+// old time and the new is dropped, the samples carry on from here.
+static void resync(AudioBuffer *audio, u64 cycles) {
+  if (cycles < audio->frame_start ||
+      cycles - audio->frame_start > 2 * CYCLES_PER_FRAME)
+    audio->frame_start = cycles;
+}
+
+static void add_step(AudioBuffer *audio, u64 cycle, float level) {
+  float delta = level - audio->level;
+  if (delta == 0)
+    return;
+  audio->level = level;
+
+  double position =
+      audio->offset + (cycle - audio->frame_start) * audio->ratio;
+  u32 index = position;
+  if (index >= AUDIO_MAX_SAMPLES)
+    index = AUDIO_MAX_SAMPLES - 1;
+  int phase = (position - index) * BLEP_PHASES;
+  if (phase >= BLEP_PHASES)
+    phase = BLEP_PHASES - 1;
+
+  const float *kernel = audio->kernel[phase];
+  float *out = audio->steps + index;
+  __m128 scale = _mm_set1_ps(delta);
+  for (int t = 0; t < BLEP_TAPS; t += 4)
+    _mm_storeu_ps(out + t,
+                  _mm_add_ps(_mm_loadu_ps(out + t),
+                             _mm_mul_ps(scale, _mm_load_ps(kernel + t))));
+}
+
+// the steps up to here summed into samples. the taps past the end belong to
+// the next frame and move to the front.
+static void make_samples(AudioBuffer *audio, u64 cycles) {
+  double end = audio->offset + (cycles - audio->frame_start) * audio->ratio;
+  u32 count = end < AUDIO_MAX_SAMPLES ? (u32)end : AUDIO_MAX_SAMPLES;
+
+  float integrator = audio->integrator;
+  float dc_in = audio->dc_in, dc_out = audio->dc_out;
+  for (u32 i = 0; i < count; i++) {
+    integrator += audio->steps[i];
+    dc_out = integrator - dc_in + audio->dc_pole * dc_out;
+    dc_in = integrator;
+    audio->samples[i] = dc_out;
+  }
+  audio->integrator = integrator;
+  audio->dc_in = dc_in;
+  audio->dc_out = dc_out;
+
+  memmove(audio->steps, audio->steps + count, BLEP_TAPS * sizeof(float));
+  memset(audio->steps + BLEP_TAPS, 0, count * sizeof(float));
+
+  audio->count = count;
+  audio->offset = count < AUDIO_MAX_SAMPLES ? end - count : 0;
+  audio->frame_start = cycles;
+}
+
+/// THE CHANNELS
+static int sweep_target(const ApuPulse *p, int channel) {
+  int change = p->period >> p->sweep_shift;
+  if (p->sweep_negate) // pulse 1 negates with ones' complement.
+    return p->period - change - (channel == 0);
+  return p->period + change;
+}
+
+static u8 pulse_muted(const ApuPulse *p, int channel) {
+  return p->period < 8 || sweep_target(p, channel) > 0x7FF;
+}
+
+static u8 envelope_volume(const ApuEnvelope *e) {
+  return e->constant ? e->period : e->decay;
+}
+
+// the timers worth running. one that can't change what's heard is left
+// where it is, the phase it comes back at doesn't matter. without a buffer
+// that's all of them, except the dmc, whose fetches show in $4015.
+typedef enum ApuTimer {
+  TimerPulse1 = (1 << 0),
+  TimerPulse2 = (1 << 1),
+  TimerTriangle = (1 << 2),
+  TimerNoise = (1 << 3),
+  TimerDmc = (1 << 4),
+} ApuTimer;
+
+static u8 running_timers(const ApuState *apu, u8 audible) {
+  const ApuDmc *d = &apu->dmc;
+  u8 timers = (d->remaining || d->buffer_full || !d->silence) ? TimerDmc : 0;
+  if (!audible)
+    return timers;
+
+  for (int c = 0; c < 2; c++)
+    if (apu->pulse[c].length && !pulse_muted(&apu->pulse[c], c))
+      timers |= TimerPulse1 << c;
+  // an ultrasonic triangle just holds where it is.
+  const ApuTriangle *t = &apu->triangle;
+  if (t->length && t->linear && t->period >= 2)
+    timers |= TimerTriangle;
+  if (apu->noise.length)
+    timers |= TimerNoise;
+  return timers;
+}
+
+// what's heard. a channel whose timer isn't running is silent, except the
+// triangle, which holds its level.
+static float mix(const AudioBuffer *audio, const ApuState *apu, u8 timers) {
+  u8 pulses = 0;
+  for (int c = 0; c < 2; c++) {
+    const ApuPulse *p = &apu->pulse[c];
+    if ((timers & (TimerPulse1 << c)) && ((duty_table[p->duty] >> p->step) & 1))
+      pulses += envelope_volume(&p->envelope);
+  }
+  const ApuNoise *n = &apu->noise;
+  u8 noise = (timers & TimerNoise) && !(n->shift & 1)
+                 ? envelope_volume(&n->envelope)
+                 : 0;
+  u8 tnd = 3 * triangle_table[apu->triangle.step] + 2 * noise + apu->dmc.level;
+  return audio->pulse_mix[pulses] + audio->tnd_mix[tnd];
+}
+
+// the memory reader, whenever the buffer's empty and there's sample left.
+static void dmc_fetch(EmuState *state) {
+  ApuDmc *d = &state->apu.dmc;
+  if (d->buffer_full || d->remaining == 0)
+    return;
+
+  d->buffer = peek(state, d->address);
+  d->buffer_full = 1;
+  d->address = d->address == 0xFFFF ? 0x8000 : d->address + 1;
+  if (--d->remaining == 0) {
+    if (d->loop) {
+      d->address = d->sample_address;
+      d->remaining = d->sample_length;
+    } else if (d->irq_enabled) {
+      state->apu.dmc_irq = 1;
+    }
+  }
+}
+
+static void dmc_clock(EmuState *state) {
+  ApuDmc *d = &state->apu.dmc;
+  if (!d->silence) {
+    if (d->shift & 1) {
+      if (d->level <= 125)
+        d->level += 2;
+    } else if (d->level >= 2) {
+      d->level -= 2;
+    }
+  }
+  d->shift >>= 1;
+
+  if (--d->bits == 0) {
+    d->bits = 8;
+    d->silence = !d->buffer_full;
+    if (d->buffer_full) {
+      d->shift = d->buffer;
+      d->buffer_full = 0;
+      dmc_fetch(state);
+    }
+  }
+}
+
+/// THE FRAME COUNTER
+static void envelope_clock(ApuEnvelope *e) {
+  if (e->start) {
+    e->start = 0;
+    e->decay = 15;
+    e->divider = e->period;
+  } else if (e->divider == 0) {
+    e->divider = e->period;
+    if (e->decay > 0)
+      e->decay--;
+    else if (e->loop)
+      e->decay = 15;
+  } else {
+    e->divider--;
+  }
+}
+
+static void quarter_frame(ApuState *apu) {
+  envelope_clock(&apu->pulse[0].envelope);
+  envelope_clock(&apu->pulse[1].envelope);
+  envelope_clock(&apu->noise.envelope);
+
+  ApuTriangle *t = &apu->triangle;
+  if (t->linear_reload)
+    t->linear = t->linear_period;
+  else if (t->linear > 0)
+    t->linear--;
+  if (!t->control)
+    t->linear_reload = 0;
+}
+
+static void half_frame(ApuState *apu) {
+  for (int c = 0; c < 2; c++) {
+    ApuPulse *p = &apu->pulse[c];
+    if (!p->envelope.loop && p->length > 0)
+      p->length--;
+
+    if (p->sweep_divider == 0 && p->sweep_enabled && p->sweep_shift &&
+        !pulse_muted(p, c))
+      p->period = sweep_target(p, c);
+    if (p->sweep_divider == 0 || p->sweep_reload) {
+      p->sweep_divider = p->sweep_period;
+      p->sweep_reload = 0;
+    } else {
+      p->sweep_divider--;
+    }
+  }
+
+  if (!apu->triangle.control && apu->triangle.length > 0)
+    apu->triangle.length--;
+  if (!apu->noise.envelope.loop && apu->noise.length > 0)
+    apu->noise.length--;
+}
+
+static void frame_clock(ApuState *apu) {
+  int step = apu->frame_step;
+  if (apu->five_step) {
+    if (step != 3)
+      quarter_frame(apu);
+    if (step == 1 || step == 4)
+      half_frame(apu);
+  } else {
+    quarter_frame(apu);
+    if (step & 1)
+      half_frame(apu);
+    if (step == 3 && !apu->irq_inhibit)
+      apu->frame_irq = 1;
+  }
+
+  if (++apu->frame_step == frame_steps[apu->five_step]) {
+    apu->frame_step = 0;
+    apu->frame_cycle -= frame_periods[apu->five_step];
+  }
+}
+
+/// CATCHING UP
+static u8 timer_expired(u32 *countdown, u32 span, u32 period) {
+  *countdown -= span;
+  if (*countdown)
+    return 0;
+  *countdown = period;
+  return 1;
+}
+
+void apu_catch_up(EmuState *state) {
+  ApuState *apu = &state->apu;
+  AudioBuffer *audio = state->audio;
+  u64 target = state->cpu_state->cycles;
+  if (audio)
+    resync(audio, apu->cycles);
+
+  // only the frame counter, the dmc and the registers change which timers
+  // run.
+  u8 timers = running_timers(apu, audio != NULL);
+  while (apu->cycles < target) {
+    // on to whatever happens first.
+    u64 span = target - apu->cycles;
+    u64 frame_wait =
+        frame_times[apu->five_step][apu->frame_step] - apu->frame_cycle;
+    if (frame_wait < span)
+      span = frame_wait;
+    for (int c = 0; c < 2; c++)
+      if ((timers & (TimerPulse1 << c)) && apu->pulse[c].countdown < span)
+        span = apu->pulse[c].countdown;
+    if ((timers & TimerTriangle) && apu->triangle.countdown < span)
+      span = apu->triangle.countdown;
+    if ((timers & TimerNoise) && apu->noise.countdown < span)
+      span = apu->noise.countdown;
+    if ((timers & TimerDmc) && apu->dmc.countdown < span)
+      span = apu->dmc.countdown;
+
+    apu->cycles += span;
+    apu->frame_cycle += span;
+    u8 fired = 0; // anything that could change the mix.
+
+    for (int c = 0; c < 2; c++) {
+      ApuPulse *p = &apu->pulse[c];
+      if ((timers & (TimerPulse1 << c)) &&
+          timer_expired(&p->countdown, span, (p->period + 1) * 2)) {
+        p->step = (p->step + 1) & 7;
+        fired = 1;
+      }
+    }
+
+    ApuTriangle *t = &apu->triangle;
+    if ((timers & TimerTriangle) &&
+        timer_expired(&t->countdown, span, t->period + 1)) {
+      t->step = (t->step + 1) & 31;
+      fired = 1;
+    }
+
+    ApuNoise *n = &apu->noise;
+    if ((timers & TimerNoise) &&
+        timer_expired(&n->countdown, span, noise_periods[n->rate])) {
+      u16 feedback = (n->shift ^ (n->shift >> (n->mode ? 6 : 1))) & 1;
+      n->shift = (n->shift >> 1) | (feedback << 14);
+      fired = 1;
+    }
+
+    if ((timers & TimerDmc) &&
+        timer_expired(&apu->dmc.countdown, span,
+                      dmc_periods[apu->dmc.rate])) {
+      dmc_clock(state);
+      timers = running_timers(apu, audio != NULL);
+      fired = 1;
+    }
+
+    if (apu->frame_cycle == frame_times[apu->five_step][apu->frame_step]) {
+      frame_clock(apu);
+      timers = running_timers(apu, audio != NULL);
+      fired = 1;
+    }
+
+    if (audio && fired)
+      add_step(audio, apu->cycles, mix(audio, apu, timers));
+  }
+}
+
+void apu_end_frame(EmuState *state) {
+  apu_catch_up(state);
+  if (state->audio)
+    make_samples(state->audio, state->apu.cycles);
+}
+
+/// THE REGISTERS
+static void envelope_write(ApuEnvelope *e, u8 value) {
+  e->loop = (value >> 5) & 1;
+  e->constant = (value >> 4) & 1;
+  e->period = value & 0x0F;
+}
+
+void apu_write(EmuState *state, u16 address, u8 value) {
+  apu_catch_up(state);
+  ApuState *apu = &state->apu;
+  ApuPulse *p = &apu->pulse[(address >> 2) & 1];
+  ApuTriangle *t = &apu->triangle;
+  ApuNoise *n = &apu->noise;
+  ApuDmc *d = &apu->dmc;
+
+  switch (address) {
+  case 0x4000:
+  case 0x4004:
+    p->duty = value >> 6;
+    envelope_write(&p->envelope, value);
+    break;
+  case 0x4001:
+  case 0x4005:
+    p->sweep_enabled = value >> 7;
+    p->sweep_period = (value >> 4) & 7;
+    p->sweep_negate = (value >> 3) & 1;
+    p->sweep_shift = value & 7;
+    p->sweep_reload = 1;
+    break;
+  case 0x4002:
+  case 0x4006:
+    p->period = (p->period & 0x700) | value;
+    break;
+  case 0x4003:
+  case 0x4007:
+    p->period = (p->period & 0xFF) | (value & 7) << 8;
+    if (apu->enabled & (1 << ((address >> 2) & 1)))
+      p->length = length_table[value >> 3];
+    p->step = 0;
+    p->envelope.start = 1;
+    break;
+
+  case 0x4008:
+    t->control = value >> 7;
+    t->linear_period = value & 0x7F;
+    break;
+  case 0x400A:
+    t->period = (t->period & 0x700) | value;
+    break;
+  case 0x400B:
+    t->period = (t->period & 0xFF) | (value & 7) << 8;
+    if (apu->enabled & 4)
+      t->length = length_table[value >> 3];
+    t->linear_reload = 1;
+    break;
+
+  case 0x400C:
+    envelope_write(&n->envelope, value);
+    break;
+  case 0x400E:
+    n->mode = value >> 7;
+    n->rate = value & 0x0F;
+    break;
+  case 0x400F:
+    if (apu->enabled & 8)
+      n->length = length_table[value >> 3];
+    n->envelope.start = 1;
+    break;
+
+  case 0x4010:
+    d->irq_enabled = value >> 7;
+    d->loop = (value >> 6) & 1;
+    d->rate = value & 0x0F;
+    if (!d->irq_enabled)
+      apu->dmc_irq = 0;
+    break;
+  case 0x4011:
+    d->level = value & 0x7F;
+    break;
+  case 0x4012:
+    d->sample_address = 0xC000 + value * 64;
+    break;
+  case 0x4013:
+    d->sample_length = value * 16 + 1;
+    break;
+
+  case 0x4015:
+    apu->enabled = value & 0x1F;
+    if (!(value & 1))
+      apu->pulse[0].length = 0;
+    if (!(value & 2))
+      apu->pulse[1].length = 0;
+    if (!(value & 4))
+      t->length = 0;
+    if (!(value & 8))
+      n->length = 0;
+    apu->dmc_irq = 0;
+    if (!(value & 0x10)) {
+      d->remaining = 0;
+    } else if (d->remaining == 0) {
+      d->address = d->sample_address;
+      d->remaining = d->sample_length;
+      dmc_fetch(state);
+    }
+    break;
+
+  case 0x4017:
+    apu->five_step = value >> 7;
+    apu->irq_inhibit = (value >> 6) & 1;
+    if (apu->irq_inhibit)
+      apu->frame_irq = 0;
+    apu->frame_step = 0;
+    apu->frame_cycle = 0;
+    // the 5 step sequence clocks everything straight away.
+    if (apu->five_step) {
+      quarter_frame(apu);
+      half_frame(apu);
+    }
+    break;
+  }
+
+  if (state->audio)
+    add_step(state->audio, apu->cycles,
+             mix(state->audio, apu, running_timers(apu, 1)));
+}
+
+u8 apu_read_status(EmuState *state) {
+  apu_catch_up(state);
+  ApuState *apu = &state->apu;
+  u8 status = (apu->pulse[0].length > 0) | (apu->pulse[1].length > 0) << 1 |
+              (apu->triangle.length > 0) << 2 |
+              (apu->noise.length > 0) << 3 | (apu->dmc.remaining > 0) << 4 |
+              apu->frame_irq << 6 | apu->dmc_irq << 7;
+  apu->frame_irq = 0;
+  return status;
+}
@@ -0,0 +1,157 @@
+#pragma once
+
+#include "defines.h"
+
+// the 2A03's sound: two pulses, a triangle, noise and the dmc, with the
+// frame counter clocking their length counters, envelopes and sweeps.
+//
+// the apu is lazy, like everything else in the core. nothing happens to it
+// until the cpu touches $4000-$4017 or the frame ends, and then it's caught
+// up to the cpu's cycle in one go, jumping from one timer expiring to the
+// next instead of ticking every cycle. a channel that can't be heard (length
+// counter out, or an ultrasonic period) doesn't run its timer at all.
+//
+// sound is made only when the machine has an AudioBuffer. the channels'
+// output levels are mixed the way the hardware does, and every change of the
+// mix goes in as a band-limited step at its exact cycle. once a frame the
+// steps are summed up into samples at the buffer's rate. a machine without
+// a buffer (headless, a clone, an ahead frame) still keeps its apu state
+// right for $4015, it just doesn't make sound.
+//
+// the interrupts ($4015's frame and dmc flags) are kept, but the cpu has no
+// irq line yet, so nothing is interrupted. the dmc's reads don't steal
+// cycles from the cpu either.
+
+#define APU_CLOCK 1789773 // the ntsc cpu clock, which everything here counts.
+
+// the band-limited step. phases of the fraction of a sample a step lands on,
+// taps per step.
+#define BLEP_PHASES 32
+#define BLEP_TAPS 16
+// samples one frame can make. plenty for any rate up to 192khz, even for
+// the odd frame that runs long.
+#define AUDIO_MAX_SAMPLES 8192
+
+typedef struct EmuState EmuState;
+
+typedef struct ApuEnvelope {
+  u8 start;
+  u8 divider;
+  u8 decay;
+  u8 period;   // and the constant volume, the low 4 bits of $4000.
+  u8 constant;
+  u8 loop;     // also halts the length counter.
+} ApuEnvelope;
+
+typedef struct ApuPulse {
+  ApuEnvelope envelope;
+  u8 length;
+  u8 duty;
+  u8 step; // into the duty cycle.
+  u16 period;
+  u32 countdown; // cpu cycles to the next step.
+
+  u8 sweep_enabled;
+  u8 sweep_period;
+  u8 sweep_negate;
+  u8 sweep_shift;
+  u8 sweep_reload;
+  u8 sweep_divider;
+} ApuPulse;
+
+typedef struct ApuTriangle {
+  u8 length;
+  u8 control; // halts the length counter, and keeps reloading the linear.
+  u8 linear;
+  u8 linear_period;
+  u8 linear_reload;
+  u8 step; // into the 32 step ramp.
+  u16 period;
+  u32 countdown;
+} ApuTriangle;
+
+typedef struct ApuNoise {
+  ApuEnvelope envelope;
+  u8 length;
+  u8 mode; // short (93 step) sequence.
+  u8 rate;
+  u16 shift;
+  u32 countdown;
+} ApuNoise;
+
+typedef struct ApuDmc {
+  u8 irq_enabled;
+  u8 loop;
+  u8 rate;
+  u8 level; // 7 bit output.
+
+  u16 sample_address; // from $4012 and $4013.
+  u16 sample_length;
+  u16 address; // of the next byte to fetch.
+  u16 remaining; // bytes left to fetch.
+
+  u8 buffer; // the fetched byte waiting for the output unit.
+  u8 buffer_full;
+  u8 shift;
+  u8 bits;
+  u8 silence;
+  u32 countdown;
+} ApuDmc;
+
+// all of it by value, so clones and snapshots get it for free.
+typedef struct ApuState {
+  ApuPulse pulse[2];
+  ApuTriangle triangle;
+  ApuNoise noise;
+  ApuDmc dmc;
+  u8 enabled; // the channel bits of $4015.
+
+  // the frame counter.
+  u8 five_step;
+  u8 irq_inhibit;
+  u8 frame_step; // the next one due.
+  int frame_cycle; // cpu cycles into the sequence.
+
+  u8 frame_irq;
+  u8 dmc_irq;
+
+  u64 cycles; // the cpu cycle the apu has been caught up to.
+} ApuState;
+
+// where a machine's sound goes. borrowed by the machine, see
+// EmuState.audio, and owned by whoever attached it.
+typedef struct AudioBuffer {
+  u32 sample_rate;
+  double ratio; // samples per cpu cycle.
+
+  u64 frame_start; // the cpu cycle this frame's samples start at,
+  double offset;   // and the fraction of a sample it starts into.
+  float level;     // the mix as of the last step put in.
+
+  float pulse_mix[31]; // the mixer, by the sum of the channels' levels.
+  float tnd_mix[203];  // 3 * triangle + 2 * noise + dmc.
+
+  float integrator;
+  float dc_in, dc_out, dc_pole; // a highpass, to take the mix's dc off.
+
+  // band-limited impulses, 16 byte aligned for the sse that adds them in.
+  _Alignas(16) float kernel[BLEP_PHASES][BLEP_TAPS];
+  float steps[AUDIO_MAX_SAMPLES + BLEP_TAPS];
+
+  float samples[AUDIO_MAX_SAMPLES]; // what the last frame made.
+  u32 count;
+} AudioBuffer;
+
+void apu_reset(ApuState *apu);
+
+AudioBuffer *make_audio_buffer(u32 sample_rate);
+void clean_audio_buffer(AudioBuffer *audio);
+
+// the bus side, $4000-$4013, $4015 and $4017. both catch the apu up first.
+void apu_write(EmuState *state, u16 address, u8 value);
+u8 apu_read_status(EmuState *state);
+
+// up to the cpu's cycle.
+void apu_catch_up(EmuState *state);
+// catches up and, with a buffer, turns the frame's steps into samples.
+void apu_end_frame(EmuState *state);
@@ -0,0 +1,342 @@
+#include "audio.h"
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#if is_alsa
+#include <alsa/asoundlib.h>
+#endif
+
+AudioState *audio_state = NULL;
+
+/// THE RING
+void audio_ring_reset(AudioRing *ring) {
+  atomic_store(&ring->head, 0);
+  atomic_store(&ring->tail, 0);
+}
+
+// the producer's side. the samples go in before the new head is published,
+// so the consumer never sees a slot that isn't written yet.
+u32 audio_ring_push(AudioRing *ring, const float *samples, u32 count) {
+  u64 head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+  u64 tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+  u32 room = AUDIO_RING_SIZE - (u32)(head - tail);
+  if (count > room)
+    count = room;
+
+  u32 start = head & (AUDIO_RING_SIZE - 1);
+  u32 first = AUDIO_RING_SIZE - start < count ? AUDIO_RING_SIZE - start : count;
+  memcpy(ring->samples + start, samples, first * sizeof(float));
+  memcpy(ring->samples, samples + first, (count - first) * sizeof(float));
+
+  atomic_store_explicit(&ring->head, head + count, memory_order_release);
+  return count;
+}
+
+// and the consumer's, the same the other way around.
+u32 audio_ring_pop(AudioRing *ring, float *out, u32 count) {
+  u64 tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+  u64 head = atomic_load_explicit(&ring->head, memory_order_acquire);
+  u32 waiting = head - tail;
+  if (count > waiting)
+    count = waiting;
+
+  u32 start = tail & (AUDIO_RING_SIZE - 1);
+  u32 first = AUDIO_RING_SIZE - start < count ? AUDIO_RING_SIZE - start : count;
+  memcpy(out, ring->samples + start, first * sizeof(float));
+  memcpy(out + first, ring->samples, (count - first) * sizeof(float));
+
+  atomic_store_explicit(&ring->tail, tail + count, memory_order_release);
+  return count;
+}
+
+u32 audio_ring_fill(AudioRing *ring) {
+  u64 tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+  u64 head = atomic_load_explicit(&ring->head, memory_order_acquire);
+  return head - tail;
+}
+
+/// WAV FILES
+static void put16(u8 *out, u16 value) {
+  out[0] = value;
+  out[1] = value >> 8;
+}
+
+static void put32(u8 *out, u32 value) {
+  put16(out, value);
+  put16(out + 2, value >> 16);
+}
+
+static void write_header(WavFile *wav) {
+  u32 data = wav->samples * 2;
+  u8 header[44];
+  memcpy(header, "RIFF", 4);
+  put32(header + 4, 36 + data);
+  memcpy(header + 8, "WAVEfmt ", 8);
+  put32(header + 16, 16);
+  put16(header + 20, 1); // pcm.
+  put16(header + 22, 1); // mono.
+  put32(header + 24, wav->sample_rate);
+  put32(header + 28, wav->sample_rate * 2);
+  put16(header + 32, 2);
+  put16(header + 34, 16);
+  memcpy(header + 36, "data", 4);
+  put32(header + 40, data);
+  fwrite(header, 1, sizeof(header), wav->file);
+}
+
+WavFile *wav_open(const char *path, u32 sample_rate) {
+  FILE *file = fopen(path, "wb");
+  if (file == NULL) {
+    printf("Could not open %s for the wav.\n", path);
+    return NULL;
+  }
+
+  WavFile *wav = (WavFile *)malloc(sizeof(WavFile));
+  wav->file = file;
+  wav->sample_rate = sample_rate;
+  wav->samples = 0;
+  write_header(wav); // a placeholder until the sizes are known.
+  return wav;
+}
+
+void wav_write(WavFile *wav, const float *samples, u32 count) {
+  u8 pcm[1024 * 2];
+  while (count > 0) {
+    u32 chunk = count < 1024 ? count : 1024;
+    for (u32 i = 0; i < chunk; i++) {
+      float s = samples[i] * 32767;
+      s = s > 32767 ? 32767 : s < -32768 ? -32768 : s;
+      put16(pcm + i * 2, (u16)(int)s);
+    }
+    fwrite(pcm, 2, chunk, wav->file);
+    wav->samples += chunk;
+    samples += chunk;
+    count -= chunk;
+  }
+}
+
+u8 wav_close(WavFile *wav) {
+  u8 ok = fseek(wav->file, 0, SEEK_SET) == 0;
+  if (ok)
+    write_header(wav);
+  ok = ok && !ferror(wav->file);
+  ok = (fclose(wav->file) == 0) && ok;
+  free(wav);
+  return ok;
+}
+
+/// THE BACKENDS
+// one device period out of the ring, made up with silence if it's short.
+// short before anything has ever arrived doesn't count, that's just the
+// start.
+static void take(AudioState *as, float *out, u8 *started) {
+  u32 got = audio_ring_pop(as->ring, out, AUDIO_PERIOD);
+  if (got < AUDIO_PERIOD) {
+    memset(out + got, 0, (AUDIO_PERIOD - got) * sizeof(float));
+    if (*started) {
+      atomic_fetch_add_explicit(&as->underruns, 1, memory_order_relaxed);
+      atomic_fetch_add_explicit(&as->padded, AUDIO_PERIOD - got,
+                                memory_order_relaxed);
+    }
+  }
+  if (got > 0)
+    *started = 1;
+  atomic_fetch_add_explicit(&as->played, AUDIO_PERIOD, memory_order_relaxed);
+}
+
+// a device that isn't there, on the same clock as one that is.
+static void *null_thread(void *arg) {
+  AudioState *as = (AudioState *)arg;
+  float period[AUDIO_PERIOD];
+  u8 started = 0;
+  long step = (long)(1e9 * AUDIO_PERIOD / as->sample_rate);
+
+  struct timespec next;
+  clock_gettime(CLOCK_MONOTONIC, &next);
+  while (!atomic_load(&as->quit)) {
+    next.tv_nsec += step;
+    if (next.tv_nsec >= 1000000000) {
+      next.tv_sec++;
+      next.tv_nsec -= 1000000000;
+    }
+    clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, NULL);
+    take(as, period, &started);
+  }
+  return NULL;
+}
+
+// whatever's there, as soon as it's there. after quit it keeps going until
+// the ring's empty, so a wav gets every sample pushed before the end.
+static void *wav_thread(void *arg) {
+  AudioState *as = (AudioState *)arg;
+  float chunk[AUDIO_PERIOD];
+  u8 quitting = 0;
+
+  for (;;) {
+    u32 got = audio_ring_pop(as->ring, chunk, AUDIO_PERIOD);
+    if (got > 0) {
+      wav_write(as->wav, chunk, got);
+      atomic_fetch_add_explicit(&as->played, got, memory_order_relaxed);
+      continue;
+    }
+    if (quitting)
+      break;
+    if (atomic_load(&as->quit)) {
+      quitting = 1; // one more look, for anything pushed just before.
+      continue;
+    }
+    struct timespec wait = {0, 1000000};
+    nanosleep(&wait, NULL);
+  }
+  return NULL;
+}
+
+#if is_alsa
+// the device's blocking write is the clock here. an xrun means the device
+// ran dry underneath us, which counts the same as coming up short.
+static void *alsa_thread(void *arg) {
+  AudioState *as = (AudioState *)arg;
+  snd_pcm_t *pcm = (snd_pcm_t *)as->pcm;
+  float period[AUDIO_PERIOD];
+  u8 started = 0;
+
+  while (!atomic_load(&as->quit)) {
+    take(as, period, &started);
+    snd_pcm_sframes_t wrote = snd_pcm_writei(pcm, period, AUDIO_PERIOD);
+    if (wrote < 0) {
+      if (wrote == -EPIPE)
+        atomic_fetch_add_explicit(&as->underruns, 1, memory_order_relaxed);
+      snd_pcm_recover(pcm, wrote, 1);
+    }
+  }
+  return NULL;
+}
+
+static u8 open_alsa(AudioState *as) {
+  snd_pcm_t *pcm;
+  if (snd_pcm_open(&pcm, "default", SND_PCM_STREAM_PLAYBACK, 0) < 0) {
+    printf("Could not open the alsa device.\n");
+    return 0;
+  }
+  // 50ms of device buffer, on top of the ring.
+  if (snd_pcm_set_params(pcm, SND_PCM_FORMAT_FLOAT,
+                         SND_PCM_ACCESS_RW_INTERLEAVED, 1, as->sample_rate, 1,
+                         50000) < 0) {
+    printf("The alsa device won't take %u hz mono floats.\n",
+           as->sample_rate);
+    snd_pcm_close(pcm);
+    return 0;
+  }
+  as->pcm = pcm;
+  return 1;
+}
+#endif
+
+/// THE MODULE
+AudioState *make_audio_state() {
+  AudioState *as = (AudioState *)calloc(1, sizeof(AudioState));
+  as->sample_rate = AUDIO_SAMPLE_RATE;
+  as->buffer = make_audio_buffer(AUDIO_SYNTH_RATE);
+  as->resampler = make_resampler(AUDIO_SYNTH_RATE, as->sample_rate,
+                                 (ResampleQuality)AUDIO_QUALITY);
+  // the ring's lines are 64 byte aligned, calloc doesn't promise that.
+  as->ring = (AudioRing *)aligned_alloc(64, sizeof(AudioRing));
+  audio_ring_reset(as->ring);
+  return as;
+}
+
+void clean_audio_state(AudioState *as) {
+  clean_audio_buffer(as->buffer);
+  clean_resampler(as->resampler);
+  free(as->ring);
+  free(as);
+}
+
+u8 audio_init(const char *backend, EmuState *state) {
+  AudioState *as = make_audio_state();
+  void *(*thread)(void *) = NULL;
+
+  if (strcmp(backend, "null") == 0) {
+    as->backend = AudioNull;
+    thread = null_thread;
+  } else if (strncmp(backend, "wav:", 4) == 0) {
+    as->backend = AudioWav;
+    as->wav = wav_open(backend + 4, as->sample_rate);
+    if (as->wav)
+      thread = wav_thread;
+  } else if (strcmp(backend, "alsa") == 0) {
+    as->backend = AudioAlsa;
+#if is_alsa
+    if (open_alsa(as))
+      thread = alsa_thread;
+#else
+    printf("Built without alsa, see is_alsa in defines.h.\n");
+#endif
+  } else {
+    printf("Unknown audio backend %s, try null, wav:file or alsa.\n",
+           backend);
+  }
+
+  if (thread == NULL) {
+    clean_audio_state(as);
+    return 0;
+  }
+
+  pthread_create(&as->thread, NULL, thread, as);
+  state->audio = as->buffer;
+  audio_state = as;
+  return 1;
+}
+
+void audio_update(EmuState *state) {
+  AudioState *as = audio_state;
+  AudioBuffer *buffer = state->audio;
+  if (as == NULL || buffer == NULL || buffer->count == 0)
+    return;
+
+  float out[AUDIO_MAX_SAMPLES];
+  u32 made = resample_block(as->resampler, buffer->samples, buffer->count,
+                            out, AUDIO_MAX_SAMPLES);
+  u32 pushed = audio_ring_push(as->ring, out, made);
+  if (pushed < made) {
+    atomic_fetch_add_explicit(&as->overruns, 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&as->dropped, made - pushed,
+                              memory_order_relaxed);
+  }
+  buffer->count = 0; // taken, so a frame that makes none pushes none.
+}
+
+void audio_report() {
+  AudioState *as = audio_state;
+  if (as == NULL)
+    return;
+
+  printf("Audio: %llu samples played, %llu underruns (%llu samples of "
+         "silence), %llu overruns (%llu samples dropped).\n",
+         (unsigned long long)as->played, (unsigned long long)as->underruns,
+         (unsigned long long)as->padded, (unsigned long long)as->overruns,
+         (unsigned long long)as->dropped);
+}
+
+void audio_clean(EmuState *state) {
+  AudioState *as = audio_state;
+  if (as == NULL)
+    return;
+
+  atomic_store(&as->quit, 1);
+  pthread_join(as->thread, NULL);
+  if (as->wav)
+    wav_close(as->wav);
+#if is_alsa
+  if (as->pcm)
+    snd_pcm_close((snd_pcm_t *)as->pcm);
+#endif
+
+  if (state->audio == as->buffer)
+    state->audio = NULL;
+  clean_audio_state(as);
+  audio_state = NULL;
+}
@@ -1 +1,103 @@
 #pragma once
+
+#include "apu.h"
+#include "cpu.h"
+#include "defines.h"
+#include "resample.h"
+
+#include <pthread.h>
+#include <stdio.h>
+
+// getting the apu's samples to a sound device without the emulation ever
+// waiting on it. the machine's AudioBuffer fills once a frame at
+// AUDIO_SYNTH_RATE, audio_update resamples it down to the device's rate (see
+// resample.h) into a single producer, single consumer ring, and a backend
+// thread drains the ring at its own pace. neither side takes a lock: a push
+// that doesn't fit drops what's left over (an overrun) and a pop that comes
+// up short plays silence for the rest (an underrun). both are counted.
+// ./nes_bench audio checks the ring, the counters and the wav headless.
+//
+// the backends, picked by name (see audio_init):
+//
+//   null        a thread that takes samples at the device rate and throws
+//               them away. paced like a real device, so the counters mean
+//               the same thing they would with one.
+//   wav:PATH    writes everything to a 16 bit mono wav, as fast as it's
+//               given. a file has no clock, so it never underruns.
+//   alsa        the default device. only there when built with is_alsa,
+//               see defines.h (make.sh turns it on when it finds alsa).
+
+#define AUDIO_SAMPLE_RATE 48000
+// the apu's, twice the device's. the blep steps roll off well before this
+// nyquist, and the resampler's lowpass takes it the rest of the way.
+#define AUDIO_SYNTH_RATE 96000
+#define AUDIO_RING_SIZE 8192 // samples, a power of two. ~170ms at 48khz.
+#define AUDIO_PERIOD 480     // samples a device thread takes at a time, 10ms.
+
+// head and tail only ever count up, the index is them masked. each has its
+// own cache line, since each is written by a different thread.
+typedef struct AudioRing {
+  _Alignas(64) _Atomic u64 head; // written by the producer.
+  _Alignas(64) _Atomic u64 tail; // written by the consumer.
+  _Alignas(64) float samples[AUDIO_RING_SIZE];
+} AudioRing;
+
+void audio_ring_reset(AudioRing *ring);
+// both return how many samples actually went through.
+u32 audio_ring_push(AudioRing *ring, const float *samples, u32 count);
+u32 audio_ring_pop(AudioRing *ring, float *out, u32 count);
+// samples waiting. exact from either thread's side, a moment stale from
+// anywhere else.
+u32 audio_ring_fill(AudioRing *ring);
+
+typedef struct WavFile {
+  FILE *file;
+  u32 sample_rate;
+  u32 samples; // written so far.
+} WavFile;
+
+// 16 bit pcm, mono. NULL if the file can't be made.
+WavFile *wav_open(const char *path, u32 sample_rate);
+void wav_write(WavFile *wav, const float *samples, u32 count);
+// fills in the sizes the header was left without. 1 on success.
+u8 wav_close(WavFile *wav);
+
+typedef enum AudioBackend {
+  AudioNull,
+  AudioWav,
+  AudioAlsa,
+} AudioBackend;
+
+typedef struct AudioState {
+  AudioBackend backend;
+  u32 sample_rate;
+  AudioBuffer *buffer; // lent to the machine while we're up.
+  Resampler *resampler;
+  AudioRing *ring;
+
+  pthread_t thread; // the consumer.
+  _Atomic u8 quit;
+  WavFile *wav;
+  void *pcm; // alsa's snd_pcm_t.
+
+  // written by one side each, read by anyone.
+  _Atomic u64 overruns;  // pushes that didn't fit, by the emulation thread.
+  _Atomic u64 underruns; // periods that came up short, by the backend.
+  _Atomic u64 dropped;   // samples lost to overruns.
+  _Atomic u64 padded;    // samples of silence played for underruns.
+  _Atomic u64 played;    // samples the backend took, silence included.
+} AudioState;
+
+extern AudioState *audio_state;
+
+// starts the named backend and lends the machine a buffer. 0 (and no sound)
+// if the backend couldn't be started.
+u8 audio_init(const char *backend, EmuState *state);
+// call once per real frame, after it's run. takes the frame's samples out of
+// the machine's buffer and pushes them, never waits. a frame that made none
+// (a rewind step, say) pushes nothing.
+void audio_update(EmuState *state);
+void audio_report();
+// stops the backend (a wav gets whatever was still in the ring) and takes
+// the buffer back from the machine.
+void audio_clean(EmuState *state);
@@ -0,0 +1,314 @@
+#include "batch.h"
+#include "movie.h"
+#include "state.h"
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+typedef struct Image {
+  char path[BATCH_PATH_MAX];
+  u8 *data;
+  u32 size;
+} Image;
+
+typedef struct Job {
+  const Image *image;
+  u32 frames;
+  char movie[BATCH_PATH_MAX]; // empty for none.
+  int line;
+} Job;
+
+// a worker's share of the jobs. the owner takes from the bottom, thieves
+// from the top, so they only meet when it's nearly empty. jobs are coarse
+// (thousands of frames each), so a lock per deque costs nothing measurable.
+typedef struct Deque {
+  pthread_mutex_t lock;
+  int *jobs;
+  int top;
+  int bottom;
+} Deque;
+
+typedef struct Batch {
+  Job *jobs;
+  int job_count;
+  Image *images;
+  int image_count;
+
+  Deque *deques;
+  int workers;
+
+  pthread_mutex_t output_lock;
+  FILE *output;
+  int failed;
+} Batch;
+
+typedef struct Worker {
+  Batch *batch;
+  int index;
+} Worker;
+
+static double now_seconds() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/// THE MANIFEST
+static const Image *find_image(Batch *b, const char *path) {
+  for (int i = 0; i < b->image_count; i++)
+    if (strcmp(b->images[i].path, path) == 0)
+      return &b->images[i];
+
+  FILE *file = fopen(path, "rb");
+  if (file == NULL)
+    return NULL;
+
+  fseek(file, 0, SEEK_END);
+  long size = ftell(file);
+  rewind(file);
+
+  u8 *data = (u8 *)malloc(size);
+  u8 ok = fread(data, 1, size, file) == (size_t)size;
+  fclose(file);
+  if (!ok) {
+    free(data);
+    return NULL;
+  }
+
+  b->images = (Image *)realloc(b->images, (b->image_count + 1) * sizeof(Image));
+  Image *image = &b->images[b->image_count++];
+  snprintf(image->path, sizeof(image->path), "%s", path);
+  image->data = data;
+  image->size = size;
+  return image;
+}
+
+static u8 read_manifest(Batch *b, const char *path) {
+  FILE *file = fopen(path, "r");
+  if (file == NULL) {
+    printf("Failed to open the manifest %s.\n", path);
+    return 0;
+  }
+
+  // the images array moves as it grows, so jobs hold an index until the
+  // whole manifest is read.
+  int *image_of = NULL;
+  int capacity = 0;
+  char line[3 * BATCH_PATH_MAX];
+  int line_number = 0;
+  u8 ok = 1;
+
+  while (fgets(line, sizeof(line), file)) {
+    line_number++;
+    char rom[BATCH_PATH_MAX], movie[BATCH_PATH_MAX] = "";
+    unsigned frames;
+
+    char *start = line + strspn(line, " \t");
+    if (*start == '#' || *start == '\n' || *start == '\0')
+      continue;
+    if (sscanf(start, "%511s %u %511s", rom, &frames, movie) < 2) {
+      printf("Bad manifest line %d: %s", line_number, line);
+      ok = 0;
+      break;
+    }
+
+    const Image *image = find_image(b, rom);
+    if (image == NULL) {
+      printf("Failed to read the rom %s (manifest line %d).\n", rom,
+             line_number);
+      ok = 0;
+      break;
+    }
+
+    if (b->job_count == capacity) {
+      capacity = capacity ? capacity * 2 : 64;
+      b->jobs = (Job *)realloc(b->jobs, capacity * sizeof(Job));
+      image_of = (int *)realloc(image_of, capacity * sizeof(int));
+    }
+    Job *job = &b->jobs[b->job_count];
+    image_of[b->job_count++] = image - b->images;
+    job->frames = frames;
+    job->line = line_number;
+    snprintf(job->movie, sizeof(job->movie), "%s", movie);
+  }
+  fclose(file);
+
+  for (int i = 0; i < b->job_count; i++)
+    b->jobs[i].image = &b->images[image_of[i]];
+  free(image_of);
+  return ok;
+}
+
+/// THE POOL
+static int take(Deque *d) {
+  pthread_mutex_lock(&d->lock);
+  int job = (d->bottom > d->top) ? d->jobs[--d->bottom] : -1;
+  pthread_mutex_unlock(&d->lock);
+  return job;
+}
+
+static int steal(Deque *d) {
+  pthread_mutex_lock(&d->lock);
+  int job = (d->bottom > d->top) ? d->jobs[d->top++] : -1;
+  pthread_mutex_unlock(&d->lock);
+  return job;
+}
+
+// our own work first, then go round everyone else once. nothing is ever
+// pushed after the start, so a full round with nothing means we're done.
+static int next_job(Worker *w) {
+  Batch *b = w->batch;
+  int job = take(&b->deques[w->index]);
+
+  for (int i = 1; job < 0 && i < b->workers; i++)
+    job = steal(&b->deques[(w->index + i) % b->workers]);
+  return job;
+}
+
+/// RUNNING
+static void write_string(FILE *out, const char *s) {
+  fputc('"', out);
+  for (; *s; s++) {
+    if (*s == '"' || *s == '\\')
+      fprintf(out, "\\%c", *s);
+    else if ((u8)*s < 0x20)
+      fprintf(out, "\\u%04x", *s);
+    else
+      fputc(*s, out);
+  }
+  fputc('"', out);
+}
+
+static void run_job(Worker *w, const Job *job) {
+  double start = now_seconds();
+  const char *status = "ok";
+
+  EmuState *state = make_emu_state();
+  CPUState *cs = state->cpu_state;
+  u64 hash = 0;
+
+  if (!load_rom(state, job->image->data, job->image->size)) {
+    status = "bad rom";
+  } else {
+    if (job->movie[0] && !movie_play(state, job->movie))
+      status = "desync";
+
+    // frames counts from power on, movie frames included.
+    memset(state->input.buttons, 0, sizeof(state->input.buttons));
+    u64 end = (u64)job->frames * CYCLES_PER_FRAME;
+    while (cs->cycles < end && !cs->shutting_down)
+      cpu_run_frame(state);
+
+    hash = hash_machine(state);
+  }
+
+  double elapsed = now_seconds() - start;
+  Batch *b = w->batch;
+
+  pthread_mutex_lock(&b->output_lock);
+  fprintf(b->output, "{\"line\":%d,\"rom\":", job->line);
+  write_string(b->output, job->image->path);
+  if (job->movie[0]) {
+    fprintf(b->output, ",\"movie\":");
+    write_string(b->output, job->movie);
+  }
+  fprintf(b->output,
+          ",\"frames\":%u,\"cycles\":%llu,\"hash\":\"%016llx\","
+          "\"halted\":%s,\"status\":\"%s\",\"seconds\":%.6f}\n",
+          job->frames, (unsigned long long)cs->cycles,
+          (unsigned long long)hash, cs->shutting_down ? "true" : "false",
+          status, elapsed);
+  fflush(b->output);
+  if (strcmp(status, "ok") != 0)
+    b->failed++;
+  pthread_mutex_unlock(&b->output_lock);
+
+  clean_emu_state(state);
+}
+
+static void *worker_thread(void *arg) {
+  Worker *w = (Worker *)arg;
+  int job;
+
+  while ((job = next_job(w)) >= 0)
+    run_job(w, &w->batch->jobs[job]);
+  return NULL;
+}
+
+static u8 run_pool(Batch *b, int workers) {
+  if (workers <= 0)
+    workers = sysconf(_SC_NPROCESSORS_ONLN);
+  if (workers > b->job_count)
+    workers = b->job_count;
+  if (workers < 1)
+    workers = 1;
+  b->workers = workers;
+
+  // deal the jobs out round robin. the order within a deque doesn't matter,
+  // whoever finishes early steals the rest.
+  b->deques = (Deque *)calloc(workers, sizeof(Deque));
+  int share = b->job_count / workers + 1;
+  for (int i = 0; i < workers; i++) {
+    pthread_mutex_init(&b->deques[i].lock, NULL);
+    b->deques[i].jobs = (int *)malloc(share * sizeof(int));
+  }
+  for (int i = 0; i < b->job_count; i++) {
+    Deque *d = &b->deques[i % workers];
+    d->jobs[d->bottom++] = i;
+  }
+  pthread_mutex_init(&b->output_lock, NULL);
+
+  Worker *pool = (Worker *)calloc(workers, sizeof(Worker));
+  pthread_t *threads = (pthread_t *)calloc(workers, sizeof(pthread_t));
+
+  double start = now_seconds();
+  for (int i = 0; i < workers; i++) {
+    pool[i] = (Worker){b, i};
+    pthread_create(&threads[i], NULL, worker_thread, &pool[i]);
+  }
+  for (int i = 0; i < workers; i++)
+    pthread_join(threads[i], NULL);
+  double elapsed = now_seconds() - start;
+
+  printf("Ran %d jobs (%d roms) on %d workers in %.2fs, %d failed.\n",
+         b->job_count, b->image_count, workers, elapsed, b->failed);
+
+  for (int i = 0; i < workers; i++) {
+    free(b->deques[i].jobs);
+    pthread_mutex_destroy(&b->deques[i].lock);
+  }
+  free(pool);
+  free(threads);
+  free(b->deques);
+  pthread_mutex_destroy(&b->output_lock);
+  return b->failed == 0;
+}
+
+u8 batch_run(const char *manifest_path, const char *results_path,
+             int workers) {
+  Batch b = {0};
+  u8 ok = read_manifest(&b, manifest_path);
+
+  if (ok) {
+    b.output = fopen(results_path, "w");
+    if (b.output == NULL) {
+      printf("Failed to open %s for the results.\n", results_path);
+      ok = 0;
+    }
+  }
+
+  if (ok)
+    ok = run_pool(&b, workers);
+
+  if (b.output)
+    fclose(b.output);
+  for (int i = 0; i < b.image_count; i++)
+    free(b.images[i].data);
+  free(b.images);
+  free(b.jobs);
+  return ok;
+}
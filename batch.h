@@ -0,0 +1,24 @@
+#pragma once
+
+#include "cpu.h"
+#include "defines.h"
+
+// the batch runner. a manifest lists jobs, one per line:
+//
+//   rom frames [movie]
+//
+// each job boots the rom, plays the movie if there is one, then runs with no
+// input until `frames` frames have gone by, and records the hash_machine of
+// where it ended up. blank lines and lines starting with # are skipped.
+//
+// every rom is read once and shared read-only by all the machines running it.
+// jobs are dealt out to one deque per worker, workers take from their own
+// deque and steal from the others when it runs dry, so a few long jobs don't
+// leave cores idle. results go out as one json object per line, as each job
+// finishes, so the order follows completion, not the manifest.
+
+#define BATCH_PATH_MAX 512
+
+// workers of 0 means one per core. 1 if every job ran to completion.
+u8 batch_run(const char *manifest_path, const char *results_path,
+             int workers);
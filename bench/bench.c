@@ -0,0 +1,826 @@
+// the benchmark suite. builds synthetic roms in memory, each one hammering
+// a different part of the core, runs them headless for a fixed number of
+// cycles and reports throughput over a few repetitions.
+//
+//   ./make.sh bench && ./nes_bench [cycles] [repetitions] [workload]
+//
+// ./nes_bench ops runs the per-opcode microbenchmarks instead, see
+// opbench.c. ./nes_bench lockstep [frames] runs every workload on a row of
+// machines, one at a time and then in lockstep, see lockstep.h.
+// ./nes_bench observe [frames] checks the observation stage against a slow
+// reference and times it, see observe.h.
+// ./nes_bench apu [frames] [reps] times frames with and without sound, see
+// apu.h. ./nes_bench resample [frames] [reps] times each resampler kernel
+// against the scalar one, see resample.h. ./nes_bench audio checks the
+// audio ring, its counters and the wav writer, see audio.h.
+
+#include "../apu.h"
+#include "../audio.h"
+#include "../cpu.h"
+#include "../lockstep.h"
+#include "../observe.h"
+#include "../resample.h"
+#include "../state.h"
+#include "bench.h"
+
+#include <math.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define PRG_SIZE 0x4000
+#define ROM_SIZE (0x10 + PRG_SIZE)
+
+/// THE ROM GENERATOR
+// a tiny assembler, just enough to lay out the loops below.
+typedef struct Gen {
+  u8 *rom;
+  u16 pc; // the cpu address we're emitting at.
+} Gen;
+
+static void emit(Gen *g, u8 byte) {
+  g->rom[0x10 + (g->pc++ - 0x8000)] = byte;
+}
+
+static void op(Gen *g, u8 opcode) { emit(g, opcode); }
+
+static void op8(Gen *g, u8 opcode, u8 operand) {
+  emit(g, opcode);
+  emit(g, operand);
+}
+
+static void op16(Gen *g, u8 opcode, u16 operand) {
+  emit(g, opcode);
+  emit(g, operand & 0xFF);
+  emit(g, operand >> 8);
+}
+
+// a branch back to target.
+static void branch(Gen *g, u8 opcode, u16 target) {
+  op8(g, opcode, (u8)(target - (g->pc + 2)));
+}
+
+static void header(u8 *rom) {
+  memset(rom, 0, ROM_SIZE);
+  rom[0] = 'N';
+  rom[1] = 'E';
+  rom[2] = 'S';
+  rom[3] = 0x1A;
+  rom[4] = 1; // 16kb of prg-rom.
+  rom[5] = 1;
+}
+
+// adds, logic and register shuffling, no memory traffic.
+static void gen_alu(Gen *g) {
+  u16 loop = g->pc;
+  op(g, 0x18);         // CLC
+  op8(g, 0x69, 3);     // ADC #3
+  op8(g, 0x49, 0x55);  // EOR #$55
+  op8(g, 0x29, 0xF7);  // AND #$F7
+  op8(g, 0x09, 0x10);  // ORA #$10
+  op(g, 0x0A);         // ASL A
+  op(g, 0x6A);         // ROR A
+  op(g, 0xAA);         // TAX
+  op(g, 0xE8);         // INX
+  op(g, 0x8A);         // TXA
+  op8(g, 0xE9, 1);     // SBC #1
+  op(g, 0x88);         // DEY
+  op16(g, 0x4C, loop); // JMP loop
+}
+
+// loads and stores through most of the addressing modes.
+static void gen_memory(Gen *g) {
+  op8(g, 0xA9, 0x00); // LDA #$00
+  op8(g, 0x85, 0x20); // STA $20
+  op8(g, 0xA9, 0x03); // LDA #$03
+  op8(g, 0x85, 0x21); // STA $21, ($20) points at $0300
+  op8(g, 0xA0, 0x00); // LDY #0
+  u16 loop = g->pc;
+  op16(g, 0xBD, 0x0200); // LDA $0200,X
+  op16(g, 0x7D, 0x0400); // ADC $0400,X
+  op16(g, 0x9D, 0x0500); // STA $0500,X
+  op8(g, 0xB1, 0x20);    // LDA ($20),Y
+  op8(g, 0x91, 0x20);    // STA ($20),Y
+  op8(g, 0xE6, 0x10);    // INC $10
+  op8(g, 0xA5, 0x10);    // LDA $10
+  op8(g, 0x95, 0x40);    // STA $40,X
+  op(g, 0xE8);           // INX
+  op(g, 0xC8);           // INY
+  branch(g, 0xD0, loop); // BNE loop
+  op16(g, 0x4C, loop);   // JMP loop
+}
+
+// a mix of taken and not taken branches on changing conditions.
+static void gen_branch(Gen *g) {
+  u16 loop = g->pc;
+  op(g, 0x8A);           // TXA
+  op8(g, 0x29, 0x01);    // AND #1
+  op8(g, 0xF0, 0x01);    // BEQ +1
+  op(g, 0xC8);           // INY
+  op(g, 0x8A);           // TXA
+  op8(g, 0x29, 0x02);    // AND #2
+  op8(g, 0xD0, 0x01);    // BNE +1
+  op(g, 0x88);           // DEY
+  op8(g, 0xE0, 0x80);    // CPX #$80
+  op8(g, 0x90, 0x01);    // BCC +1
+  op(g, 0xEA);           // NOP
+  op8(g, 0x30, 0x00);    // BMI +0
+  op(g, 0xE8);           // INX
+  branch(g, 0xD0, loop); // BNE loop
+  op16(g, 0x4C, loop);   // JMP loop
+}
+
+// subroutine calls and pushes and pulls.
+static void gen_stack(Gen *g) {
+  u16 loop = g->pc;
+  u16 sub = loop + 13;
+  op16(g, 0x20, sub);  // JSR sub
+  op(g, 0x48);         // PHA
+  op(g, 0x08);         // PHP
+  op(g, 0x28);         // PLP
+  op(g, 0x68);         // PLA
+  op(g, 0xCA);         // DEX
+  op16(g, 0x4C, loop); // JMP loop
+  op(g, 0xEA);         // NOP, padding up to sub
+  op(g, 0xEA);
+  // sub:
+  op16(g, 0x20, sub + 4); // JSR sub2
+  op(g, 0x60);            // RTS
+  // sub2:
+  op(g, 0x48); // PHA
+  op(g, 0x68); // PLA
+  op(g, 0x60); // RTS
+}
+
+// the pattern a vblank upload makes: set the ppu address, stream bytes at
+// $2007. there's no ppu yet, so this measures the register path.
+static void gen_ppu(Gen *g) {
+  u16 loop = g->pc;
+  op16(g, 0xAD, 0x2002); // LDA $2002
+  op8(g, 0xA9, 0x20);    // LDA #$20
+  op16(g, 0x8D, 0x2006); // STA $2006
+  op8(g, 0xA9, 0x00);    // LDA #$00
+  op16(g, 0x8D, 0x2006); // STA $2006
+  op8(g, 0xA2, 0x00);    // LDX #0
+  u16 inner = g->pc;
+  op16(g, 0x8E, 0x2007);  // STX $2007
+  op(g, 0xE8);            // INX
+  branch(g, 0xD0, inner); // BNE inner
+  op16(g, 0x4C, loop);    // JMP loop
+}
+
+// every channel going at once, and the alu loop underneath moving pulse 1's
+// pitch now and then. not in the table, it's for ./nes_bench apu.
+static void gen_apu(Gen *g) {
+  static const u16 writes[][2] = {
+      {0x4015, 0x0F}, {0x4000, 0xBF}, {0x4002, 0xFD}, {0x4003, 0x08},
+      {0x4004, 0x7F}, {0x4006, 0x7C}, {0x4007, 0x09}, {0x4008, 0xFF},
+      {0x400A, 0xC9}, {0x400B, 0x08}, {0x400C, 0x3F}, {0x400E, 0x04},
+      {0x400F, 0x08},
+  };
+  for (size_t i = 0; i < sizeof(writes) / sizeof(writes[0]); i++) {
+    op8(g, 0xA9, writes[i][1]);  // LDA #value
+    op16(g, 0x8D, writes[i][0]); // STA register
+  }
+
+  u16 loop = g->pc;
+  op(g, 0xE8);           // INX
+  op(g, 0x8A);           // TXA
+  op8(g, 0x69, 0x03);    // ADC #3
+  op(g, 0xC8);           // INY
+  branch(g, 0xD0, loop); // BNE loop
+  op16(g, 0x8E, 0x4002); // STX $4002
+  op16(g, 0x4C, loop);   // JMP loop
+}
+
+typedef struct Workload {
+  const char *name;
+  void (*generate)(Gen *g);
+} Workload;
+
+static const Workload workloads[] = {
+    {"alu", gen_alu},     {"memory", gen_memory}, {"branch", gen_branch},
+    {"stack", gen_stack}, {"ppu", gen_ppu},
+};
+
+#define WORKLOAD_COUNT (sizeof(workloads) / sizeof(workloads[0]))
+
+static void build_rom(const Workload *w, u8 *rom) {
+  header(rom);
+  Gen g = {rom, 0x8000};
+  w->generate(&g);
+}
+
+/// RUNNING
+static double now_seconds() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+typedef struct Result {
+  double seconds;
+  u64 instructions;
+  u64 cycles;
+} Result;
+
+static Result run_once(u8 *rom, u64 cycles) {
+  EmuState *state = make_emu_state();
+  load_rom(state, rom, ROM_SIZE);
+  CPUState *cs = state->cpu_state;
+  u64 instructions = 0;
+
+  double start = now_seconds();
+  while (cs->cycles < cycles && !cs->shutting_down) {
+    handle_instruction(state);
+    instructions++;
+  }
+  double elapsed = now_seconds() - start;
+
+  Result r = {elapsed, instructions, cs->cycles};
+  clean_emu_state(state);
+  return r;
+}
+
+static void stats(double *values, int count, double *mean, double *stddev) {
+  double sum = 0, squares = 0;
+  for (int i = 0; i < count; i++)
+    sum += values[i];
+  *mean = sum / count;
+  for (int i = 0; i < count; i++)
+    squares += (values[i] - *mean) * (values[i] - *mean);
+  *stddev = count > 1 ? sqrt(squares / (count - 1)) : 0;
+}
+
+/// LOCKSTEP
+// LOCKSTEP_WIDTH machines per workload, each started with a different X so
+// the branchy ones drift apart. hashes are kept for every machine and frame,
+// and the two runs have to agree on all of them.
+static double run_machines(EmuState **machines, int frames, u64 *hashes) {
+  double start = now_seconds();
+  for (int f = 0; f < frames; f++) {
+    for (int i = 0; i < LOCKSTEP_WIDTH; i++) {
+      cpu_run_frame(machines[i]);
+      hashes[f * LOCKSTEP_WIDTH + i] = hash_machine(machines[i]);
+    }
+  }
+  return now_seconds() - start;
+}
+
+static double run_lockstep(LockstepState *ls, int frames, u64 *hashes) {
+  double start = now_seconds();
+  for (int f = 0; f < frames; f++) {
+    lockstep_run_frame(ls);
+    for (int i = 0; i < LOCKSTEP_WIDTH; i++)
+      hashes[f * LOCKSTEP_WIDTH + i] = hash_machine(ls->machines[i]);
+  }
+  return now_seconds() - start;
+}
+
+// best of a few runs, the machines are made fresh for each.
+static double time_lockstep(u8 *rom, int frames, u8 lockstep, u64 *hashes,
+                            double *vector) {
+  EmuState *machines[LOCKSTEP_WIDTH];
+  for (int i = 0; i < LOCKSTEP_WIDTH; i++) {
+    machines[i] = make_emu_state();
+    load_rom(machines[i], rom, ROM_SIZE);
+    machines[i]->cpu_state->x = i * 37;
+  }
+
+  double seconds;
+  if (lockstep) {
+    LockstepState *ls = make_lockstep_state(machines, LOCKSTEP_WIDTH);
+    seconds = run_lockstep(ls, frames, hashes);
+    *vector = ls->vector_steps /
+              (double)(ls->vector_steps + ls->scalar_steps);
+    clean_lockstep_state(ls);
+  } else {
+    seconds = run_machines(machines, frames, hashes);
+  }
+
+  for (int i = 0; i < LOCKSTEP_WIDTH; i++)
+    clean_emu_state(machines[i]);
+  return seconds;
+}
+
+static int lockstep_main(int argc, char *argv[]) {
+  int frames = (argc > 1) ? atoi(argv[1]) : 600;
+  int repetitions = (argc > 2) ? atoi(argv[2]) : 3;
+  if (frames < 1)
+    frames = 1;
+  if (repetitions < 1)
+    repetitions = 1;
+
+  u8 *rom = (u8 *)malloc(ROM_SIZE);
+  u64 *expected = (u64 *)malloc(frames * LOCKSTEP_WIDTH * sizeof(u64));
+  u64 *got = (u64 *)malloc(frames * LOCKSTEP_WIDTH * sizeof(u64));
+  int mismatches = 0;
+
+  printf("%d frames on %d machines, best of %d.\n\n", frames, LOCKSTEP_WIDTH,
+         repetitions);
+  printf("%-8s %14s %14s %9s %9s\n", "workload", "alone fps", "lockstep fps",
+         "speedup", "vector");
+
+  for (size_t w = 0; w < WORKLOAD_COUNT; w++) {
+    build_rom(&workloads[w], rom);
+
+    double alone = INFINITY, lockstep = INFINITY, vector = 0;
+    for (int r = 0; r < repetitions; r++) {
+      alone = fmin(alone, time_lockstep(rom, frames, 0, expected, &vector));
+      lockstep = fmin(lockstep, time_lockstep(rom, frames, 1, got, &vector));
+    }
+
+    int bad = -1;
+    for (int i = 0; bad < 0 && i < frames * LOCKSTEP_WIDTH; i++)
+      if (expected[i] != got[i])
+        bad = i;
+
+    double total = frames * LOCKSTEP_WIDTH;
+    printf("%-8s %14.0f %14.0f %8.2fx %8.1f%%", workloads[w].name,
+           total / alone, total / lockstep, alone / lockstep, vector * 100);
+    if (bad >= 0) {
+      printf("  MISMATCH, machine %d frame %d", bad % LOCKSTEP_WIDTH,
+             bad / LOCKSTEP_WIDTH);
+      mismatches++;
+    }
+    printf("\n");
+  }
+
+  free(rom);
+  free(expected);
+  free(got);
+  return mismatches ? 1 : 0;
+}
+
+/// SOUND
+static double time_apu(u8 *rom, int frames, u8 sound) {
+  EmuState *state = make_emu_state();
+  load_rom(state, rom, ROM_SIZE);
+  AudioBuffer *audio = sound ? make_audio_buffer(48000) : NULL;
+  state->audio = audio;
+
+  double start = now_seconds();
+  for (int f = 0; f < frames; f++)
+    cpu_run_frame(state);
+  double elapsed = now_seconds() - start;
+
+  clean_emu_state(state);
+  if (audio)
+    clean_audio_buffer(audio);
+  return elapsed;
+}
+
+// the same frames twice, with the apu kept up to date either way but only
+// making samples the second time. the difference is what sound costs.
+static int apu_main(int argc, char *argv[]) {
+  int frames = (argc > 1) ? atoi(argv[1]) : 3000;
+  int repetitions = (argc > 2) ? atoi(argv[2]) : 5;
+  if (frames < 1)
+    frames = 1;
+  if (repetitions < 1)
+    repetitions = 1;
+
+  u8 *rom = (u8 *)malloc(ROM_SIZE);
+  header(rom);
+  Gen g = {rom, 0x8000};
+  gen_apu(&g);
+
+  // best of each, taking turns so drift in the machine's speed hits both.
+  double quiet = 1e30, sound = 1e30;
+  for (int r = 0; r < repetitions; r++) {
+    double q = time_apu(rom, frames, 0), s = time_apu(rom, frames, 1);
+    quiet = q < quiet ? q : quiet;
+    sound = s < sound ? s : sound;
+  }
+  printf("%d frames, best of %d.\n", frames, repetitions);
+  printf("silent  %8.1f us a frame\n", quiet / frames * 1e6);
+  printf("sound   %8.1f us a frame, %.1f%% of it making samples\n",
+         sound / frames * 1e6, (sound - quiet) / sound * 100);
+
+  free(rom);
+  return 0;
+}
+
+// the apu rom's sound at the synth rate, then through the resampler at
+// every quality with every kernel the cpu has, a frame's block at a time.
+// the vector kernels should come out within float rounding of the scalar.
+static int resample_main(int argc, char *argv[]) {
+  int frames = (argc > 1) ? atoi(argv[1]) : 3000;
+  int repetitions = (argc > 2) ? atoi(argv[2]) : 5;
+  if (frames < 1)
+    frames = 1;
+  if (repetitions < 1)
+    repetitions = 1;
+
+  u8 *rom = (u8 *)malloc(ROM_SIZE);
+  header(rom);
+  Gen g = {rom, 0x8000};
+  gen_apu(&g);
+
+  EmuState *state = make_emu_state();
+  load_rom(state, rom, ROM_SIZE);
+  state->audio = make_audio_buffer(96000);
+  u32 *counts = (u32 *)malloc(frames * sizeof(u32));
+  float *input = (float *)malloc((size_t)frames * AUDIO_MAX_SAMPLES *
+                                 sizeof(float));
+  u64 total = 0;
+  for (int f = 0; f < frames; f++) {
+    cpu_run_frame(state);
+    counts[f] = state->audio->count;
+    memcpy(input + total, state->audio->samples, counts[f] * sizeof(float));
+    total += counts[f];
+  }
+  clean_audio_buffer(state->audio);
+  state->audio = NULL;
+  clean_emu_state(state);
+
+  float *expected = (float *)malloc(total * sizeof(float));
+  float *got = (float *)malloc(total * sizeof(float));
+  static const char *qualities[] = {"low", "medium", "high"};
+  static const char *kernels[] = {"scalar", "sse", "avx2"};
+  int mismatches = 0;
+
+  printf("%d frames, %llu samples at 96khz to 48khz, best of %d.\n", frames,
+         (unsigned long long)total, repetitions);
+  printf("quality  kernel      us/frame   Msamples/s   max error\n");
+  for (int q = ResampleLow; q <= ResampleHigh; q++) {
+    double scalar = 0;
+    for (int k = ResampleScalar; k <= ResampleAvx2; k++) {
+      float *out = k == ResampleScalar ? expected : got;
+      double best = 1e30;
+      u64 made = 0;
+      u8 runs = 1;
+      for (int r = 0; runs && r < repetitions; r++) {
+        Resampler *rs = make_resampler(96000, 48000, (ResampleQuality)q);
+        runs = resample_set_kernel(rs, (ResampleKernel)k);
+        made = 0;
+        u64 at = 0;
+        double start = now_seconds();
+        for (int f = 0; runs && f < frames; f++) {
+          made += resample_block(rs, input + at, counts[f], out + made,
+                                 total - made);
+          at += counts[f];
+        }
+        double elapsed = now_seconds() - start;
+        best = elapsed < best ? elapsed : best;
+        clean_resampler(rs);
+      }
+      if (!runs) {
+        printf("%-8s %-8s  not on this cpu\n", qualities[q], kernels[k]);
+        continue;
+      }
+
+      double error = 0;
+      for (u64 i = 0; k != ResampleScalar && i < made; i++) {
+        double e = fabs(got[i] - expected[i]);
+        error = e > error ? e : error;
+      }
+      if (k == ResampleScalar)
+        scalar = best;
+      printf("%-8s %-8s %10.2f %12.1f %11.2e  %.2fx", qualities[q],
+             kernels[k], best / frames * 1e6, total / best / 1e6, error,
+             scalar / best);
+      if (error > 1e-5) {
+        printf("  MISMATCH");
+        mismatches++;
+      }
+      printf("\n");
+    }
+  }
+
+  free(rom);
+  free(counts);
+  free(input);
+  free(expected);
+  free(got);
+  return mismatches ? 1 : 0;
+}
+
+/// THE AUDIO RING
+// the ring's contents are a count, so anything lost, doubled or out of
+// order shows. exact in a float up to 2^24.
+#define RING_SAMPLES (1 << 22)
+
+typedef struct RingCheck {
+  AudioRing *ring;
+  u64 wrong; // samples the consumer didn't expect.
+} RingCheck;
+
+static void *ring_consumer(void *arg) {
+  RingCheck *check = (RingCheck *)arg;
+  float out[AUDIO_PERIOD * 3];
+  u32 next = 0, size = 1;
+  while (next < RING_SAMPLES) {
+    size = size * 7 % (AUDIO_PERIOD * 3) + 1; // all over the place.
+    u32 got = audio_ring_pop(check->ring, out, size);
+    if (got == 0)
+      sched_yield(); // on one core the producer can't fill it otherwise.
+    for (u32 i = 0; i < got; i++)
+      check->wrong += out[i] != (float)next++;
+  }
+  return NULL;
+}
+
+static u16 get16(const u8 *bytes) { return bytes[0] | bytes[1] << 8; }
+static u32 get32(const u8 *bytes) {
+  return get16(bytes) | (u32)get16(bytes + 2) << 16;
+}
+
+// the ring on its own, then a whole null backend for the counters, then a
+// wav out and back in. nothing here is timed, it's pass or fail.
+static int audio_main() {
+  int failures = 0;
+  AudioRing *ring = (AudioRing *)aligned_alloc(64, sizeof(AudioRing));
+  float *in = (float *)malloc(AUDIO_RING_SIZE * 2 * sizeof(float));
+  float *out = (float *)malloc(AUDIO_RING_SIZE * 2 * sizeof(float));
+
+  // one thread: full and empty come back short, and odd sizes wrap.
+  audio_ring_reset(ring);
+  for (int i = 0; i < AUDIO_RING_SIZE * 2; i++)
+    in[i] = i;
+  u8 ok = audio_ring_pop(ring, out, 10) == 0;
+  ok = ok && audio_ring_push(ring, in, AUDIO_RING_SIZE + 5) == AUDIO_RING_SIZE;
+  ok = ok && audio_ring_fill(ring) == AUDIO_RING_SIZE;
+  ok = ok && audio_ring_push(ring, in, 1) == 0;
+  ok = ok && audio_ring_pop(ring, out, AUDIO_RING_SIZE * 2) == AUDIO_RING_SIZE;
+  ok = ok && memcmp(in, out, AUDIO_RING_SIZE * sizeof(float)) == 0;
+  u32 at = 0;
+  for (int round = 0; ok && round < 1000; round++) {
+    u32 size = (round * 997) % (AUDIO_RING_SIZE - 1) + 1;
+    ok = audio_ring_push(ring, in + at % AUDIO_RING_SIZE, size) == size;
+    ok = ok && audio_ring_pop(ring, out, size) == size;
+    ok = ok && memcmp(in + at % AUDIO_RING_SIZE, out,
+                      size * sizeof(float)) == 0;
+    at += size;
+  }
+  ok = ok && audio_ring_fill(ring) == 0;
+  printf("ring, one thread:       %s\n", ok ? "ok" : "FAILED");
+  failures += !ok;
+
+  // two threads, the producer as fast as it can go. on one core it fills
+  // the ring right up between turns, so start it off the ring's edge or
+  // every fill would line up with it and never wrap partway.
+  audio_ring_reset(ring);
+  audio_ring_push(ring, in, 1000);
+  audio_ring_pop(ring, out, 1000);
+  RingCheck check = {ring, 0};
+  pthread_t consumer;
+  pthread_create(&consumer, NULL, ring_consumer, &check);
+  float chunk[AUDIO_MAX_SAMPLES];
+  u32 next = 0, size = 1;
+  while (next < RING_SAMPLES) {
+    size = size * 5 % AUDIO_MAX_SAMPLES + 1;
+    if (size > RING_SAMPLES - next)
+      size = RING_SAMPLES - next;
+    for (u32 i = 0; i < size; i++)
+      chunk[i] = next + i;
+    u32 pushed = audio_ring_push(ring, chunk, size); // the rest goes again.
+    if (pushed == 0)
+      sched_yield();
+    next += pushed;
+  }
+  pthread_join(consumer, NULL);
+  ok = check.wrong == 0 && audio_ring_fill(ring) == 0;
+  printf("ring, two threads:      %s, %d samples through\n",
+         ok ? "ok" : "FAILED", RING_SAMPLES);
+  failures += !ok;
+
+  // the null backend, flooded and then starved. the apu rom makes sound,
+  // run unpaced it overruns the ring within a few frames. left alone after,
+  // the device drains it and then comes up short.
+  u8 *rom = (u8 *)malloc(ROM_SIZE);
+  header(rom);
+  Gen g = {rom, 0x8000};
+  gen_apu(&g);
+  EmuState *state = make_emu_state();
+  load_rom(state, rom, ROM_SIZE);
+  ok = audio_init("null", state);
+  for (int f = 0; ok && f < 100; f++) {
+    cpu_run_frame(state);
+    audio_update(state);
+  }
+  struct timespec wait = {0, 500000000}; // ~3 rings' worth.
+  nanosleep(&wait, NULL);
+  if (ok) {
+    AudioState *as = audio_state;
+    ok = as->overruns > 0 && as->dropped > 0 && as->underruns > 0 &&
+         as->padded > 0 && as->padded <= as->underruns * AUDIO_PERIOD &&
+         as->played >= AUDIO_RING_SIZE && audio_ring_fill(as->ring) == 0;
+    printf("counters, null device:  %s, ", ok ? "ok" : "FAILED");
+    audio_report();
+    audio_clean(state);
+  }
+  failures += !ok;
+  clean_emu_state(state);
+  free(rom);
+
+  // a wav out and back. more than wav_write's chunk, and past full scale
+  // both ways so it clips.
+  const char *path = "nes_bench_audio.wav";
+  u32 count = 3000;
+  for (u32 i = 0; i < count; i++)
+    in[i] = sinf(i * 0.01f) * 1.25f;
+  WavFile *wav = wav_open(path, AUDIO_SAMPLE_RATE);
+  ok = wav != NULL;
+  if (ok) {
+    wav_write(wav, in, 1000);
+    wav_write(wav, in + 1000, count - 1000);
+    ok = wav_close(wav);
+  }
+  u8 *file = (u8 *)malloc(44 + count * 2 + 1);
+  FILE *f = ok ? fopen(path, "rb") : NULL;
+  ok = f != NULL && fread(file, 1, 44 + count * 2 + 1, f) == 44 + count * 2;
+  if (f)
+    fclose(f);
+  remove(path);
+
+  u32 data = count * 2;
+  ok = ok && memcmp(file, "RIFF", 4) == 0 && get32(file + 4) == 36 + data;
+  ok = ok && memcmp(file + 8, "WAVEfmt ", 8) == 0 && get32(file + 16) == 16;
+  ok = ok && get16(file + 20) == 1 && get16(file + 22) == 1; // pcm, mono.
+  ok = ok && get32(file + 24) == AUDIO_SAMPLE_RATE;
+  ok = ok && get32(file + 28) == AUDIO_SAMPLE_RATE * 2;
+  ok = ok && get16(file + 32) == 2 && get16(file + 34) == 16;
+  ok = ok && memcmp(file + 36, "data", 4) == 0 && get32(file + 40) == data;
+  for (u32 i = 0; ok && i < count; i++) {
+    float s = in[i] * 32767;
+    int expect = s > 32767 ? 32767 : s < -32768 ? -32768 : (int)s;
+    ok = (int16_t)get16(file + 44 + i * 2) == expect;
+  }
+  printf("wav, out and back:      %s, %u samples\n", ok ? "ok" : "FAILED",
+         count);
+  failures += !ok;
+
+  free(file);
+  free(in);
+  free(out);
+  free(ring);
+  return failures ? 1 : 0;
+}
+
+/// OBSERVATIONS
+// how much of source pixel s output pixel o covers, in the units make_taps
+// uses. worked out again here rather than trusting its tables.
+static u32 overlap(int o, int s, int outputs, int sources) {
+  int from = o * sources > s * outputs ? o * sources : s * outputs;
+  int to = (o + 1) * sources < (s + 1) * outputs ? (o + 1) * sources
+                                                 : (s + 1) * outputs;
+  return to > from ? to - from : 0;
+}
+
+// the observation the slow way: the palette straight from the table, the
+// max with the frame before (none for the first), and every output the
+// area weighted average of everything it covers, rounded.
+static void observe_reference(const u8 *palette, const u8 *frame,
+                              const u8 *before, u8 *luma, u8 *out) {
+  for (int i = 0; i < FRAME_WIDTH * FRAME_HEIGHT; i++)
+    luma[i] = palette[frame[i] & 0x3F];
+  if (before == NULL)
+    before = luma;
+
+  for (int y = 0; y < OBSERVE_HEIGHT; y++)
+    for (int x = 0; x < OBSERVE_WIDTH; x++) {
+      u64 total = 0;
+      int top = y * FRAME_HEIGHT / OBSERVE_HEIGHT;
+      int left = x * FRAME_WIDTH / OBSERVE_WIDTH;
+      for (int sy = top; sy <= top + 3 && sy < FRAME_HEIGHT; sy++)
+        for (int sx = left; sx <= left + 4 && sx < FRAME_WIDTH; sx++) {
+          int i = sy * FRAME_WIDTH + sx;
+          u8 pixel = luma[i] > before[i] ? luma[i] : before[i];
+          total += (u64)overlap(y, sy, OBSERVE_HEIGHT, FRAME_HEIGHT) *
+                   overlap(x, sx, OBSERVE_WIDTH, FRAME_WIDTH) * pixel;
+        }
+      const u64 area = FRAME_WIDTH * FRAME_HEIGHT;
+      out[y * OBSERVE_WIDTH + x] = (total + area / 2) / area;
+    }
+}
+
+// there's no ppu to make frames, so it's noise, which is the worst case for
+// nothing at all. palette lookups cost the same whatever the picture. both
+// palette paths are checked against the reference first, on noise with the
+// emphasis bits set as well, then timed.
+static int observe_main(int argc, char *argv[]) {
+  int frames = (argc > 1) ? atoi(argv[1]) : 2000;
+  if (frames < 1)
+    frames = 1;
+  const int size = FRAME_WIDTH * FRAME_HEIGHT;
+  const int observation = OBSERVE_WIDTH * OBSERVE_HEIGHT;
+
+  u8 *noise = (u8 *)malloc(2 * size);
+  u8 *stack = (u8 *)malloc(OBSERVE_SIZE);
+  u8 *luma = (u8 *)malloc(2 * size);
+  u8 *expected = (u8 *)malloc(observation);
+  ObserveState *paths[2] = {make_observe_state(), make_observe_state()};
+  paths[0]->ssse3 = 0;
+  static const char *names[2] = {"scalar", "ssse3"};
+
+  int wrong[2] = {0};
+  for (int f = 0; f < 16; f++) {
+    u8 *frame = noise + (f & 1) * size;
+    for (int i = 0; i < size; i++)
+      frame[i] = rand();
+    observe_reference(paths[0]->palette, frame,
+                      f ? luma + ((f - 1) & 1) * size : NULL,
+                      luma + (f & 1) * size, expected);
+    for (int p = 0; p < 2; p++) {
+      observe_push(paths[p], frame);
+      observe_stack(paths[p], stack);
+      if (memcmp(stack + OBSERVE_SIZE - observation, expected, observation))
+        wrong[p]++;
+    }
+  }
+
+  for (int i = 0; i < 2 * size; i++)
+    noise[i] = rand() & 0x3F;
+  int mismatches = 0;
+  for (int p = 0; p < 2; p++) {
+    if (p == 1 && !paths[1]->ssse3) {
+      printf("%-7s not on this cpu\n", names[p]);
+      continue;
+    }
+    double start = now_seconds();
+    for (int f = 0; f < frames; f++) {
+      observe_push(paths[p], noise + (f & 1) * size);
+      observe_stack(paths[p], stack);
+    }
+    double elapsed = now_seconds() - start;
+
+    printf("%-7s %d observations, %.1f us each (%.0f/s)", names[p], frames,
+           elapsed / frames * 1e6, frames / elapsed);
+    if (wrong[p]) {
+      printf("  MISMATCH, %d of 16 against the reference", wrong[p]);
+      mismatches++;
+    }
+    printf("\n");
+  }
+
+  clean_observe_state(paths[0]);
+  clean_observe_state(paths[1]);
+  free(expected);
+  free(luma);
+  free(stack);
+  free(noise);
+  return mismatches ? 1 : 0;
+}
+
+int main(int argc, char *argv[]) {
+  if (argc > 1 && strcmp(argv[1], "ops") == 0)
+    return opbench_main(argc - 1, argv + 1);
+  if (argc > 1 && strcmp(argv[1], "lockstep") == 0)
+    return lockstep_main(argc - 1, argv + 1);
+  if (argc > 1 && strcmp(argv[1], "observe") == 0)
+    return observe_main(argc - 1, argv + 1);
+  if (argc > 1 && strcmp(argv[1], "apu") == 0)
+    return apu_main(argc - 1, argv + 1);
+  if (argc > 1 && strcmp(argv[1], "resample") == 0)
+    return resample_main(argc - 1, argv + 1);
+  if (argc > 1 && strcmp(argv[1], "audio") == 0)
+    return audio_main();
+
+  u64 cycles = (argc > 1) ? strtoull(argv[1], NULL, 0) : 50000000;
+  int repetitions = (argc > 2) ? atoi(argv[2]) : 5;
+  const char *only = (argc > 3) ? argv[3] : NULL;
+
+  if (repetitions < 1)
+    repetitions = 1;
+
+  u8 *rom = (u8 *)malloc(ROM_SIZE);
+  double *mips = (double *)malloc(repetitions * sizeof(double));
+  double *mcps = (double *)malloc(repetitions * sizeof(double));
+  double *fps = (double *)malloc(repetitions * sizeof(double));
+
+  printf("%llu cycles per run, %d runs each.\n\n",
+         (unsigned long long)cycles, repetitions);
+  printf("%-8s %18s %18s %20s\n", "workload", "Minstr/s", "Mcycles/s",
+         "frames/s");
+
+  for (size_t w = 0; w < WORKLOAD_COUNT; w++) {
+    if (only != NULL && strcmp(only, workloads[w].name) != 0)
+      continue;
+
+    build_rom(&workloads[w], rom);
+
+    for (int r = 0; r < repetitions; r++) {
+      Result result = run_once(rom, cycles);
+      mips[r] = result.instructions / result.seconds / 1e6;
+      mcps[r] = result.cycles / result.seconds / 1e6;
+      fps[r] = result.cycles / (double)CYCLES_PER_FRAME / result.seconds;
+    }
+
+    double m1, s1, m2, s2, m3, s3;
+    stats(mips, repetitions, &m1, &s1);
+    stats(mcps, repetitions, &m2, &s2);
+    stats(fps, repetitions, &m3, &s3);
+    printf("%-8s %10.2f +- %5.2f %10.2f +- %5.2f %12.0f +- %5.0f\n",
+           workloads[w].name, m1, s1, m2, s2, m3, s3);
+  }
+
+  free(rom);
+  free(mips);
+  free(mcps);
+  free(fps);
+  return 0;
+}
@@ -0,0 +1,4 @@
+#pragma once
+
+// the per-opcode microbenchmarks, ./nes_bench ops.
+int opbench_main(int argc, char *argv[]);
@@ -0,0 +1,176 @@
+// per-opcode microbenchmarks. every entry of instruction_table gets run in a
+// tight loop on its own, with the hardware counters read around it through
+// perf_event_open, and the lot comes out as csv. where the counters aren't
+// allowed (containers, perf_event_paranoid), the columns are left empty and
+// only the timing is reported.
+//
+//   ./nes_bench ops [iterations] > ops.csv
+
+#include "../cpu.h"
+#include "bench.h"
+
+#include <linux/perf_event.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+#define COUNTER_COUNT 4
+#define CODE_ADDRESS 0x0600 // where each instruction under test sits.
+
+static const char *counter_names[COUNTER_COUNT] = {
+    "cycles", "instructions", "branch_misses", "l1d_misses"};
+
+static const char *mode_names[] = {
+    "implied", "immediate", "abs",        "abs_x",       "abs_y",
+    "zp",      "zp_x",      "zp_y",       "relative",    "indexed_indirect",
+    "indirect_indexed",     "accumulator", "indirect",
+};
+
+typedef struct Counters {
+  int fds[COUNTER_COUNT]; // fds[0] leads the group, -1 if unavailable.
+} Counters;
+
+static int open_counter(u32 type, u64 config, int group) {
+  struct perf_event_attr attr;
+  memset(&attr, 0, sizeof(attr));
+  attr.size = sizeof(attr);
+  attr.type = type;
+  attr.config = config;
+  attr.disabled = (group == -1); // the leader starts the whole group.
+  attr.exclude_kernel = 1;
+  attr.exclude_hv = 1;
+  attr.read_format = PERF_FORMAT_GROUP;
+  return syscall(SYS_perf_event_open, &attr, 0, -1, group, 0);
+}
+
+static u8 open_counters(Counters *c) {
+  c->fds[0] = open_counter(PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES, -1);
+  if (c->fds[0] < 0) {
+    for (int i = 1; i < COUNTER_COUNT; i++)
+      c->fds[i] = -1;
+    return 0;
+  }
+
+  c->fds[1] = open_counter(PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS,
+                           c->fds[0]);
+  c->fds[2] = open_counter(PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES,
+                           c->fds[0]);
+  c->fds[3] = open_counter(PERF_TYPE_HW_CACHE,
+                           PERF_COUNT_HW_CACHE_L1D |
+                               (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+                               (PERF_COUNT_HW_CACHE_RESULT_MISS << 16),
+                           c->fds[0]);
+  return 1;
+}
+
+static void close_counters(Counters *c) {
+  for (int i = 0; i < COUNTER_COUNT; i++)
+    if (c->fds[i] >= 0)
+      close(c->fds[i]);
+}
+
+// read the group into values, in the order the counters were opened. the
+// ones that failed to open are left at -1.
+static void read_counters(Counters *c, long long *values) {
+  for (int i = 0; i < COUNTER_COUNT; i++)
+    values[i] = -1;
+  if (c->fds[0] < 0)
+    return;
+
+  u64 buffer[1 + COUNTER_COUNT];
+  if (read(c->fds[0], buffer, sizeof(buffer)) < (ssize_t)sizeof(u64))
+    return;
+
+  // the group only has the members that opened, in order.
+  u64 index = 0;
+  for (int i = 0; i < COUNTER_COUNT && index < buffer[0]; i++)
+    if (c->fds[i] >= 0)
+      values[i] = buffer[1 + index++];
+}
+
+static double now_seconds() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// a machine with the opcode at CODE_ADDRESS, operands pointing somewhere
+// harmless in work ram.
+static void place(EmuState *state, u8 opcode) {
+  for (int page = 0; page < PAGE_COUNT; page++)
+    memset(page_for_write(state, page), 0, PAGE_SIZE);
+  poke(state, CODE_ADDRESS, opcode);
+  poke(state, CODE_ADDRESS + 1, 0x10);
+  poke(state, CODE_ADDRESS + 2, 0x02); // abs operands land on $0210.
+  poke(state, 0x10, 0x00);             // and zp pointers on $0300.
+  poke(state, 0x11, 0x03);
+}
+
+// run the opcode iterations times. pc goes back every time, so branches,
+// jumps and returns all just run the one instruction over and over.
+static void run(EmuState *state, u64 iterations) {
+  CPUState *cs = state->cpu_state;
+  for (u64 i = 0; i < iterations; i++) {
+    cs->pc = CODE_ADDRESS;
+    handle_instruction(state);
+  }
+}
+
+int opbench_main(int argc, char *argv[]) {
+  u64 iterations = (argc > 1) ? strtoull(argv[1], NULL, 0) : 1000000;
+
+  EmuState *state = make_emu_state(); // no rom, place() fills ram in.
+
+  Counters counters;
+  u8 have_counters = open_counters(&counters);
+  if (!have_counters)
+    fprintf(stderr, "perf_event_open isn't available here, only timing "
+                    "will be reported.\n");
+
+  printf("opcode,name,mode,ns_per_op");
+  for (int i = 0; i < COUNTER_COUNT; i++)
+    printf(",%s_per_op", counter_names[i]);
+  printf("\n");
+
+  for (int opcode = 0; opcode < 256; opcode++) {
+    const Instruction *inst = &instruction_table[opcode];
+    if (inst->function == NULL || opcode == 0xFF) // 0xFF is our debug print.
+      continue;
+
+    place(state, opcode);
+    run(state, iterations / 10); // warm up the caches and predictors.
+
+    long long before[COUNTER_COUNT], after[COUNTER_COUNT];
+    if (have_counters) {
+      ioctl(counters.fds[0], PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+      read_counters(&counters, before);
+    }
+
+    double start = now_seconds();
+    run(state, iterations);
+    double elapsed = now_seconds() - start;
+
+    if (have_counters) {
+      read_counters(&counters, after);
+      ioctl(counters.fds[0], PERF_EVENT_IOC_DISABLE, PERF_IOC_FLAG_GROUP);
+    }
+
+    printf("%02X,%s,%s,%.3f", opcode, inst->name, mode_names[inst->mode],
+           elapsed * 1e9 / iterations);
+    for (int i = 0; i < COUNTER_COUNT; i++) {
+      if (have_counters && before[i] >= 0 && after[i] >= 0)
+        printf(",%.3f", (double)(after[i] - before[i]) / iterations);
+      else
+        printf(",");
+    }
+    printf("\n");
+  }
+
+  close_counters(&counters);
+  clean_emu_state(state);
+  return 0;
+}
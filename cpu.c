@@ -1,34 +1,100 @@
 #include "cpu.h"
+#include "nsf.h"
+#include "profile.h"
+#include "trace.h"
 #include "util.h"
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
 CPUState *make_cpu_state() {
   CPUState *state = (CPUState *)malloc(sizeof(CPUState));
 
   state->pc = 0; // to be read from the reset vector, when that gets setup.
+  state->sp = 0xFD; // where the reset sequence leaves it.
   state->a = 0;
   state->x = 0;
   state->y = 0;
   state->status = 0b00100000; // flip the unused bit? does it matter?
 
   state->shutting_down = 0;
+  state->cycles = 0;
 
   return state;
 }
 
-void clean_cpu_state(CPUState *state) {}
+void clean_cpu_state(CPUState *state) { free(state); }
+
+static Page *make_page() {
+  // zeroed, so two machines booted from the same rom hash the same.
+  Page *page = (Page *)calloc(1, sizeof(Page));
+  atomic_init(&page->refs, 1);
+  return page;
+}
+
+static void release_page(Page *page) {
+  if (atomic_fetch_sub_explicit(&page->refs, 1, memory_order_acq_rel) == 1)
+    free(page);
+}
 
 EmuState *make_emu_state() {
   EmuState *state = (EmuState *)malloc(sizeof(EmuState));
   state->cpu_state = make_cpu_state();
-  state->ram = (u8 *)malloc(0xFFFF);
+  for (int i = 0; i < PAGE_COUNT; i++)
+    state->pages[i] = make_page();
   state->rom = NULL;
+  state->rom_size = 0;
+  memset(state->dirty, 0, sizeof(state->dirty));
+  memset(state->shared, 0, sizeof(state->shared));
+  // nothing's been hashed yet.
+  memset(state->unhashed, 0xFF, sizeof(state->unhashed));
+  memset(state->page_hashes, 0, sizeof(state->page_hashes));
+  state->ram_hash = 0;
+  memset(&state->input, 0, sizeof(InputState));
+  apu_reset(&state->apu);
+  state->audio = NULL;
+  state->nsf = NULL;
   return state;
 }
 
-void clean_emu_state(EmuState *state) { clean_cpu_state(state->cpu_state); }
+void clean_emu_state(EmuState *state) {
+  clean_cpu_state(state->cpu_state);
+  for (int i = 0; i < PAGE_COUNT; i++)
+    release_page(state->pages[i]);
+  free(state);
+}
+
+EmuState *clone_instance(EmuState *state) {
+  for (int i = 0; i < PAGE_COUNT; i++)
+    atomic_fetch_add_explicit(&state->pages[i]->refs, 1, memory_order_relaxed);
+  memset(state->shared, 0xFF, sizeof(state->shared));
+
+  EmuState *clone = (EmuState *)malloc(sizeof(EmuState));
+  memcpy(clone, state, sizeof(EmuState));
+
+  clone->cpu_state = (CPUState *)malloc(sizeof(CPUState));
+  memcpy(clone->cpu_state, state->cpu_state, sizeof(CPUState));
+  clone->audio = NULL;
+  return clone;
+}
+
+u8 *page_for_write(EmuState *state, u8 index) {
+  Page *page = state->pages[index];
+  state->unhashed[index >> 6] |= (u64)1 << (index & 63);
+  state->shared[index >> 6] &= ~((u64)1 << (index & 63));
+  // everyone else may have let go of it already.
+  if (atomic_load_explicit(&page->refs, memory_order_acquire) == 1)
+    return page->data;
+
+  // shared, take our own copy and let go of theirs.
+  Page *copy = (Page *)malloc(sizeof(Page));
+  atomic_init(&copy->refs, 1);
+  memcpy(copy->data, page->data, PAGE_SIZE);
+  state->pages[index] = copy;
+  release_page(page);
+  return copy->data;
+}
 
 void debug_print(EmuState *state) {
   if (state == NULL) {
@@ -53,8 +119,8 @@ void debug_print(EmuState *state) {
   }
 
   // Print RAM and ROM info
-  if (state->ram != NULL) {
-    printf("  RAM: %p\n", state->ram); // %p formats a pointer
+  if (state->pages[0] != NULL) {
+    printf("  RAM: %p\n", state->pages[0]); // %p formats a pointer
   } else {
     printf("  RAM is NULL\n");
   }
@@ -69,6 +135,58 @@ void debug_print(EmuState *state) {
   printf("  CHR size: %u * 8kb\n", state->chr_size);
 }
 
+void poke_shared(EmuState *state, u16 address, u8 value) {
+  page_for_write(state, address >> 8)[address & 0xFF] = value;
+}
+
+/// CONTROLLERS
+static u8 read_controller(InputState *input, int port) {
+  if (input->strobe) // still latching, we only ever see the A button.
+    return 0x40 | (input->buttons[port] & 1);
+
+  u8 bit = input->shift[port] & 1;
+  // ones shift in from the top, so reads past the 8th return 1.
+  input->shift[port] = (input->shift[port] >> 1) | 0x80;
+  return 0x40 | bit; // the upper bits are open bus, usually $40.
+}
+
+static void write_controller_strobe(InputState *input, u8 value) {
+  input->strobe = value & 1;
+  if (input->strobe) {
+    input->shift[0] = input->buttons[0];
+    input->shift[1] = input->buttons[1];
+  }
+}
+
+/// BUS
+u8 read_byte(EmuState *state, u16 address) {
+  if (address < 0x2000) // the 2kb of work ram is mirrored four times.
+    address &= 0x07FF;
+  else if (address == 0x4016 || address == 0x4017)
+    return read_controller(&state->input, address - 0x4016);
+  else if (address == 0x4015)
+    return apu_read_status(state);
+
+  return peek(state, address);
+}
+
+void write_byte(EmuState *state, u16 address, u8 value) {
+  if (address < 0x2000)
+    address &= 0x07FF;
+  else if (address >= 0x8000) // prg-rom, and there's no mapper to talk to.
+    return;
+  else if (address == 0x4016)
+    write_controller_strobe(&state->input, value);
+  else if ((address >= 0x4000 && address <= 0x4013) || address == 0x4015 ||
+           address == 0x4017)
+    apu_write(state, address, value);
+  else if (address >= 0x5FF8 && address <= 0x5FFF && state->nsf)
+    nsf_switch_bank(state, address - 0x5FF8, value);
+
+  state->dirty[address >> 14] |= (u64)1 << ((address >> 8) & 63);
+  poke(state, address, value);
+}
+
 /// STATUS HELPERS
 // flip the passed statusbit
 void toggle_status(CPUState *cs, StatusBit s) {
@@ -94,7 +212,10 @@ u8 is_set(u8 which_bit, u8 byte) {
 
 // set zero if the target is zero,
 // and set negative if bit 7 (leftmost) of target is set.
+// both get cleared otherwise, they always describe the last result.
 void neg_and_zero(CPUState *cs, u8 target) {
+  cs->status &= ~(Zero | Negative);
+
   if (target == 0) // if the byte is zero...
     set_status(cs, Zero);
 
@@ -102,70 +223,214 @@ void neg_and_zero(CPUState *cs, u8 target) {
     set_status(cs, Negative);
 }
 
+// set or clear a flag from a condition.
+void put_status(CPUState *cs, StatusBit s, u8 condition) {
+  if (condition)
+    set_status(cs, s);
+  else
+    unset_status(cs, s);
+}
+
 // so it has come to this
 #define CS state->cpu_state
 #define PC state->cpu_state->pc
-#define SP state->cpu_state->csp
+#define SP state->cpu_state->sp
 #define A state->cpu_state->a
 #define X state->cpu_state->x
 #define Y state->cpu_state->y
 #define STATUS state->cpu_state->status
 
+/// STACK HELPERS
+// the stack lives in page one, growing down.
+void push(EmuState *state, u8 value) {
+  write_byte(state, 0x0100 | SP, value);
+  SP--;
+}
+
+u8 pull(EmuState *state) {
+  SP++;
+  return read_byte(state, 0x0100 | SP);
+}
+
+void push16(EmuState *state, u16 value) {
+  push(state, value >> 8);
+  push(state, value & 0xFF);
+}
+
+u16 pull16(EmuState *state) {
+  u16 lo = pull(state);
+  return lo | (pull(state) << 8);
+}
+
+// the operand of a read instruction. indexed reads that cross a page take
+// an extra cycle, stores and read-modify-writes always pay it up front.
+u8 read_operand(EmuState *state, Args *args) {
+  CS->cycles += args->page_crossed;
+  return read_byte(state, args->address);
+}
+
+// branches take a cycle when taken, and another if they land on a new page.
+void branch_if(EmuState *state, Args *args, u8 condition) {
+  if (!condition)
+    return;
+  CS->cycles += 1 + ((PC & 0xFF00) != (args->address & 0xFF00));
+  PC = args->address;
+}
+
+void compare(EmuState *state, u8 reg, u8 value) {
+  put_status(CS, Carry, reg >= value);
+  neg_and_zero(CS, reg - value);
+}
+
+// sbc is adc with the operand inverted, there's no decimal mode on the nes.
+void add_with_carry(EmuState *state, u8 value) {
+  u16 sum = A + value + is_status_set(Carry, CS);
+  put_status(CS, Carry, sum > 0xFF);
+  // overflow if both inputs have the same sign and the result doesn't.
+  put_status(CS, Overflow, (~(A ^ value) & (A ^ sum) & 0x80) != 0);
+  A = (u8)sum;
+  neg_and_zero(CS, A);
+}
+
+// the shifts and rotates either work on A or on memory.
+u8 modify_read(EmuState *state, Args *args) {
+  return (args->mode == Accumulator) ? A : read_byte(state, args->address);
+}
+
+void modify_write(EmuState *state, Args *args, u8 value) {
+  if (args->mode == Accumulator)
+    A = value;
+  else
+    write_byte(state, args->address, value);
+  neg_and_zero(CS, value);
+}
+
 // helper for defining the function headers.
 #define INST(name) void name(EmuState *state, Args *args)
 
 // logic functions.
 // CPU instructions.
-INST(adc) {}
-INST(and) {}
-INST(asl) {}
-INST(bcc) {}
-INST(bcs) {}
-INST(beq) {}
-INST(bit) {}
-INST(bmi) {}
-INST(bne) {}
-INST(bpl) {}
+INST(adc) { add_with_carry(state, read_operand(state, args)); }
+INST(and) {
+  A &= read_operand(state, args);
+  neg_and_zero(CS, A);
+}
+INST(asl) {
+  u8 value = modify_read(state, args);
+  put_status(CS, Carry, is_set(7, value));
+  modify_write(state, args, value << 1);
+}
+INST(bcc) { branch_if(state, args, !is_status_set(Carry, CS)); }
+INST(bcs) { branch_if(state, args, is_status_set(Carry, CS)); }
+INST(beq) { branch_if(state, args, is_status_set(Zero, CS)); }
+INST(bit) {
+  u8 value = read_byte(state, args->address);
+  put_status(CS, Zero, (A & value) == 0);
+  put_status(CS, Overflow, is_set(6, value));
+  put_status(CS, Negative, is_set(7, value));
+}
+INST(bmi) { branch_if(state, args, is_status_set(Negative, CS)); }
+INST(bne) { branch_if(state, args, !is_status_set(Zero, CS)); }
+INST(bpl) { branch_if(state, args, !is_status_set(Negative, CS)); }
+// not the real interrupt, the test roms use BRK to say they're done.
 INST(brk) { state->cpu_state->shutting_down = 1; }
-INST(bvc) {}
-INST(bvs) {}
-INST(clc) {}
-INST(cld) {}
-INST(cli) {}
-INST(clv) {}
-INST(cmp) {}
-INST(cpx) {}
-INST(cpy) {}
-INST(dec) {}
-INST(dex) {}
-INST(dey) {}
-INST(eor) {}
-INST(inc) {}
-INST(inx) {}
-INST(iny) {}
-INST(jmp) {}
-INST(jsr) {}
-INST(lda) { A = args->immediate; }
-INST(ldx) {}
-INST(ldy) {}
-INST(lsr) {}
+INST(bvc) { branch_if(state, args, !is_status_set(Overflow, CS)); }
+INST(bvs) { branch_if(state, args, is_status_set(Overflow, CS)); }
+INST(clc) { unset_status(CS, Carry); }
+INST(cld) { unset_status(CS, Decimal); }
+INST(cli) { unset_status(CS, Interrupt); }
+INST(clv) { unset_status(CS, Overflow); }
+INST(cmp) { compare(state, A, read_operand(state, args)); }
+INST(cpx) { compare(state, X, read_byte(state, args->address)); }
+INST(cpy) { compare(state, Y, read_byte(state, args->address)); }
+INST(dec) {
+  u8 value = read_byte(state, args->address) - 1;
+  write_byte(state, args->address, value);
+  neg_and_zero(CS, value);
+}
+INST(dex) {
+  X--;
+  neg_and_zero(CS, X);
+}
+INST(dey) {
+  Y--;
+  neg_and_zero(CS, Y);
+}
+INST(eor) {
+  A ^= read_operand(state, args);
+  neg_and_zero(CS, A);
+}
+INST(inc) {
+  u8 value = read_byte(state, args->address) + 1;
+  write_byte(state, args->address, value);
+  neg_and_zero(CS, value);
+}
+INST(inx) {
+  X++;
+  neg_and_zero(CS, X);
+}
+INST(iny) {
+  Y++;
+  neg_and_zero(CS, Y);
+}
+INST(jmp) { PC = args->address; }
+INST(jsr) {
+  push16(state, PC - 1); // the last byte of the jsr itself.
+  PC = args->address;
+}
+INST(lda) {
+  A = read_operand(state, args);
+  neg_and_zero(CS, A);
+}
+INST(ldx) {
+  X = read_operand(state, args);
+  neg_and_zero(CS, X);
+}
+INST(ldy) {
+  Y = read_operand(state, args);
+  neg_and_zero(CS, Y);
+}
+INST(lsr) {
+  u8 value = modify_read(state, args);
+  put_status(CS, Carry, is_set(0, value));
+  modify_write(state, args, value >> 1);
+}
 INST(nop) {}
-INST(ora) {}
-INST(pha) {}
-INST(php) {}
-INST(pla) {}
-INST(plp) {}
-INST(rol) {}
-INST(ror) {}
-INST(rti) {}
-INST(rts) {}
-INST(sbc) {}
-INST(sec) {}
-INST(sed) {}
-INST(sei) {}
-INST(sta) {}
-INST(stx) {}
-INST(sty) {}
+INST(ora) {
+  A |= read_operand(state, args);
+  neg_and_zero(CS, A);
+}
+INST(pha) { push(state, A); }
+INST(php) { push(state, STATUS | Break | Unused); } // B is only on the stack.
+INST(pla) {
+  A = pull(state);
+  neg_and_zero(CS, A);
+}
+INST(plp) { STATUS = (pull(state) & ~Break) | Unused; }
+INST(rol) {
+  u8 value = modify_read(state, args);
+  u8 carry_in = is_status_set(Carry, CS);
+  put_status(CS, Carry, is_set(7, value));
+  modify_write(state, args, (value << 1) | carry_in);
+}
+INST(ror) {
+  u8 value = modify_read(state, args);
+  u8 carry_in = is_status_set(Carry, CS);
+  put_status(CS, Carry, is_set(0, value));
+  modify_write(state, args, (value >> 1) | (carry_in << 7));
+}
+INST(rti) {
+  STATUS = (pull(state) & ~Break) | Unused;
+  PC = pull16(state);
+}
+INST(rts) { PC = pull16(state) + 1; }
+INST(sbc) { add_with_carry(state, ~read_operand(state, args)); }
+INST(sec) { set_status(CS, Carry); }
+INST(sed) { set_status(CS, Decimal); }
+INST(sei) { set_status(CS, Interrupt); }
+INST(sta) { write_byte(state, args->address, A); }
+INST(stx) { write_byte(state, args->address, X); }
+INST(sty) { write_byte(state, args->address, Y); }
 INST(tax) {
   X = A;
   neg_and_zero(CS, X);
@@ -175,15 +440,18 @@ INST(tay) {
   neg_and_zero(CS, Y);
 } // Y = A, A -> Y, and etc...
 INST(tsx) {
-  X = STATUS;
+  X = SP;
   neg_and_zero(CS, X);
 }
 INST(txa) {
   A = X;
   neg_and_zero(CS, A);
 }
-INST(txs) {}
-INST(tya) {}
+INST(txs) { SP = X; } // the only transfer that leaves the flags alone.
+INST(tya) {
+  A = Y;
+  neg_and_zero(CS, A);
+}
 
 // takes in an instruction function and a mode.
 // this handles the addressing mode abstractions, giving the function
@@ -191,508 +459,339 @@ INST(tya) {}
 // instruction.
 void call(void (*function)(EmuState *, Args *), AddrMode mode, EmuState *es) {
   CPUState *cs = es->cpu_state;
-  Args *arg = (Args *)malloc(2);
+  Args arg = {0};
+  arg.mode = mode;
 
   // increment to either the first arg byte or the next instruction.
   cs->pc++;
 
   switch (mode) {
   case None:
+  case Accumulator:
     // no arg, do nothing
     break;
   case Immediate:
-    arg->immediate = es->ram[cs->pc];
+    arg.address = cs->pc;
     cs->pc++;
     break;
-  default:
-    printf("Invalid addressing mode.");
-    break;
-  }
-
-  function(es, arg);
-}
-
-// handlers and etc logic
-void handle_instruction(EmuState *state) {
-  CPUState *cs = state->cpu_state;
-  u8 base_instruction = state->ram[cs->pc];
-
-  if (is_debug)
-    printf("Running 0x%02X...\n", base_instruction);
-
-#define C(fn, addrmode) call(fn, addrmode, state)
-
-  // then, specify the full opcode table, including the different addressing
-  // modes.
-  switch (base_instruction) {
-  case 0x00:
-    C(brk, None);
-    break;
-  case 0x01:
-    C(ora, IndexedIndirect);
-    break;
-  case 0x05:
-    C(ora, ZP);
-    break;
-  case 0x06:
-    C(asl, ZP);
-    break;
-  case 0x08:
-    C(php, None);
-    break;
-  case 0x09:
-    C(ora, Immediate);
-    break;
-  case 0x0A:
-    C(asl, None);
-    break;
-  case 0x0D:
-    C(ora, Abs);
-    break;
-  case 0x0E:
-    C(asl, Abs);
-    break;
-  case 0x10:
-    C(bpl, Relative);
-    break;
-  case 0x11:
-    C(ora, IndirectIndexed);
-    break;
-  case 0x15:
-    C(ora, ZPX);
-    break;
-  case 0x16:
-    C(asl, ZPX);
-    break;
-  case 0x18:
-    C(clc, None);
-    break;
-  case 0x19:
-    C(ora, AbsY);
-    break;
-  case 0x1D:
-    C(ora, AbsX);
-    break;
-  case 0x1E:
-    C(asl, AbsX);
-    break;
-  case 0x20:
-    C(jsr, Abs);
-    break;
-  case 0x21:
-    C(and, IndexedIndirect);
-    break;
-  case 0x24:
-    C(bit, ZP);
-    break;
-  case 0x25:
-    C(and, ZP);
-    break;
-  case 0x26:
-    C(rol, ZP);
-    break;
-  case 0x28:
-    C(plp, None);
-    break;
-  case 0x29:
-    C(and, Immediate);
-    break;
-  case 0x2A:
-    C(rol, None);
-    break;
-  case 0x2C:
-    C(bit, Abs);
-    break;
-  case 0x2D:
-    C(and, Abs);
-    break;
-  case 0x2E:
-    C(rol, Abs);
-    break;
-  case 0x30:
-    C(bmi, Relative);
-    break;
-  case 0x31:
-    C(and, IndirectIndexed);
-    break;
-  case 0x35:
-    C(and, ZPX);
-    break;
-  case 0x36:
-    C(rol, ZPX);
-    break;
-  case 0x38:
-    C(sec, None);
-    break;
-  case 0x39:
-    C(and, AbsY);
-    break;
-  case 0x3D:
-    C(and, AbsX);
-    break;
-  case 0x3E:
-    C(rol, AbsX);
-    break;
-  case 0x40:
-    C(rti, None);
-    break;
-  case 0x41:
-    C(eor, IndexedIndirect);
-    break;
-  case 0x45:
-    C(eor, ZP);
-    break;
-  case 0x46:
-    C(lsr, ZP);
-    break;
-  case 0x48:
-    C(pha, None);
-    break;
-  case 0x49:
-    C(eor, Immediate);
-    break;
-  case 0x4A:
-    C(lsr, None);
-    break;
-  case 0x4C:
-    C(jmp, Abs);
-    break;
-  case 0x4D:
-    C(eor, Abs);
-    break;
-  case 0x4E:
-    C(lsr, Abs);
-    break;
-  case 0x50:
-    C(bvc, Relative);
-    break;
-  case 0x51:
-    C(eor, IndirectIndexed);
-    break;
-  case 0x55:
-    C(eor, ZPX);
-    break;
-  case 0x56:
-    C(lsr, ZPX);
-    break;
-  case 0x58:
-    C(cli, None);
-    break;
-  case 0x59:
-    C(eor, AbsY);
-    break;
-  case 0x5D:
-    C(eor, AbsX);
-    break;
-  case 0x5E:
-    C(lsr, AbsX);
-    break;
-  case 0x60:
-    C(rts, None);
-    break;
-  case 0x61:
-    C(adc, IndexedIndirect);
-    break;
-  case 0x65:
-    C(adc, ZP);
-    break;
-  case 0x66:
-    C(ror, ZP);
-    break;
-  case 0x68:
-    C(pla, None);
-    break;
-  case 0x69:
-    C(adc, Immediate);
-    break;
-  case 0x6A:
-    C(ror, None);
-    break;
-  case 0x6C:
-    C(jmp, None);
-    break;
-  case 0x6D:
-    C(adc, Abs);
-    break;
-  case 0x6E:
-    C(ror, Abs);
-    break;
-  case 0x70:
-    C(bvs, Relative);
-    break;
-  case 0x71:
-    C(adc, IndirectIndexed);
-    break;
-  case 0x75:
-    C(adc, ZPX);
-    break;
-  case 0x76:
-    C(ror, ZPX);
-    break;
-  case 0x78:
-    C(sei, None);
-    break;
-  case 0x79:
-    C(adc, AbsY);
-    break;
-  case 0x7D:
-    C(adc, AbsX);
-    break;
-  case 0x7E:
-    C(ror, AbsX);
-    break;
-  case 0x81:
-    C(sta, IndexedIndirect);
-    break;
-  case 0x84:
-    C(sty, ZP);
-    break;
-  case 0x85:
-    C(sta, ZP);
-    break;
-  case 0x86:
-    C(stx, ZP);
-    break;
-  case 0x88:
-    C(dey, None);
-    break;
-  case 0x8A:
-    C(txa, None);
-    break;
-  case 0x8C:
-    C(sty, Abs);
-    break;
-  case 0x8D:
-    C(sta, Abs);
-    break;
-  case 0x8E:
-    C(stx, Abs);
-    break;
-  case 0x90:
-    C(bcc, Relative);
-    break;
-  case 0x91:
-    C(sta, IndirectIndexed);
-    break;
-  case 0x94:
-    C(sty, ZPX);
-    break;
-  case0x95:
-    C(sta, ZPX);
-    break;
-  case 0x96:
-    C(stx, ZPY);
-    break;
-  case 0x98:
-    C(tya, None);
-    break;
-  case 0x99:
-    C(sta, AbsY);
-    break;
-  case 0x9A:
-    C(txs, None);
-    break;
-  case 0x9D:
-    C(sta, AbsX);
-    break;
-  case 0xA0:
-    C(ldy, Immediate);
-    break;
-  case 0xA1:
-    C(lda, IndexedIndirect);
-    break;
-  case 0xA2:
-    C(ldx, Immediate);
-    break;
-  case 0xA4:
-    C(ldy, ZP);
-    break;
-  case 0xA5:
-    C(lda, ZP);
-    break;
-  case 0xA6:
-    C(ldx, ZP);
-    break;
-  case 0xA8:
-    C(tay, None);
-    break;
-  case 0xA9:
-    C(lda, Immediate);
-    break;
-  case 0xAA:
-    C(tax, None);
-    break;
-  case 0xAC:
-    C(ldy, Abs);
-    break;
-  case 0xAD:
-    C(lda, Abs);
-    break;
-  case 0xAE:
-    C(ldx, Abs);
-    break;
-  case 0xB0:
-    C(bcs, Relative);
-    break;
-  case 0xB1:
-    C(lda, IndirectIndexed);
-    break;
-  case 0xB4:
-    C(ldy, ZPX);
-    break;
-  case 0xB5:
-    C(lda, ZPX);
-    break;
-  case 0xB6:
-    C(ldx, ZPY);
-    break;
-  case 0xB8:
-    C(clv, None);
-    break;
-  case 0xB9:
-    C(lda, AbsY);
-    break;
-  case 0xBA:
-    C(tsx, None);
-    break;
-  case 0xBC:
-    C(ldy, AbsX);
-    break;
-  case 0xBD:
-    C(lda, AbsX);
-    break;
-  case 0xBE:
-    C(ldx, AbsY);
-    break;
-  case 0xC0:
-    C(cpy, Immediate);
-    break;
-  case 0xC1:
-    C(cmp, IndexedIndirect);
-    break;
-  case 0xC4:
-    C(cpy, ZP);
-    break;
-  case 0xC5:
-    C(cmp, ZP);
-    break;
-  case 0xC6:
-    C(dec, ZP);
-    break;
-  case 0xC8:
-    C(iny, None);
-    break;
-  case 0xC9:
-    C(cmp, Immediate);
-    break;
-  case 0xCA:
-    C(dex, None);
-    break;
-  case 0xCC:
-    C(cpy, Abs);
-    break;
-  case 0xCD:
-    C(cmp, Abs);
-    break;
-  case 0xCE:
-    C(dec, Abs);
-    break;
-  case 0xD0:
-    C(bne, Relative);
-    break;
-  case 0xD1:
-    C(cmp, IndirectIndexed);
-    break;
-  case 0xD5:
-    C(cmp, ZPX);
-    break;
-  case 0xD6:
-    C(dec, ZPX);
-    break;
-  case 0xD8:
-    C(cld, None);
-    break;
-  case 0xD9:
-    C(cmp, AbsY);
-    break;
-  case 0xDD:
-    C(cmp, AbsX);
-    break;
-  case 0xDE:
-    C(dec, AbsX);
-    break;
-  case 0xE0:
-    C(cpx, Immediate);
-    break;
-  case 0xE1:
-    C(sbc, IndexedIndirect);
-    break;
-  case 0xE4:
-    C(cpx, ZP);
-    break;
-  case 0xE5:
-    C(sbc, ZP);
-    break;
-  case 0xE6:
-    C(inc, ZP);
-    break;
-  case 0xE8:
-    C(inx, None);
-    break;
-  case 0xE9:
-    C(sbc, Immediate);
-    break;
-  case 0xEA:
-    C(nop, None);
-    break;
-  case 0xEC:
-    C(cpx, Abs);
-    break;
-  case 0xED:
-    C(sbc, Abs);
-    break;
-  case 0xEE:
-    C(inc, Abs);
+  case ZP:
+    arg.address = read_byte(es, cs->pc);
+    cs->pc++;
     break;
-  case 0xF0:
-    C(beq, Relative);
+  case ZPX: // the zero page indexed modes wrap around inside the zero page.
+    arg.address = (u8)(read_byte(es, cs->pc) + cs->x);
+    cs->pc++;
     break;
-  case 0xF1:
-    C(sbc, IndirectIndexed);
+  case ZPY:
+    arg.address = (u8)(read_byte(es, cs->pc) + cs->y);
+    cs->pc++;
     break;
-  case 0xF5:
-    C(sbc, ZPX);
+  case Abs:
+    arg.address = read_byte(es, cs->pc) | (read_byte(es, cs->pc + 1) << 8);
+    cs->pc += 2;
     break;
-  case 0xF6:
-    C(inc, ZPX);
+  case AbsX: {
+    u16 base = read_byte(es, cs->pc) | (read_byte(es, cs->pc + 1) << 8);
+    arg.address = base + cs->x;
+    arg.page_crossed = (base & 0xFF00) != (arg.address & 0xFF00);
+    cs->pc += 2;
     break;
-  case 0xF8:
-    C(sed, None);
+  }
+  case AbsY: {
+    u16 base = read_byte(es, cs->pc) | (read_byte(es, cs->pc + 1) << 8);
+    arg.address = base + cs->y;
+    arg.page_crossed = (base & 0xFF00) != (arg.address & 0xFF00);
+    cs->pc += 2;
     break;
-  case 0xF9:
-    C(sbc, AbsY);
+  }
+  case Indirect: { // only JMP. the pointer's high byte never leaves its page,
+                   // a famous 6502 bug that games do rely on.
+    u16 pointer = read_byte(es, cs->pc) | (read_byte(es, cs->pc + 1) << 8);
+    u16 high = (pointer & 0xFF00) | (u8)(pointer + 1);
+    arg.address = read_byte(es, pointer) | (read_byte(es, high) << 8);
+    cs->pc += 2;
     break;
-  case 0xFD:
-    C(sbc, AbsX);
+  }
+  case Relative: { // the branch target, relative to the next instruction.
+    signed char offset = (signed char)read_byte(es, cs->pc);
+    cs->pc++;
+    arg.address = cs->pc + offset;
     break;
-  case 0xFE:
-    C(inc, AbsX);
+  }
+  case IndexedIndirect: { // ($zp,X), the pointer itself is indexed.
+    u8 pointer = read_byte(es, cs->pc) + cs->x;
+    arg.address =
+        read_byte(es, pointer) | (read_byte(es, (u8)(pointer + 1)) << 8);
+    cs->pc++;
     break;
-  case 0xFF: // print debug, not real or used opcode.
-    C(nop, None);
-    if (is_debug)
-      debug_print(state);
+  }
+  case IndirectIndexed: { // ($zp),Y, the pointed-to address is indexed.
+    u8 pointer = read_byte(es, cs->pc);
+    u16 base =
+        read_byte(es, pointer) | (read_byte(es, (u8)(pointer + 1)) << 8);
+    arg.address = base + cs->y;
+    arg.page_crossed = (base & 0xFF00) != (arg.address & 0xFF00);
+    cs->pc++;
     break;
+  }
   default:
-    printf("Invalid opcode detected (%02X).\n", base_instruction);
+    printf("Invalid addressing mode.");
     break;
   }
+
+  function(es, &arg);
+}
+
+// base cycle counts for every opcode, indexed by the opcode itself. page
+// crossing and taken branch penalties are added by the instructions.
+const u8 cycle_table[256] = {
+    /*0x*/ 7, 6, 2, 8, 3, 3, 5, 5, 3, 2, 2, 2, 4, 4, 6, 6,
+    /*1x*/ 2, 5, 2, 8, 4, 4, 6, 6, 2, 4, 2, 7, 4, 4, 7, 7,
+    /*2x*/ 6, 6, 2, 8, 3, 3, 5, 5, 4, 2, 2, 2, 4, 4, 6, 6,
+    /*3x*/ 2, 5, 2, 8, 4, 4, 6, 6, 2, 4, 2, 7, 4, 4, 7, 7,
+    /*4x*/ 6, 6, 2, 8, 3, 3, 5, 5, 3, 2, 2, 2, 3, 4, 6, 6,
+    /*5x*/ 2, 5, 2, 8, 4, 4, 6, 6, 2, 4, 2, 7, 4, 4, 7, 7,
+    /*6x*/ 6, 6, 2, 8, 3, 3, 5, 5, 4, 2, 2, 2, 5, 4, 6, 6,
+    /*7x*/ 2, 5, 2, 8, 4, 4, 6, 6, 2, 4, 2, 7, 4, 4, 7, 7,
+    /*8x*/ 2, 6, 2, 6, 3, 3, 3, 3, 2, 2, 2, 2, 4, 4, 4, 4,
+    /*9x*/ 2, 6, 2, 6, 4, 4, 4, 4, 2, 5, 2, 5, 5, 5, 5, 5,
+    /*Ax*/ 2, 6, 2, 6, 3, 3, 3, 3, 2, 2, 2, 2, 4, 4, 4, 4,
+    /*Bx*/ 2, 5, 2, 5, 4, 4, 4, 4, 2, 4, 2, 4, 4, 4, 4, 4,
+    /*Cx*/ 2, 6, 2, 8, 3, 3, 5, 5, 2, 2, 2, 2, 4, 4, 6, 6,
+    /*Dx*/ 2, 5, 2, 8, 4, 4, 6, 6, 2, 4, 2, 7, 4, 4, 7, 7,
+    /*Ex*/ 2, 6, 2, 8, 3, 3, 5, 5, 2, 2, 2, 2, 4, 4, 6, 6,
+    /*Fx*/ 2, 5, 2, 8, 4, 4, 6, 6, 2, 4, 2, 7, 4, 4, 7, 2,
+}; // 0xFF is our debug print, call it a nop.
+
+// the full opcode table, including the different addressing modes. anything
+// not in here is an invalid opcode.
+#define I(fn, addrmode) {#fn, fn, addrmode}
+const Instruction instruction_table[256] = {
+    [0x00] = I(brk, None),
+    [0x01] = I(ora, IndexedIndirect),
+    [0x05] = I(ora, ZP),
+    [0x06] = I(asl, ZP),
+    [0x08] = I(php, None),
+    [0x09] = I(ora, Immediate),
+    [0x0A] = I(asl, Accumulator),
+    [0x0D] = I(ora, Abs),
+    [0x0E] = I(asl, Abs),
+    [0x10] = I(bpl, Relative),
+    [0x11] = I(ora, IndirectIndexed),
+    [0x15] = I(ora, ZPX),
+    [0x16] = I(asl, ZPX),
+    [0x18] = I(clc, None),
+    [0x19] = I(ora, AbsY),
+    [0x1D] = I(ora, AbsX),
+    [0x1E] = I(asl, AbsX),
+    [0x20] = I(jsr, Abs),
+    [0x21] = I(and, IndexedIndirect),
+    [0x24] = I(bit, ZP),
+    [0x25] = I(and, ZP),
+    [0x26] = I(rol, ZP),
+    [0x28] = I(plp, None),
+    [0x29] = I(and, Immediate),
+    [0x2A] = I(rol, Accumulator),
+    [0x2C] = I(bit, Abs),
+    [0x2D] = I(and, Abs),
+    [0x2E] = I(rol, Abs),
+    [0x30] = I(bmi, Relative),
+    [0x31] = I(and, IndirectIndexed),
+    [0x35] = I(and, ZPX),
+    [0x36] = I(rol, ZPX),
+    [0x38] = I(sec, None),
+    [0x39] = I(and, AbsY),
+    [0x3D] = I(and, AbsX),
+    [0x3E] = I(rol, AbsX),
+    [0x40] = I(rti, None),
+    [0x41] = I(eor, IndexedIndirect),
+    [0x45] = I(eor, ZP),
+    [0x46] = I(lsr, ZP),
+    [0x48] = I(pha, None),
+    [0x49] = I(eor, Immediate),
+    [0x4A] = I(lsr, Accumulator),
+    [0x4C] = I(jmp, Abs),
+    [0x4D] = I(eor, Abs),
+    [0x4E] = I(lsr, Abs),
+    [0x50] = I(bvc, Relative),
+    [0x51] = I(eor, IndirectIndexed),
+    [0x55] = I(eor, ZPX),
+    [0x56] = I(lsr, ZPX),
+    [0x58] = I(cli, None),
+    [0x59] = I(eor, AbsY),
+    [0x5D] = I(eor, AbsX),
+    [0x5E] = I(lsr, AbsX),
+    [0x60] = I(rts, None),
+    [0x61] = I(adc, IndexedIndirect),
+    [0x65] = I(adc, ZP),
+    [0x66] = I(ror, ZP),
+    [0x68] = I(pla, None),
+    [0x69] = I(adc, Immediate),
+    [0x6A] = I(ror, Accumulator),
+    [0x6C] = I(jmp, Indirect),
+    [0x6D] = I(adc, Abs),
+    [0x6E] = I(ror, Abs),
+    [0x70] = I(bvs, Relative),
+    [0x71] = I(adc, IndirectIndexed),
+    [0x75] = I(adc, ZPX),
+    [0x76] = I(ror, ZPX),
+    [0x78] = I(sei, None),
+    [0x79] = I(adc, AbsY),
+    [0x7D] = I(adc, AbsX),
+    [0x7E] = I(ror, AbsX),
+    [0x81] = I(sta, IndexedIndirect),
+    [0x84] = I(sty, ZP),
+    [0x85] = I(sta, ZP),
+    [0x86] = I(stx, ZP),
+    [0x88] = I(dey, None),
+    [0x8A] = I(txa, None),
+    [0x8C] = I(sty, Abs),
+    [0x8D] = I(sta, Abs),
+    [0x8E] = I(stx, Abs),
+    [0x90] = I(bcc, Relative),
+    [0x91] = I(sta, IndirectIndexed),
+    [0x94] = I(sty, ZPX),
+    [0x95] = I(sta, ZPX),
+    [0x96] = I(stx, ZPY),
+    [0x98] = I(tya, None),
+    [0x99] = I(sta, AbsY),
+    [0x9A] = I(txs, None),
+    [0x9D] = I(sta, AbsX),
+    [0xA0] = I(ldy, Immediate),
+    [0xA1] = I(lda, IndexedIndirect),
+    [0xA2] = I(ldx, Immediate),
+    [0xA4] = I(ldy, ZP),
+    [0xA5] = I(lda, ZP),
+    [0xA6] = I(ldx, ZP),
+    [0xA8] = I(tay, None),
+    [0xA9] = I(lda, Immediate),
+    [0xAA] = I(tax, None),
+    [0xAC] = I(ldy, Abs),
+    [0xAD] = I(lda, Abs),
+    [0xAE] = I(ldx, Abs),
+    [0xB0] = I(bcs, Relative),
+    [0xB1] = I(lda, IndirectIndexed),
+    [0xB4] = I(ldy, ZPX),
+    [0xB5] = I(lda, ZPX),
+    [0xB6] = I(ldx, ZPY),
+    [0xB8] = I(clv, None),
+    [0xB9] = I(lda, AbsY),
+    [0xBA] = I(tsx, None),
+    [0xBC] = I(ldy, AbsX),
+    [0xBD] = I(lda, AbsX),
+    [0xBE] = I(ldx, AbsY),
+    [0xC0] = I(cpy, Immediate),
+    [0xC1] = I(cmp, IndexedIndirect),
+    [0xC4] = I(cpy, ZP),
+    [0xC5] = I(cmp, ZP),
+    [0xC6] = I(dec, ZP),
+    [0xC8] = I(iny, None),
+    [0xC9] = I(cmp, Immediate),
+    [0xCA] = I(dex, None),
+    [0xCC] = I(cpy, Abs),
+    [0xCD] = I(cmp, Abs),
+    [0xCE] = I(dec, Abs),
+    [0xD0] = I(bne, Relative),
+    [0xD1] = I(cmp, IndirectIndexed),
+    [0xD5] = I(cmp, ZPX),
+    [0xD6] = I(dec, ZPX),
+    [0xD8] = I(cld, None),
+    [0xD9] = I(cmp, AbsY),
+    [0xDD] = I(cmp, AbsX),
+    [0xDE] = I(dec, AbsX),
+    [0xE0] = I(cpx, Immediate),
+    [0xE1] = I(sbc, IndexedIndirect),
+    [0xE4] = I(cpx, ZP),
+    [0xE5] = I(sbc, ZP),
+    [0xE6] = I(inc, ZP),
+    [0xE8] = I(inx, None),
+    [0xE9] = I(sbc, Immediate),
+    [0xEA] = I(nop, None),
+    [0xEC] = I(cpx, Abs),
+    [0xED] = I(sbc, Abs),
+    [0xEE] = I(inc, Abs),
+    [0xF0] = I(beq, Relative),
+    [0xF1] = I(sbc, IndirectIndexed),
+    [0xF5] = I(sbc, ZPX),
+    [0xF6] = I(inc, ZPX),
+    [0xF8] = I(sed, None),
+    [0xF9] = I(sbc, AbsY),
+    [0xFD] = I(sbc, AbsX),
+    [0xFE] = I(inc, AbsX),
+    [0xFF] = I(nop, None), // print debug, not real or used opcode.
+};
+#undef I
+
+// handlers and etc logic
+void handle_instruction(EmuState *state) {
+  CPUState *cs = state->cpu_state;
+  u16 pc = cs->pc;
+  u8 base_instruction = read_byte(state, pc);
+  const Instruction *instruction = &instruction_table[base_instruction];
+
+  TRACE(state, base_instruction);
+
+  // the instructions add their own page crossing and branch penalties, so
+  // the profile gets whatever the clock actually moved by.
+  u64 before = cs->cycles;
+  if (instruction->function != NULL) {
+    call(instruction->function, instruction->mode, state);
+  } else {
+    // there's nothing to run and the pc wouldn't move, so it'd sit here
+    // for good. halt, the same as a brk, and say so once.
+    printf("Invalid opcode detected (%02X) at $%04X, halting.\n",
+           base_instruction, pc);
+    cs->shutting_down = 1;
+  }
+
+  if (base_instruction == 0xFF && is_debug)
+    debug_print(state);
+
+  cs->cycles += cycle_table[base_instruction];
+  PROFILE(pc, base_instruction, cs->cycles - before);
 }
 
 // NOW, DEFINE THE EXPOSED MODULE FUNCTIONS (and state variables)
 
 EmuState *emu_state = NULL;
 
+// the file image behind the global instance, the machine only borrows it.
+static u8 *rom_image = NULL;
+
+u8 load_rom(EmuState *state, const u8 *image, u32 size) {
+  // parse the header.
+  // it will read in BE? why do we need to convert it? i'm so confused??
+  if (size < 0x10 + 0x4000 ||
+      convertToLittleEndian(*(u32 *)image) != ines_magic) {
+    printf("Magic number does not match, or the rom is too small.\n");
+    return 0;
+  }
+
+  state->rom = image;
+  state->rom_size = size;
+  state->prg_size = image[4];
+  state->chr_size = image[5];
+
+  // now, map the prg-rom into RAM. no mappers yet, so it's nrom: one 16kb
+  // bank shows up at both 0x8000 and 0xC000, two fill the whole 32kb.
+  u32 banks = (state->prg_size >= 2 && size >= 0x10 + 0x8000) ? 2 : 1;
+  for (int page = 0x80; page < PAGE_COUNT; page++)
+    memcpy(page_for_write(state, page),
+           image + 0x0010 + ((page - 0x80) * PAGE_SIZE) % (banks * 0x4000),
+           PAGE_SIZE);
+
+  // 0x8000, little endian is our starting postition.
+  // TODO: do we have to read this from the header? what's up with the reset
+  // vecs?
+  poke(state, 0xFFFC, 0x00);
+  poke(state, 0xFFFD, 0x80);
+  // TODO: handle the irq vector.
+
+  // TODO: read from the ram.
+  state->cpu_state->pc = 0x8000;
+  return 1;
+}
+
 // main does the parsing and file handling, we use the FILE* to read
 // into the emu->rom field
 void cpu_init(FILE *rom_file) {
@@ -705,56 +804,43 @@ void cpu_init(FILE *rom_file) {
   rewind(rom_file);
 
   // Allocate memory to store the file contents
-  emu_state->rom = (u8 *)malloc(rom_file_size);
-
-  // Read the file byte by byte
-  int byte;
-  long index = 0;
-  while ((byte = fgetc(rom_file)) != EOF) {
-    emu_state->rom[index++] = (u8)byte;
+  rom_image = (u8 *)malloc(rom_file_size);
+  if (fread(rom_image, 1, rom_file_size, rom_file) != (size_t)rom_file_size) {
+    printf("Could not read the rom file.\n");
+    return;
   }
 
-  // done reading, parse the header.
-  // it will read in BE? why do we need to convert it? i'm so confused??
-  u32 *first_four_bytes = (u32 *)emu_state->rom;
-  if (convertToLittleEndian(*first_four_bytes) != ines_magic) {
-    printf("Magic number does not match, exiting...\n");
-    printf("Your magic: %08X, ines_magic: %08X.\n", *first_four_bytes,
-           ines_magic);
+  if (!load_rom(emu_state, rom_image, rom_file_size)) {
     // TODO: exit here
+    return;
   }
 
-  emu_state->prg_size = emu_state->rom[4];
-  emu_state->chr_size = emu_state->rom[5];
-
   printf("Parsed header. Found a rom with proper magic, a PRG-ROM size of %d * "
          "16kb, and CHR-ROM of %d * 8kb.\n",
          emu_state->prg_size, emu_state->chr_size);
+}
 
-  // now, map the prg-rom into RAM.
-  // assume 16kb for now, map into the 0x8000 region in memory.
-  mapArraySection(emu_state->rom, emu_state->ram, 0x0010, 0x8000, 0x4000);
-
-  // 0x8000, little endian is our starting postition.
-  // TODO: do we have to read this from the header? what's up with the reset
-  // vecs?
-  emu_state->ram[0xFFFC] = 0x00;
-  emu_state->ram[0xFFFD] = 0x80;
-  // TODO: handle the irq vector.
-
-  // TODO: read from the ram.
-  emu_state->cpu_state->pc = 0x8000;
+void cpu_run_frame(EmuState *state) {
+  CPUState *cs = state->cpu_state;
+  u64 frame_end = (cs->cycles / CYCLES_PER_FRAME + 1) * CYCLES_PER_FRAME;
+
+  while (cs->cycles < frame_end && !cs->shutting_down) {
+    // lol
+    if (cs->pc == 0xFFFF) {
+      cs->pc = 0x8000;
+    }
+    handle_instruction(state);
+  }
+  apu_end_frame(state);
 }
 
 void cpu_update(u8 *is_running) {
-  // lol
-  if (emu_state->cpu_state->pc == 0xFFFF) {
-    emu_state->cpu_state->pc = 0x8000;
-  }
-  handle_instruction(emu_state);
+  cpu_run_frame(emu_state);
 
-  printf("cpu: %d", !emu_state->cpu_state->shutting_down);
   *is_running = !emu_state->cpu_state->shutting_down;
 }
 
-void cpu_clean() { clean_emu_state(emu_state); }
+void cpu_clean() {
+  clean_emu_state(emu_state);
+  free(rom_image);
+}
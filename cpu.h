@@ -1,15 +1,23 @@
 #pragma once
 
+#include "apu.h"
 #include "defines.h"
+#include <stdatomic.h>
 #include <stdio.h>
 
 #define ines_magic 0x4E45531A
 
-typedef union { // args can either be some u16 entity,
-  // or a u8 entity. pass this to get around the weirdness.
-  u8 immediate;
-  u16 address;
-} Args;
+// the whole 16 bit address space, mapped flat.
+#define RAM_SIZE 0x10000
+
+// the same thing, in 256 byte pages. snapshots and dirty tracking work on
+// these, and it's the unit machines share memory in.
+#define PAGE_SIZE 0x100
+#define PAGE_COUNT (RAM_SIZE / PAGE_SIZE)
+#define DIRTY_WORDS (PAGE_COUNT / 64)
+
+// ntsc runs 29780.5 cpu cycles per frame, round up.
+#define CYCLES_PER_FRAME 29781
 
 // enums and defines
 typedef enum AddrMode { // the addressing mode for each instruction.
@@ -24,8 +32,19 @@ typedef enum AddrMode { // the addressing mode for each instruction.
   Relative,
   IndexedIndirect,
   IndirectIndexed,
+  Accumulator, // the shifts and rotates that work on A.
+  Indirect,    // JMP ($nnnn) and nothing else.
 } AddrMode;
 
+typedef struct Args {
+  // call() resolves every addressing mode down to an effective address,
+  // even Immediate, where it's the address of the operand byte itself. the
+  // instructions then just go through the bus with it.
+  u16 address;
+  AddrMode mode;
+  u8 page_crossed; // indexing carried into the high byte, reads pay for it.
+} Args;
+
 typedef enum StatusBit {
   Carry = (1 << 0),
   Zero = (1 << 1),
@@ -40,33 +59,143 @@ typedef enum StatusBit {
 
 typedef struct CPUState {
   u16 pc;
-  u8 sp; // is the sp 8 bit?
+  u8 sp; // 8 bit, an offset into the stack page at $0100.
 
   u8 a;
   u8 x;
   u8 y;
   u8 status;
 
-  u8 shutting_down; // for BRK.
+  u8 shutting_down; // for BRK, and an opcode we don't have.
+
+  u64 cycles; // cpu cycles since power on, the core's only clock for now.
 } CPUState;
 
+typedef enum Button { // the standard controller, in the order it shifts out.
+  ButtonA = (1 << 0),
+  ButtonB = (1 << 1),
+  ButtonSelect = (1 << 2),
+  ButtonStart = (1 << 3),
+  ButtonUp = (1 << 4),
+  ButtonDown = (1 << 5),
+  ButtonLeft = (1 << 6),
+  ButtonRight = (1 << 7),
+} Button;
+
+typedef struct InputState { // both controller ports, at $4016 and $4017.
+  u8 buttons[2]; // what's held right now, a mask of Buttons. the frontend
+                 // sets these before each frame.
+  u8 shift[2];   // the latched buttons, shifting out one bit per read.
+  u8 strobe;     // while set, the shift registers keep reloading.
+} InputState;
+
+// one page of memory. clones share pages, refs counts the machines holding
+// this one, and a machine that wants to write a shared page copies it first.
+// the prg-rom pages are never written, so every clone of a machine keeps
+// pointing at the same ones.
+typedef struct Page {
+  _Atomic u32 refs;
+  u8 data[PAGE_SIZE];
+} Page;
+
 // our overall stateful object for the emulator core.
 // cleaning this should clean EVERYTHING else.
 typedef struct EmuState {
   CPUState *cpu_state;
 
-  u8 *ram;
-  u8 *rom;
+  Page *pages[PAGE_COUNT]; // the address space, see peek and poke.
+  const u8 *rom; // borrowed, the image must outlive the machine.
+  u32 rom_size; // of the whole file, header included.
 
   u8 prg_size; // both straight from the header.
   u8 chr_size;
+
+  InputState input;
+
+  ApuState apu;
+  // where the apu's sound goes, NULL for none. borrowed, and never carried
+  // over to a clone. see apu.h.
+  AudioBuffer *audio;
+  // the nsf being played, NULL for a rom. borrowed like the rom, see nsf.h.
+  const struct NsfFile *nsf;
+
+  // one bit per page of ram, set by the bus on every write. cleared when a
+  // full snapshot is taken or loaded, so it always means "changed since the
+  // base snapshot". see state.h.
+  u64 dirty[DIRTY_WORDS];
+  // pages that might have another holder, set for every page on both sides
+  // of a clone. keeps the refcount off the write path, it's only looked at
+  // the first time a shared page is written.
+  u64 shared[DIRTY_WORDS];
+
+  // the incremental state hash, see hash_machine in state.h. pages written
+  // since it last ran, each page's hash as of then, and all of them xored.
+  u64 unhashed[DIRTY_WORDS];
+  u64 page_hashes[PAGE_COUNT];
+  u64 ram_hash;
 } EmuState;
 
+// one entry of the opcode table. the name is only for tools, like the trace
+// and the disassembly.
+typedef struct Instruction {
+  const char *name;
+  void (*function)(EmuState *, Args *);
+  AddrMode mode;
+} Instruction;
+
+extern const Instruction instruction_table[256];
+// base cycles per opcode, before page crossing and branch penalties.
+extern const u8 cycle_table[256];
+
 // static module instances.
 // we'll hide the constructor, and only expose the instance itself
 // and the structure to the rest of the program.
 extern EmuState *emu_state;
 
+// the bus. everything that touches memory on behalf of the cpu goes through
+// these, so mirroring and dirty tracking live in one place.
+u8 read_byte(EmuState *state, u16 address);
+void write_byte(EmuState *state, u16 address, u8 value);
+
+// the memory underneath the bus, no mirroring or side effects. for snapshots,
+// tools and anything else that isn't the cpu.
+static inline u8 peek(const EmuState *state, u16 address) {
+  return state->pages[address >> 8]->data[address & 0xFF];
+}
+
+// a page this machine can write to, copied first if it's shared.
+u8 *page_for_write(EmuState *state, u8 page);
+// poke's slow path, kept out of line so the fast one stays small.
+void poke_shared(EmuState *state, u16 address, u8 value);
+
+static inline void poke(EmuState *state, u16 address, u8 value) {
+  u8 page = address >> 8;
+  state->unhashed[page >> 6] |= (u64)1 << (page & 63);
+  if (state->shared[page >> 6] & ((u64)1 << (page & 63)))
+    poke_shared(state, address, value);
+  else
+    state->pages[page]->data[address & 0xFF] = value;
+}
+
+// a blank machine with nothing loaded, and its destructor. cpu_init makes
+// the static instance with one of these.
+EmuState *make_emu_state();
+void clean_emu_state(EmuState *state);
+// an independent machine exactly where this one is. costs a table of page
+// pointers, the pages themselves are shared and only copied by whichever
+// side writes to one first. the rom image stays borrowed by both. don't
+// clone a machine while another thread is running it.
+EmuState *clone_instance(EmuState *state);
+
+// parse an ines image and map it into a fresh machine. any number of machines
+// can be loaded from the same image, it's never written to. 0 on a bad header.
+u8 load_rom(EmuState *state, const u8 *image, u32 size);
 void cpu_init(FILE *rom_file);
+// fetch, decode and run the instruction at pc.
+void handle_instruction(EmuState *state);
+// what a jsr pushes, for calling into guest code from outside.
+void push16(EmuState *state, u16 value);
 void cpu_update(u8 *is_running);
+// run until the next frame boundary, or until the cpu shuts down.
+void cpu_run_frame(EmuState *state);
 void cpu_clean();
@@ -8,7 +8,31 @@
 
 #define is_debug 1
 
+// the binary instruction trace, see trace.h. off compiles it out entirely.
+#define is_trace 0
+#define TRACE_PATH "trace.bin"
+
+// the guest profiler, see profile.h. same deal as the trace.
+#define is_profile 0
+#define PROFILE_PATH "profile.folded"
+
+// the alsa audio backend, see audio.h. needs libasound, so make.sh passes
+// -Dis_alsa=1 (and -lasound) only when pkg-config finds it.
+#ifndef is_alsa
+#define is_alsa 0
+#endif
+// the resampler's, see resample.h. 0 low, 1 medium, 2 high.
+#define AUDIO_QUALITY 1
+
+// rewind history, see rewind.h.
+#define REWIND_CAP (16 * 1024 * 1024) // bytes of packed history.
+#define REWIND_INTERVAL 1             // frames between snapshots.
+
+// frames of run-ahead to hide the game's input lag, 0 to turn it off.
+#define RUNAHEAD_FRAMES 2
+
 // helper types
 typedef uint8_t u8;
 typedef uint16_t u16;
 typedef uint32_t u32;
+typedef uint64_t u64;
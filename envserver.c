@@ -0,0 +1,374 @@
+#define _GNU_SOURCE // memfd_create
+#include "envserver.h"
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+
+typedef struct Env {
+  EmuState *state;
+  u32 frames; // into the episode.
+} Env;
+
+typedef struct Server {
+  EmuState *start;
+  pthread_mutex_t clone_lock; // clone_instance writes to start.
+  Env *envs;
+  int count;
+
+  const EnvPredicate *predicates;
+  int predicate_count;
+
+  // the shared region, and the arrays in it.
+  int memfd;
+  EnvShared *shared;
+  u8 *actions;
+  float *rewards;
+  u8 *dones;
+  u32 *frames;
+  u8 *observations;
+
+  // the pool, the same as search.c's. everyone meets at start, works through
+  // the envs until they run out, and meets again at done.
+  pthread_t *threads;
+  int workers;
+  pthread_barrier_t start_barrier;
+  pthread_barrier_t done_barrier;
+  _Atomic int next;
+  EnvMessage job; // what this round is.
+  u8 quit;
+} Server;
+
+static double now_seconds() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/// PREDICATES
+u8 env_parse_predicate(const char *text, EnvPredicate *out) {
+  memset(out, 0, sizeof(EnvPredicate));
+  const char *start;
+  char *end;
+
+  if (strncmp(text, "reward:", 7) == 0) {
+    start = text + 7;
+    out->kind = EnvReward;
+    out->scale = 1;
+    long address = strtol(start, &end, 0);
+    if (end == start || address < 0 || address > 0xFFFF)
+      return 0;
+    out->address = address;
+    if (*end == '*')
+      out->scale = strtof(end + 1, &end);
+    return *end == '\0';
+  }
+
+  if (strncmp(text, "done:", 5) == 0) {
+    start = text + 5;
+    out->kind = EnvDone;
+    long address = strtol(start, &end, 0);
+    if (end == start || address < 0 || address > 0xFFFF)
+      return 0;
+    out->address = address;
+
+    if (end[0] == '!' && end[1] == '=') {
+      out->op = '!';
+      end += 2;
+    } else if (*end == '=' || *end == '<' || *end == '>') {
+      out->op = *end++;
+    } else {
+      return 0;
+    }
+
+    start = end;
+    long value = strtol(start, &end, 0);
+    out->value = value;
+    return end != start && *end == '\0' && value >= 0 && value <= 0xFF;
+  }
+
+  return 0;
+}
+
+static u8 is_done(const Server *s, const EmuState *state) {
+  if (state->cpu_state->shutting_down)
+    return 1;
+
+  for (int p = 0; p < s->predicate_count; p++) {
+    const EnvPredicate *pred = &s->predicates[p];
+    if (pred->kind != EnvDone)
+      continue;
+
+    u8 value = peek(state, pred->address);
+    if ((pred->op == '=' && value == pred->value) ||
+        (pred->op == '!' && value != pred->value) ||
+        (pred->op == '<' && value < pred->value) ||
+        (pred->op == '>' && value > pred->value))
+      return 1;
+  }
+  return 0;
+}
+
+/// THE ENVS
+static void observe(Server *s, int i) {
+  u8 *out = s->observations + (size_t)i * ENV_OBSERVATION_SIZE;
+  for (int page = 0; page < ENV_OBSERVATION_SIZE / PAGE_SIZE; page++)
+    memcpy(out + page * PAGE_SIZE, s->envs[i].state->pages[page]->data,
+           PAGE_SIZE);
+}
+
+// back to the start. a clone, so it's nearly free until it's written to.
+static void reset_env(Server *s, int i) {
+  Env *env = &s->envs[i];
+  if (env->state)
+    clean_emu_state(env->state);
+
+  pthread_mutex_lock(&s->clone_lock);
+  env->state = clone_instance(s->start);
+  pthread_mutex_unlock(&s->clone_lock);
+
+  env->frames = 0;
+  s->rewards[i] = 0;
+  s->dones[i] = 0;
+  s->frames[i] = 0;
+  observe(s, i);
+}
+
+static void step_env(Server *s, int i, u32 frames) {
+  if (s->dones[i])
+    reset_env(s, i);
+
+  Env *env = &s->envs[i];
+  EmuState *state = env->state;
+
+  u8 before[ENV_MAX_PREDICATES];
+  for (int p = 0; p < s->predicate_count; p++)
+    before[p] = peek(state, s->predicates[p].address);
+
+  state->input.buttons[0] = s->actions[i];
+  state->input.buttons[1] = 0;
+
+  u8 done = 0;
+  for (u32 f = 0; f < frames && !done; f++) {
+    cpu_run_frame(state);
+    env->frames++;
+    done = is_done(s, state);
+  }
+
+  float reward = 0;
+  for (int p = 0; p < s->predicate_count; p++) {
+    const EnvPredicate *pred = &s->predicates[p];
+    if (pred->kind == EnvReward)
+      reward += pred->scale * ((int)peek(state, pred->address) - before[p]);
+  }
+
+  s->rewards[i] = reward;
+  s->dones[i] = done;
+  s->frames[i] = env->frames;
+  observe(s, i);
+}
+
+static void *worker_thread(void *arg) {
+  Server *s = (Server *)arg;
+
+  for (;;) {
+    pthread_barrier_wait(&s->start_barrier);
+    if (s->quit)
+      break;
+
+    int i;
+    while ((i = atomic_fetch_add(&s->next, 1)) < s->count) {
+      if (s->job.type == EnvReset)
+        reset_env(s, i);
+      else
+        step_env(s, i, s->job.frames);
+    }
+    pthread_barrier_wait(&s->done_barrier);
+  }
+
+  return NULL;
+}
+
+// every env through one job, on the pool.
+static void run_job(Server *s, EnvMessage job) {
+  s->job = job;
+  atomic_store(&s->next, 0);
+  pthread_barrier_wait(&s->start_barrier);
+  pthread_barrier_wait(&s->done_barrier);
+}
+
+/// THE SHARED REGION
+static u32 align64(u32 x) { return (x + 63) & ~63u; }
+
+static u8 map_shared(Server *s) {
+  EnvShared layout;
+  memset(&layout, 0, sizeof(layout));
+  layout.magic = env_magic;
+  layout.version = env_version;
+  layout.envs = s->count;
+  layout.observation_size = ENV_OBSERVATION_SIZE;
+  u32 offset = align64(sizeof(EnvShared));
+  layout.actions_offset = offset;
+  offset = align64(offset + s->count);
+  layout.rewards_offset = offset;
+  offset = align64(offset + s->count * sizeof(float));
+  layout.dones_offset = offset;
+  offset = align64(offset + s->count);
+  layout.frames_offset = offset;
+  offset = align64(offset + s->count * sizeof(u32));
+  layout.observations_offset = offset;
+  layout.size = offset + s->count * ENV_OBSERVATION_SIZE;
+
+  s->memfd = memfd_create("nes-env", 0);
+  if (s->memfd < 0 || ftruncate(s->memfd, layout.size) != 0) {
+    printf("Could not make the shared region.\n");
+    return 0;
+  }
+
+  u8 *base = (u8 *)mmap(NULL, layout.size, PROT_READ | PROT_WRITE,
+                        MAP_SHARED, s->memfd, 0);
+  if (base == MAP_FAILED) {
+    printf("Could not map the shared region.\n");
+    return 0;
+  }
+
+  s->shared = (EnvShared *)base;
+  *s->shared = layout;
+  s->actions = base + layout.actions_offset;
+  s->rewards = (float *)(base + layout.rewards_offset);
+  s->dones = base + layout.dones_offset;
+  s->frames = (u32 *)(base + layout.frames_offset);
+  s->observations = base + layout.observations_offset;
+  return 1;
+}
+
+/// THE SOCKET
+static int listen_on(const char *path) {
+  struct sockaddr_un address = {0};
+  address.sun_family = AF_UNIX;
+  if (strlen(path) >= sizeof(address.sun_path)) {
+    printf("The socket path %s is too long.\n", path);
+    return -1;
+  }
+  strcpy(address.sun_path, path);
+
+  int listener = socket(AF_UNIX, SOCK_SEQPACKET, 0);
+  unlink(path); // whatever a server before us left behind.
+  if (listener < 0 ||
+      bind(listener, (struct sockaddr *)&address, sizeof(address)) != 0 ||
+      listen(listener, 1) != 0) {
+    printf("Could not listen on %s.\n", path);
+    if (listener >= 0)
+      close(listener);
+    return -1;
+  }
+  return listener;
+}
+
+// the hello, with the memfd riding along.
+static u8 send_hello(int client, int memfd) {
+  EnvMessage hello = {EnvHello, 0, 0};
+  struct iovec iov = {&hello, sizeof(hello)};
+
+  char control[CMSG_SPACE(sizeof(int))];
+  memset(control, 0, sizeof(control));
+  struct msghdr message = {0};
+  message.msg_iov = &iov;
+  message.msg_iovlen = 1;
+  message.msg_control = control;
+  message.msg_controllen = sizeof(control);
+
+  struct cmsghdr *cmsg = CMSG_FIRSTHDR(&message);
+  cmsg->cmsg_level = SOL_SOCKET;
+  cmsg->cmsg_type = SCM_RIGHTS;
+  cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+  memcpy(CMSG_DATA(cmsg), &memfd, sizeof(int));
+
+  return sendmsg(client, &message, 0) == sizeof(hello);
+}
+
+static void serve_client(Server *s, int client) {
+  EnvMessage reset = {EnvReset, 0, 0};
+  run_job(s, reset);
+  if (!send_hello(client, s->memfd))
+    return;
+
+  u64 steps = 0, frames = 0;
+  double started = now_seconds();
+  EnvMessage message;
+  while (recv(client, &message, sizeof(message), 0) == sizeof(message)) {
+    if (message.type == EnvStep) {
+      if (message.frames == 0)
+        message.frames = 1;
+      frames += (u64)message.frames * s->count;
+    } else if (message.type != EnvReset) {
+      printf("Unknown message type %u, dropping the client.\n", message.type);
+      break;
+    }
+
+    run_job(s, message);
+    EnvMessage reply = {EnvStepped, message.frames, ++steps};
+    if (send(client, &reply, sizeof(reply), 0) != sizeof(reply))
+      break;
+  }
+
+  double elapsed = now_seconds() - started;
+  printf("Client gone after %llu steps, %llu env frames (%.0f frames/s).\n",
+         (unsigned long long)steps, (unsigned long long)frames,
+         elapsed > 0 ? frames / elapsed : 0);
+  fflush(stdout);
+}
+
+u8 env_serve(EmuState *start, const char *socket_path, int envs,
+             const EnvPredicate *predicates, int predicate_count) {
+  if (envs < 1) {
+    printf("Need at least one env.\n");
+    return 0;
+  }
+
+  Server s = {0};
+  s.start = start;
+  s.count = envs;
+  s.predicates = predicates;
+  s.predicate_count = predicate_count;
+  if (!map_shared(&s))
+    return 0;
+
+  int listener = listen_on(socket_path);
+  if (listener < 0)
+    return 0;
+
+  s.envs = (Env *)calloc(envs, sizeof(Env));
+  pthread_mutex_init(&s.clone_lock, NULL);
+
+  s.workers = sysconf(_SC_NPROCESSORS_ONLN);
+  if (s.workers < 1)
+    s.workers = 1;
+  s.threads = (pthread_t *)calloc(s.workers, sizeof(pthread_t));
+  pthread_barrier_init(&s.start_barrier, NULL, s.workers + 1);
+  pthread_barrier_init(&s.done_barrier, NULL, s.workers + 1);
+  for (int i = 0; i < s.workers; i++)
+    pthread_create(&s.threads[i], NULL, worker_thread, &s);
+
+  printf("Serving %d envs on %s with %d threads, %u bytes shared.\n", envs,
+         socket_path, s.workers, s.shared->size);
+  // this only ends when it's killed, so anything left in the buffer of a
+  // redirected stdout would never get out.
+  fflush(stdout);
+
+  for (;;) {
+    int client = accept(listener, NULL, NULL);
+    if (client < 0)
+      continue;
+    printf("Client connected.\n");
+    fflush(stdout);
+    serve_client(&s, client);
+    close(client);
+  }
+}
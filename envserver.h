@@ -0,0 +1,91 @@
+#pragma once
+
+#include "cpu.h"
+#include "defines.h"
+
+// the environment server, for training agents on many copies of one game
+// from another process without paying for a process (and a pipe full of
+// serialized frames) per copy. it hosts ENV copies of the booted rom and
+// listens on a unix socket:
+//
+//   ./nes game.nes --serve /tmp/nes.sock 64 reward:0x0075 done:0x000E=0
+//
+// one client at a time. on connect the server sends a hello with a memfd
+// attached (SCM_RIGHTS), the shared region below, which the client maps.
+// after that only EnvMessages cross the socket. to step, the client writes
+// every env's buttons into actions and sends EnvStep with a frame count; the
+// server runs every env that many frames across a pool of threads, fills in
+// observations, rewards and dones, and answers with EnvStepped. EnvReset
+// puts every env back at the start the same way.
+//
+// an env that finished (done set) is put back at the start at the beginning
+// of its next step, so the client never has to reset one by hand.
+//
+// rewards and dones are predicates on ram, given when the server starts:
+//
+//   reward:ADDR[*SCALE]  the change in the byte at ADDR over the step, times
+//                        SCALE (1 if left out, negative to punish). every
+//                        reward predicate is summed.
+//   done:ADDR=V          the episode is over when the byte is V. also !=, <
+//                        and >. checked after every frame.
+//
+// a halted cpu is always done. the observation is the 2kb of work ram, until
+// there's a ppu to feed observe.h.
+
+#define env_magic 0x564E454E // "NENV"
+#define env_version 1
+
+#define ENV_MAX_PREDICATES 32
+#define ENV_OBSERVATION_SIZE 0x800
+
+typedef enum EnvMessageType {
+  EnvHello,   // server to client, with the memfd.
+  EnvStep,    // client to server, frames is how many.
+  EnvReset,   // client to server.
+  EnvStepped, // server to client, the shared region is ready to read.
+} EnvMessageType;
+
+// everything that crosses the socket, both ways. a seqpacket socket, so one
+// send is one message.
+typedef struct EnvMessage {
+  u32 type;
+  u32 frames;
+  u64 step; // steps (and resets) done since the client connected.
+} EnvMessage;
+
+// the start of the shared region. the arrays follow it, envs entries each,
+// at the offsets given (from the start of the region), each 64 byte aligned.
+typedef struct EnvShared {
+  u32 magic;
+  u32 version;
+  u32 envs;
+  u32 observation_size; // bytes per env.
+
+  u32 actions_offset;      // u8, port 0 buttons. written by the client.
+  u32 rewards_offset;      // float.
+  u32 dones_offset;        // u8, 1 if the episode ended during the step.
+  u32 frames_offset;       // u32, frames into the episode.
+  u32 observations_offset; // observation_size bytes each.
+  u32 size;                // of the whole region.
+} EnvShared;
+
+typedef enum EnvPredicateKind {
+  EnvReward,
+  EnvDone,
+} EnvPredicateKind;
+
+typedef struct EnvPredicate {
+  EnvPredicateKind kind;
+  u16 address;
+  float scale; // rewards.
+  char op;     // dones: '=', '!' (for !=), '<' or '>'.
+  u8 value;
+} EnvPredicate;
+
+// one predicate from the command line form above. 1 if it made sense.
+u8 env_parse_predicate(const char *text, EnvPredicate *out);
+
+// serves until the process is killed. every env starts as a copy of start.
+// 0 if the socket couldn't be set up.
+u8 env_serve(EmuState *start, const char *socket_path, int envs,
+             const EnvPredicate *predicates, int predicate_count);
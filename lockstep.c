@@ -0,0 +1,374 @@
+#include "lockstep.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+// one register of every machine, what the vector path works on. plain
+// arrays in LockstepState, loaded and stored whole.
+typedef u32 LockstepLanes __attribute__((vector_size(4 * LOCKSTEP_WIDTH)));
+
+// every lane set to v.
+#define LANES(v) ((LockstepLanes){v, v, v, v, v, v, v, v})
+
+// how long each opcode the vector path can run is, 0 for everything else.
+static const u8 vector_length[256] = {
+    // implied.
+    [0xAA] = 1, [0xA8] = 1, [0x8A] = 1, [0x98] = 1, [0xBA] = 1, [0x9A] = 1,
+    [0xE8] = 1, [0xC8] = 1, [0xCA] = 1, [0x88] = 1, [0x18] = 1, [0x38] = 1,
+    [0x58] = 1, [0x78] = 1, [0xB8] = 1, [0xD8] = 1, [0xF8] = 1, [0xEA] = 1,
+    // accumulator.
+    [0x0A] = 1, [0x4A] = 1, [0x2A] = 1, [0x6A] = 1,
+    // immediate.
+    [0xA9] = 2, [0xA2] = 2, [0xA0] = 2, [0x29] = 2, [0x09] = 2, [0x49] = 2,
+    [0x69] = 2, [0xE9] = 2, [0xC9] = 2, [0xE0] = 2, [0xC0] = 2,
+    // relative.
+    [0x10] = 2, [0x30] = 2, [0x50] = 2, [0x70] = 2, [0x90] = 2, [0xB0] = 2,
+    [0xD0] = 2, [0xF0] = 2,
+};
+
+LockstepState *make_lockstep_state(EmuState **machines, int count) {
+  LockstepState *ls = (LockstepState *)calloc(1, sizeof(LockstepState));
+  ls->count = count < LOCKSTEP_WIDTH ? count : LOCKSTEP_WIDTH;
+  memcpy(ls->machines, machines, ls->count * sizeof(EmuState *));
+  return ls;
+}
+
+void clean_lockstep_state(LockstepState *ls) { free(ls); }
+
+static void load_lane(LockstepState *ls, int i) {
+  CPUState *cs = ls->machines[i]->cpu_state;
+  ls->pc[i] = cs->pc;
+  ls->a[i] = cs->a;
+  ls->x[i] = cs->x;
+  ls->y[i] = cs->y;
+  ls->sp[i] = cs->sp;
+  ls->status[i] = cs->status;
+  ls->cycles[i] = cs->cycles;
+}
+
+static void store_lane(LockstepState *ls, int i) {
+  CPUState *cs = ls->machines[i]->cpu_state;
+  cs->pc = ls->pc[i];
+  cs->a = ls->a[i];
+  cs->x = ls->x[i];
+  cs->y = ls->y[i];
+  cs->sp = ls->sp[i];
+  cs->status = ls->status[i];
+  cs->cycles = ls->cycles[i];
+}
+
+// 1 if every machine has the same prg-rom, so the code at any pc is the same
+// for all of them. looked at once a frame, the cpu can't write there.
+static u8 same_rom(LockstepState *ls) {
+  for (int i = 1; i < ls->count; i++) {
+    for (int page = 0x80; page < PAGE_COUNT; page++) {
+      Page *ours = ls->machines[0]->pages[page];
+      Page *theirs = ls->machines[i]->pages[page];
+      if (ours != theirs && memcmp(ours->data, theirs->data, PAGE_SIZE) != 0)
+        return 0;
+    }
+  }
+  return 1;
+}
+
+/// THE VECTOR PATH
+// runs the machines in group, all at the same pc, for as long as they agree:
+// until an opcode only the scalar path knows, a branch that splits them, the
+// pc reaching stop (where a machine that's ahead is waiting to join), or the
+// one closest to the end of its frame getting there. with them all running
+// the same instructions the pc and the cycles spent are the same in every
+// lane, only the registers need vectors. written with vector extensions and
+// built twice, for avx2 (one ymm register holds every lane) and for plain
+// x86-64, picked when the program loads. each case is the scalar instruction
+// from cpu.c, lane-wise. returns how many instructions it got through.
+__attribute__((target_clones("avx2", "default"))) static u32
+vector_run(LockstepState *ls, int leader, const LockstepLanes *mask, u32 stop,
+           u64 margin) {
+  EmuState *rom = ls->machines[leader];
+  LockstepLanes group = *mask;
+  LockstepLanes a, x, y, sp, p;
+  memcpy(&a, ls->a, sizeof(a));
+  memcpy(&x, ls->x, sizeof(x));
+  memcpy(&y, ls->y, sizeof(y));
+  memcpy(&sp, ls->sp, sizeof(sp));
+  memcpy(&p, ls->status, sizeof(p));
+
+  // the lanes outside the group keep what they had.
+  LockstepLanes old_a = a, old_x = x, old_y = y, old_sp = sp, old_p = p;
+
+  u32 pc = ls->pc[leader];
+  u64 spent = 0;
+  u32 steps = 0;
+  // a branch that splits the group ends the run with a pc and cycles per lane.
+  LockstepLanes split_pc = LANES(0), split_cycles = LANES(0);
+  u8 split = 0;
+
+  while (!split && pc >= 0x8000 && pc < stop && pc != 0xFFFF &&
+         spent < margin) {
+    u8 opcode = peek(rom, pc);
+    u32 length = vector_length[opcode];
+    if (length == 0)
+      break;
+
+    u32 operand = peek(rom, (u16)(pc + 1));
+    LockstepLanes carry = p & Carry;
+    LockstepLanes result = a; // what N and Z end up describing.
+    u8 sets_nz = 1;
+
+    steps++;
+    spent += cycle_table[opcode];
+    pc = (pc + length) & 0xFFFF;
+
+    switch (opcode) {
+    case 0xAA: // tax
+      result = x = a;
+      break;
+    case 0xA8: // tay
+      result = y = a;
+      break;
+    case 0x8A: // txa
+      result = a = x;
+      break;
+    case 0x98: // tya
+      result = a = y;
+      break;
+    case 0xBA: // tsx
+      result = x = sp;
+      break;
+    case 0x9A: // txs
+      sp = x;
+      sets_nz = 0;
+      break;
+    case 0xE8: // inx
+      result = x = (x + 1) & 0xFF;
+      break;
+    case 0xC8: // iny
+      result = y = (y + 1) & 0xFF;
+      break;
+    case 0xCA: // dex
+      result = x = (x - 1) & 0xFF;
+      break;
+    case 0x88: // dey
+      result = y = (y - 1) & 0xFF;
+      break;
+    case 0x18: // clc
+      p &= ~Carry;
+      sets_nz = 0;
+      break;
+    case 0x38: // sec
+      p |= Carry;
+      sets_nz = 0;
+      break;
+    case 0x58: // cli
+      p &= ~Interrupt;
+      sets_nz = 0;
+      break;
+    case 0x78: // sei
+      p |= Interrupt;
+      sets_nz = 0;
+      break;
+    case 0xB8: // clv
+      p &= ~Overflow;
+      sets_nz = 0;
+      break;
+    case 0xD8: // cld
+      p &= ~Decimal;
+      sets_nz = 0;
+      break;
+    case 0xF8: // sed
+      p |= Decimal;
+      sets_nz = 0;
+      break;
+    case 0xEA: // nop
+      sets_nz = 0;
+      break;
+    case 0x0A: // asl a
+      p = (p & ~Carry) | (a >> 7);
+      result = a = (a << 1) & 0xFF;
+      break;
+    case 0x4A: // lsr a
+      p = (p & ~Carry) | (a & 1);
+      result = a = a >> 1;
+      break;
+    case 0x2A: // rol a
+      p = (p & ~Carry) | (a >> 7);
+      result = a = ((a << 1) | carry) & 0xFF;
+      break;
+    case 0x6A: // ror a
+      p = (p & ~Carry) | (a & 1);
+      result = a = (a >> 1) | (carry << 7);
+      break;
+    case 0xA9: // lda #
+      result = a = LANES(operand);
+      break;
+    case 0xA2: // ldx #
+      result = x = LANES(operand);
+      break;
+    case 0xA0: // ldy #
+      result = y = LANES(operand);
+      break;
+    case 0x29: // and #
+      result = a = a & operand;
+      break;
+    case 0x09: // ora #
+      result = a = a | operand;
+      break;
+    case 0x49: // eor #
+      result = a = a ^ operand;
+      break;
+    case 0xE9: // sbc #, adc with the operand inverted.
+      operand ^= 0xFF;
+      // fall through
+    case 0x69: { // adc #
+      LockstepLanes sum = a + operand + carry;
+      p = (p & ~(Carry | Overflow)) | (sum >> 8) |
+          ((~(a ^ operand) & (a ^ sum) & 0x80) >> 1);
+      result = a = sum & 0xFF;
+      break;
+    }
+    case 0xC9: // cmp #
+    case 0xE0: // cpx #
+    case 0xC0: { // cpy #
+      LockstepLanes reg = (opcode == 0xC9) ? a : (opcode == 0xE0) ? x : y;
+      p = (p & ~Carry) | ((LockstepLanes)(reg >= operand) & Carry);
+      result = (reg - operand) & 0xFF;
+      break;
+    }
+    default: { // the branches. bit 5 says which way, bits 6-7 which flag.
+      static const u8 flags[4] = {Negative, Overflow, Carry, Zero};
+      LockstepLanes set = (LockstepLanes)((p & flags[opcode >> 6]) != 0);
+      LockstepLanes taken = ((opcode & 0x20) ? set : ~set) & group;
+
+      u32 target = (pc + (signed char)operand) & 0xFFFF;
+      u32 penalty = 1 + ((pc & 0xFF00) != (target & 0xFF00));
+
+      u32 all = 1, any = 0;
+      for (int i = 0; i < LOCKSTEP_WIDTH; i++) {
+        all &= (taken[i] == group[i]);
+        any |= taken[i];
+      }
+
+      if (all && any) {
+        pc = target;
+        spent += penalty;
+      } else if (any) {
+        split_pc = (LANES(target) & taken) | (LANES(pc) & ~taken);
+        split_cycles = taken & penalty;
+        split = 1;
+      }
+      sets_nz = 0;
+      break;
+    }
+    }
+
+    if (sets_nz)
+      p = (p & ~(Zero | Negative)) | ((LockstepLanes)(result == 0) & Zero) |
+          (result & Negative);
+  }
+
+  a = (a & group) | (old_a & ~group);
+  x = (x & group) | (old_x & ~group);
+  y = (y & group) | (old_y & ~group);
+  sp = (sp & group) | (old_sp & ~group);
+  p = (p & group) | (old_p & ~group);
+  memcpy(ls->a, &a, sizeof(a));
+  memcpy(ls->x, &x, sizeof(x));
+  memcpy(ls->y, &y, sizeof(y));
+  memcpy(ls->sp, &sp, sizeof(sp));
+  memcpy(ls->status, &p, sizeof(p));
+
+  int size = 0;
+  for (int i = 0; i < LOCKSTEP_WIDTH; i++) {
+    if (!group[i])
+      continue;
+    ls->pc[i] = split ? split_pc[i] : pc;
+    ls->cycles[i] += spent + split_cycles[i];
+    size++;
+  }
+  ls->vector_steps += (u64)steps * size;
+  return steps;
+}
+
+/// THE SCALAR PATH
+static u8 vectorizable(EmuState *state, u16 pc) {
+  return pc >= 0x8000 && vector_length[peek(state, pc)];
+}
+
+// one machine on its own, through handle_instruction, up to the next opcode
+// the vector path could take (where the others might catch up with it) or
+// the end of its frame. the registers only go back and forth once per run.
+static void scalar_run(LockstepState *ls, int i, u64 frame_end) {
+  EmuState *state = ls->machines[i];
+  CPUState *cs = state->cpu_state;
+  store_lane(ls, i);
+  do {
+    if (cs->pc == 0xFFFF)
+      cs->pc = 0x8000;
+    handle_instruction(state);
+    ls->scalar_steps++;
+  } while (cs->cycles < frame_end && !cs->shutting_down &&
+           !vectorizable(state, cs->pc == 0xFFFF ? 0x8000 : cs->pc));
+  load_lane(ls, i);
+}
+
+void lockstep_run_frame(LockstepState *ls) {
+  u64 frame_end[LOCKSTEP_WIDTH];
+  for (int i = 0; i < ls->count; i++) {
+    load_lane(ls, i);
+    frame_end[i] = (ls->cycles[i] / CYCLES_PER_FRAME + 1) * CYCLES_PER_FRAME;
+  }
+  // machines on different roms just take turns.
+  u8 vector = ls->count > 1 && same_rom(ls);
+
+  for (;;) {
+    // the same checks as cpu_run_frame, machine by machine.
+    u8 running[LOCKSTEP_WIDTH] = {0};
+    int leader = -1;
+    for (int i = 0; i < ls->count; i++) {
+      if (ls->cycles[i] >= frame_end[i] ||
+          ls->machines[i]->cpu_state->shutting_down)
+        continue;
+      // lol
+      if (ls->pc[i] == 0xFFFF)
+        ls->pc[i] = 0x8000;
+
+      running[i] = 1;
+      if (leader < 0 || ls->pc[i] < ls->pc[leader])
+        leader = i;
+    }
+    if (leader < 0)
+      break;
+
+    // only the machines furthest behind in the rom, at the lowest pc, get to
+    // go. the ones ahead wait, so machines that split up at a branch meet
+    // again where the two paths join.
+    LockstepLanes group = LANES(0);
+    int size = 0;
+    u32 stop = 0x10000;
+    u64 margin = ~0ull;
+    for (int i = 0; i < ls->count; i++) {
+      if (!running[i])
+        continue;
+      if (ls->pc[i] != ls->pc[leader]) {
+        if (ls->pc[i] < stop)
+          stop = ls->pc[i];
+        continue;
+      }
+      group[i] = ~0u;
+      size++;
+      if (frame_end[i] - ls->cycles[i] < margin)
+        margin = frame_end[i] - ls->cycles[i];
+    }
+
+    if (vector && size > 1 && vector_run(ls, leader, &group, stop, margin))
+      continue;
+    for (int i = 0; i < ls->count; i++)
+      if (group[i])
+        scalar_run(ls, i, frame_end[i]);
+  }
+
+  for (int i = 0; i < ls->count; i++) {
+    store_lane(ls, i);
+    apu_end_frame(ls->machines[i]);
+  }
+}
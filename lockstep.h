@@ -0,0 +1,42 @@
+#pragma once
+
+#include "cpu.h"
+#include "defines.h"
+
+// lockstep execution, for running many copies of one rom (usually with
+// different input) on one core. the registers of LOCKSTEP_WIDTH machines
+// are kept side by side, struct of arrays. while every running machine is
+// at the same pc, on an opcode that only touches registers and flags
+// (transfers, inc/dec of X and Y, flag ops, the immediate loads, logic,
+// adc/sbc and compares, the accumulator shifts, branches) they all run it
+// at once, one machine per lane, AVX2 where the cpu has it. anything that
+// touches memory, and any step where the pcs disagree, goes through the
+// normal handle_instruction one machine at a time, so the results are
+// exactly what cpu_run_frame would have made.
+//
+// tracing and profiling only see the scalar steps.
+
+#define LOCKSTEP_WIDTH 8
+
+typedef struct LockstepState {
+  EmuState *machines[LOCKSTEP_WIDTH]; // borrowed.
+  int count;
+
+  // the registers, only valid inside lockstep_run_frame. between frames the
+  // machines' own CPUStates are the real thing, so they can be read, saved
+  // and loaded as usual.
+  u32 pc[LOCKSTEP_WIDTH], a[LOCKSTEP_WIDTH], x[LOCKSTEP_WIDTH];
+  u32 y[LOCKSTEP_WIDTH], sp[LOCKSTEP_WIDTH], status[LOCKSTEP_WIDTH];
+  u64 cycles[LOCKSTEP_WIDTH];
+
+  // instructions run, summed over the machines, by each path.
+  u64 vector_steps;
+  u64 scalar_steps;
+} LockstepState;
+
+// up to LOCKSTEP_WIDTH machines, they don't have to be in the same place.
+LockstepState *make_lockstep_state(EmuState **machines, int count);
+void clean_lockstep_state(LockstepState *ls);
+
+// cpu_run_frame, for every machine.
+void lockstep_run_frame(LockstepState *ls);
@@ -5,11 +5,23 @@
 
 // components/modules
 #include "audio.h"
+#include "batch.h"
 // the core
 #include "cpu.h"
+#include "envserver.h"
+#include "movie.h"
+#include "netplay.h"
+#include "nsf.h"
+#include "pace.h"
+#include "profile.h"
+#include "rewind.h"
+#include "runahead.h"
+#include "search.h"
+#include "trace.h"
 #include "video.h"
 
 #include <stdlib.h>
+#include <string.h>
 
 CommonState *make_common_state() {
   CommonState *cs = (CommonState *)malloc(sizeof(CommonState));
@@ -22,15 +34,53 @@ void clean_common_state(CommonState *cs) {
   free(cs);
 }
 
+// the tests are assembled from foo.sasm into foo.sasm.bin, so for those
+// there's source to label the profile with.
+void write_profile(char *rom_path) {
+  char sasm_path[512];
+  snprintf(sasm_path, sizeof(sasm_path), "%s", rom_path);
+
+  size_t length = strlen(sasm_path);
+  u8 has_source =
+      length > 9 && strcmp(sasm_path + length - 9, ".sasm.bin") == 0;
+  if (has_source)
+    sasm_path[length - 4] = '\0';
+
+  profile_write(emu_state, PROFILE_PATH, has_source ? sasm_path : NULL);
+  profile_clean();
+}
+
 int main(int argc, char *argv[]) {
   CommonState *cs;
 
+  if (argc >= 4 && strcmp(argv[1], "--trace-to-text") == 0)
+    return !trace_to_text(argv[2], argv[3]);
+
+  // headless, every core, no window.
+  if (argc >= 4 && strcmp(argv[1], "--batch") == 0)
+    return !batch_run(argv[2], argv[3], (argc >= 5) ? atoi(argv[4]) : 0);
+
+  // headless too, every track of an nsf to wav as fast as it'll go.
+  if (argc >= 5 && strcmp(argv[1], "--nsf") == 0)
+    return !nsf_render(argv[2], atof(argv[3]), argv[4],
+                       (argc >= 6) ? atoi(argv[5]) : 0);
+
   { // the main initializer. call all the module inits.
     cs = make_common_state();
 
     { // create the cpu, read the file and handle the commandline args.
       if (argc < 2) {
         printf("Pass a path to a rom file.\n");
+        printf("Usage: %s rom [--netplay player local_port remote_port]\n"
+               "       %s rom [--record movie | --play movie]\n"
+               "       %s rom --search [+|-]address movie [budget]\n"
+               "       %s rom --serve socket envs [predicate...]\n"
+               "       %s rom [...] --audio null|wav:file|alsa\n"
+               "       %s --trace-to-text trace.bin trace.txt\n"
+               "       %s --batch manifest results.jsonl [workers]\n"
+               "       %s --nsf music.nsf seconds out_prefix [workers]\n",
+               argv[0], argv[0], argv[0], argv[0], argv[0], argv[0],
+               argv[0], argv[0]);
         return 1;
       }
 
@@ -48,26 +98,143 @@ int main(int argc, char *argv[]) {
       fclose(file); // Close the file
     }
 
+    // headless as well, eg. push $0075 as high as it'll go:
+    //   ./nes game.nes --search +0x0075 best.movie [budget_frames]
+    if (argc >= 5 && strcmp(argv[2], "--search") == 0) {
+      SearchObjective objective = {
+          (u16)strtol(argv[3] + (argv[3][0] == '+' || argv[3][0] == '-'),
+                      NULL, 0),
+          argv[3][0] != '-'};
+      u64 budget = (argc >= 6) ? strtoull(argv[5], NULL, 0) : 1000000;
+      if (is_trace || is_profile)
+        printf("Not tracing or profiling, --search runs machines on several "
+               "threads.\n");
+      u8 ok = search_run(emu_state, objective, budget, argv[4]);
+      cpu_clean();
+      clean_common_state(cs);
+      return ok ? 0 : 1;
+    }
+
+    // headless, a pool of envs for a training process to step through a
+    // unix socket and shared memory, see envserver.h:
+    //   ./nes game.nes --serve /tmp/nes.sock 64 reward:0x0075 done:0x000E=0
+    if (argc >= 5 && strcmp(argv[2], "--serve") == 0) {
+      if (is_trace || is_profile)
+        printf("Not tracing or profiling, --serve runs machines on several "
+               "threads.\n");
+      EnvPredicate predicates[ENV_MAX_PREDICATES];
+      int count = 0;
+      u8 ok = 1;
+      for (int i = 5; ok && i < argc; i++) {
+        ok = count < ENV_MAX_PREDICATES &&
+             env_parse_predicate(argv[i], &predicates[count++]);
+        if (!ok)
+          printf("Bad predicate %s.\n", argv[i]);
+      }
+      if (ok)
+        ok = env_serve(emu_state, argv[3], atoi(argv[4]), predicates, count);
+      cpu_clean();
+      clean_common_state(cs);
+      return ok ? 0 : 1;
+    }
+
+    // the trace ring and the profile's counters each take one thread's
+    // records, so they only start once the modes that run machines on
+    // several threads are out of the way.
+    if (is_trace)
+      trace_init(TRACE_PATH);
+    if (is_profile)
+      profile_init();
+
+    if (argc >= 4 && strcmp(argv[2], "--play") == 0) {
+      // headless, no window, as fast as the core goes.
+      u8 ok = movie_play(emu_state, argv[3]);
+      if (is_profile)
+        write_profile(argv[1]);
+      trace_clean();
+      cpu_clean();
+      clean_common_state(cs);
+      return ok ? 0 : 1;
+    }
+
+    // two instances on the same machine, eg.
+    //   ./nes game.nes --netplay 1 7000 7001
+    //   ./nes game.nes --netplay 2 7001 7000
+    if (argc >= 6 && strcmp(argv[2], "--netplay") == 0) {
+      if (!netplay_init(atoi(argv[3]) == 2, atoi(argv[4]), atoi(argv[5])))
+        return 1;
+    }
+
     video_init();
+    rewind_init(REWIND_CAP, REWIND_INTERVAL);
+    runahead_init(RUNAHEAD_FRAMES);
+
+    // sound, through whichever backend is asked for at the end of the line,
+    // eg. --audio wav:out.wav. the device by default, if there is one.
+    const char *audio_backend = is_alsa ? "alsa" : "null";
+    for (int i = 2; i + 1 < argc; i++)
+      if (strcmp(argv[i], "--audio") == 0)
+        audio_backend = argv[i + 1];
+    audio_init(audio_backend, emu_state);
+    pace_init(video_refresh_rate(), 1);
+
+    if (argc >= 4 && strcmp(argv[2], "--record") == 0) {
+      if (!movie_record_init(argv[3], emu_state, 1))
+        return 1;
+    }
   }
 
   // the main loop, call all the update functions.
   for (;;) {
     // both can close the application for different reasons, marshall these
     // two variables into a single cs->is_running.
-    cpu_update(cs->is_running);
+    if (netplay_state != NULL) {
+      // netplay owns the timeline, so no rewinding.
+      netplay_update(emu_state, video_read_buttons());
+      *cs->is_running = !emu_state->cpu_state->shutting_down;
+      runahead_update(emu_state, video_present);
+    } else if (movie_state == NULL && video_key_held(GLFW_KEY_BACKSPACE)) {
+      // hold backspace to step back through the history, a frame at a time.
+      // not while recording, a movie can't have holes in it.
+      rewind_step_back(emu_state);
+      video_present(emu_state);
+    } else {
+      emu_state->input.buttons[0] = video_read_buttons();
+      cpu_update(cs->is_running);
+      if (movie_state != NULL)
+        movie_record_update(emu_state);
+      runahead_update(emu_state, video_present);
+      rewind_update(emu_state);
+    }
+    audio_update(emu_state); // never waits, see audio.h.
     video_update(cs->is_running); // prefer the video update? how can i stop the
     // two modules from overwriting changes to the is_running signal? i could
     // check after each module update? should the cpu brk even close the
     // application?
 
-    printf("cs: %d\n", *cs->is_running);
     if (*cs->is_running == 0)
       break;
+    pace_update(emu_state);
   }
 
   // the main cleanup, call all the destructor functions.
   {
+    if (movie_state != NULL)
+      movie_record_clean();
+    if (netplay_state != NULL) {
+      netplay_report();
+      netplay_clean();
+    }
+    rewind_report();
+    rewind_clean();
+    pace_report();
+    pace_clean();
+    audio_report();
+    audio_clean(emu_state);
+    runahead_clean();
+    if (is_profile)
+      write_profile(argv[1]);
+    trace_clean();
     cpu_clean();
     video_clean();
     clean_common_state(cs);
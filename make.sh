@@ -1,5 +1,8 @@
 #!/bin/sh
 
+# the core, everything except the glfw frontend.
+core=$(ls *.c | grep -v -e '^main.c$' -e '^video.c$')
+
 # build the assets
 if [ ${1:-"n"} == "assets" ]; then
 	cd assets 
@@ -7,5 +10,36 @@ if [ ${1:-"n"} == "assets" ]; then
 	cd ..
 fi
 
-# build the program
-gcc -o nes *.c -lGL -lglfw -lGLEW -g
+# build the benchmarks, headless and optimized.
+if [ ${1:-"n"} == "bench" ]; then
+	gcc -O2 -o nes_bench bench/*.c $core -lpthread -lm
+	exit
+fi
+
+# build the conformance runner, the golden log harness and the env server's
+# client test, same deal.
+if [ ${1:-"n"} == "test" ]; then
+	gcc -O2 -o nes_test tests/runner.c $core -lpthread -lm
+	gcc -O2 -o nes_golden tests/golden.c $core -lpthread -lm
+	gcc -O2 -o nes_env tests/env.c $core -lpthread -lm
+	exit
+fi
+
+# the core as a library, static and shared, for anything that wants to
+# embed it. see nescore.h.
+if [ ${1:-"n"} == "lib" ]; then
+	mkdir -p build
+	for file in $core; do
+		gcc -O2 -fPIC -c "$file" -o "build/${file%.c}.o"
+	done
+	ar rcs libnescore.a build/*.o
+	gcc -shared -o libnescore.so build/*.o -lpthread -lm
+	exit
+fi
+
+# build the program, with the alsa audio backend if alsa's there.
+alsa=""
+if pkg-config --exists alsa 2>/dev/null; then
+	alsa="-Dis_alsa=1 $(pkg-config --libs alsa)"
+fi
+gcc -o nes *.c -lGL -lglfw -lGLEW -lpthread -lm $alsa -g
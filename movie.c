@@ -0,0 +1,195 @@
+#include "movie.h"
+#include "util.h"
+
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+MovieState *movie_state = NULL;
+
+MovieState *make_movie_state() {
+  MovieState *ms = (MovieState *)malloc(sizeof(MovieState));
+  ms->file = NULL;
+  memset(&ms->header, 0, sizeof(MovieHeader));
+  ms->scratch = (SaveState *)malloc(sizeof(SaveState));
+  return ms;
+}
+
+void clean_movie_state(MovieState *ms) {
+  free(ms->scratch);
+  free(ms);
+}
+
+/// RECORDING
+u8 movie_record_init(const char *path, EmuState *state, u8 ports) {
+  movie_state = make_movie_state();
+  MovieState *ms = movie_state;
+
+  ms->file = fopen(path, "wb");
+  if (ms->file == NULL) {
+    printf("Failed to open %s to record a movie into.\n", path);
+    clean_movie_state(ms);
+    movie_state = NULL;
+    return 0;
+  }
+
+  ms->header.magic = movie_magic;
+  ms->header.version = movie_version;
+  ms->header.rom_hash = hash_bytes(state->rom, state->rom_size);
+  ms->header.frames = 0;
+  ms->header.ports = ports;
+  // anything past power on needs the machine as it is right now.
+  ms->header.has_snapshot = state->cpu_state->cycles != 0;
+  ms->header.hash_interval = MOVIE_HASH_INTERVAL;
+
+  // the frame count is patched in when we're done.
+  fwrite(&ms->header, sizeof(MovieHeader), 1, ms->file);
+  if (ms->header.has_snapshot) {
+    save_state(state, ms->scratch);
+    fwrite(ms->scratch, sizeof(SaveState), 1, ms->file);
+  }
+
+  printf("Recording a movie to %s.\n", path);
+  return 1;
+}
+
+void movie_record_update(EmuState *state) {
+  MovieState *ms = movie_state;
+
+  fwrite(state->input.buttons, 1, ms->header.ports, ms->file);
+  ms->header.frames++;
+
+  if (ms->header.frames % ms->header.hash_interval == 0) {
+    u64 hash = hash_machine(state);
+    fwrite(&hash, sizeof(hash), 1, ms->file);
+  }
+}
+
+void movie_record_clean() {
+  MovieState *ms = movie_state;
+
+  rewind(ms->file);
+  fwrite(&ms->header, sizeof(MovieHeader), 1, ms->file);
+  fclose(ms->file);
+
+  printf("Recorded %u frames.\n", ms->header.frames);
+  clean_movie_state(ms);
+  movie_state = NULL;
+}
+
+/// PLAYBACK
+static double now_seconds() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// runs the frames after the header (and snapshot). 1 if every hash held.
+static u8 play_frames(EmuState *state, const MovieHeader *header,
+                      const u8 *cursor, const u8 *end) {
+  double start = now_seconds();
+  u32 frame;
+  u32 played = 0;
+  u32 checked = 0;
+  u8 hash_missing = 0; // the input was all there but a hash wasn't.
+  u8 ok = 1;
+
+  for (frame = 0; frame < header->frames; frame++) {
+    if (cursor + header->ports > end)
+      break; // truncated, caught below.
+
+    state->input.buttons[0] = cursor[0];
+    state->input.buttons[1] = (header->ports == 2) ? cursor[1] : 0;
+    cursor += header->ports;
+
+    cpu_run_frame(state);
+    played++;
+
+    if ((frame + 1) % header->hash_interval == 0) {
+      u64 expected;
+      if (cursor + sizeof(expected) > end) {
+        hash_missing = 1; // even on the last frame, caught below.
+        break;
+      }
+      memcpy(&expected, cursor, sizeof(expected));
+      cursor += sizeof(expected);
+
+      if (hash_machine(state) != expected) {
+        printf("Movie desynced: hash mismatch after frame %u.\n", frame);
+        ok = 0;
+        break;
+      }
+      checked++;
+    }
+  }
+
+  double elapsed = now_seconds() - start;
+
+  if (ok && hash_missing) {
+    printf("The movie is truncated, the hash after frame %u is missing.\n",
+           played - 1);
+    ok = 0;
+  } else if (ok && played != header->frames) {
+    printf("The movie is truncated, it stops at frame %u of %u.\n", played,
+           header->frames);
+    ok = 0;
+  }
+
+  printf("Played %u frames in %.3fs (%.0f fps, %.1fx realtime), %u hashes "
+         "checked.\n",
+         played, elapsed, played / elapsed, played / elapsed / 60.0, checked);
+  return ok;
+}
+
+u8 movie_play(EmuState *state, const char *path) {
+  int fd = open(path, O_RDONLY);
+  if (fd < 0) {
+    printf("Failed to open the movie %s.\n", path);
+    return 0;
+  }
+
+  struct stat st;
+  fstat(fd, &st);
+  size_t size = st.st_size;
+
+  // map the whole thing, the kernel streams it in behind us and the frame
+  // loop never has to make a syscall.
+  const u8 *data = (const u8 *)mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (data == MAP_FAILED) {
+    printf("Failed to map the movie %s.\n", path);
+    return 0;
+  }
+  madvise((void *)data, size, MADV_SEQUENTIAL);
+
+  const u8 *cursor = data + sizeof(MovieHeader);
+  const u8 *end = data + size;
+  MovieHeader header;
+  u8 ok = 0;
+
+  if (size >= sizeof(MovieHeader))
+    memcpy(&header, data, sizeof(MovieHeader));
+
+  if (size < sizeof(MovieHeader) || header.magic != movie_magic ||
+      header.version != movie_version || header.ports < 1 ||
+      header.ports > 2 || header.hash_interval == 0) {
+    printf("%s isn't a movie this build can play.\n", path);
+  } else if (header.rom_hash != hash_bytes(state->rom, state->rom_size)) {
+    printf("The movie was recorded against a different rom.\n");
+  } else if (header.has_snapshot &&
+             (cursor + sizeof(SaveState) > end ||
+              !load_state(state, (const SaveState *)cursor))) {
+    printf("The movie's start snapshot is missing or unusable.\n");
+  } else {
+    if (header.has_snapshot)
+      cursor += sizeof(SaveState);
+    ok = play_frames(state, &header, cursor, end);
+  }
+
+  munmap((void *)data, size);
+  return ok;
+}
@@ -0,0 +1,48 @@
+#pragma once
+
+#include "cpu.h"
+#include "defines.h"
+#include "state.h"
+
+#include <stdio.h>
+
+// input movies. the file is a MovieHeader, then a SaveState if the movie
+// doesn't start from power on, then one byte per controller port per frame.
+// every hash_interval frames, the hash_machine of the machine after that
+// frame follows its input bytes, so playback can check it's still on the
+// same timeline as the recording.
+
+#define movie_magic 0x4D53454E // "NESM", little endian.
+#define movie_version 3 // 2 moved to hash_machine, 3 hashes the apu.
+
+#define MOVIE_HASH_INTERVAL 60 // a hash a second.
+
+typedef struct MovieHeader {
+  u32 magic;
+  u32 version;
+  u64 rom_hash; // hash_bytes of the whole rom file.
+  u32 frames;
+  u8 ports;        // 1 or 2.
+  u8 has_snapshot; // if not, the movie starts from power on.
+  u16 hash_interval;
+} MovieHeader;
+
+typedef struct MovieState { // only the recording side needs any state.
+  FILE *file;
+  MovieHeader header;
+  SaveState *scratch; // for the starting snapshot.
+} MovieState;
+
+// NULL unless we're recording.
+extern MovieState *movie_state;
+
+// start recording everything from the current frame on. 1 on success.
+u8 movie_record_init(const char *path, EmuState *state, u8 ports);
+// call after every emulated frame.
+void movie_record_update(EmuState *state);
+// finishes the file.
+void movie_record_clean();
+
+// play a movie back headless, as fast as the core will go. 1 if the rom
+// matched and every hash checked out.
+u8 movie_play(EmuState *state, const char *path);
@@ -0,0 +1,131 @@
+#include "nescore.h"
+#include "cpu.h"
+#include "observe.h"
+#include "state.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+_Static_assert(NES_OBSERVATION_SIZE == OBSERVE_SIZE &&
+                   NES_OBSERVATION_WIDTH == OBSERVE_WIDTH,
+               "nescore.h and observe.h disagree on the observation");
+
+struct NesCore {
+  EmuState *state;       // NULL until a rom is loaded.
+  u8 *image;             // our copy, the machine borrows it.
+  ObserveState *observe; // NULL while the stage is off.
+  AudioBuffer *audio;    // lent to the machine.
+};
+
+NesCore *nes_create(void) {
+  NesCore *nes = (NesCore *)malloc(sizeof(NesCore));
+  nes->state = NULL;
+  nes->image = NULL;
+  nes->observe = NULL;
+  nes->audio = NULL;
+  return nes;
+}
+
+static void unload(NesCore *nes) {
+  if (nes->state)
+    clean_emu_state(nes->state);
+  free(nes->image);
+  if (nes->audio)
+    clean_audio_buffer(nes->audio);
+  nes->state = NULL;
+  nes->image = NULL;
+  nes->audio = NULL;
+}
+
+void nes_destroy(NesCore *nes) {
+  unload(nes);
+  if (nes->observe)
+    clean_observe_state(nes->observe);
+  free(nes);
+}
+
+int nes_load_rom(NesCore *nes, const uint8_t *image, size_t size) {
+  unload(nes);
+  if (nes->observe)
+    observe_reset(nes->observe);
+
+  nes->image = (u8 *)malloc(size);
+  memcpy(nes->image, image, size);
+  nes->state = make_emu_state();
+
+  if (!load_rom(nes->state, nes->image, size)) {
+    unload(nes);
+    return 0;
+  }
+  nes->audio = make_audio_buffer(NES_SAMPLE_RATE);
+  nes->state->audio = nes->audio;
+  return 1;
+}
+
+void nes_set_input(NesCore *nes, int port, uint8_t buttons) {
+  if (nes->state && (port == 0 || port == 1))
+    nes->state->input.buttons[port] = buttons;
+}
+
+int nes_run_frame(NesCore *nes) {
+  if (nes->state == NULL)
+    return 0;
+
+  cpu_run_frame(nes->state);
+  // the frame's palette indices go to observe_push here, once there's a ppu
+  // to make them.
+  return !nes->state->cpu_state->shutting_down;
+}
+
+const uint8_t *nes_ram_page(NesCore *nes, uint8_t page) {
+  return nes->state ? nes->state->pages[page]->data : NULL;
+}
+
+uint8_t nes_peek(NesCore *nes, uint16_t address) {
+  return nes->state ? peek(nes->state, address) : 0;
+}
+
+const uint32_t *nes_framebuffer(NesCore *nes, int *width, int *height) {
+  (void)nes;
+  *width = 0;
+  *height = 0;
+  return NULL;
+}
+
+const float *nes_audio(NesCore *nes, size_t *count, int *sample_rate) {
+  if (nes->audio == NULL) {
+    *count = 0;
+    *sample_rate = 0;
+    return NULL;
+  }
+  *count = nes->audio->count;
+  *sample_rate = nes->audio->sample_rate;
+  return nes->audio->samples;
+}
+
+void nes_set_observation(NesCore *nes, int enabled) {
+  if (enabled && nes->observe == NULL) {
+    nes->observe = make_observe_state();
+  } else if (enabled) {
+    observe_reset(nes->observe);
+  } else if (nes->observe) {
+    clean_observe_state(nes->observe);
+    nes->observe = NULL;
+  }
+}
+
+int nes_observation(NesCore *nes, uint8_t *out) {
+  if (nes->observe == NULL || nes->observe->pushed == 0)
+    return 0;
+
+  observe_stack(nes->observe, out);
+  return 1;
+}
+
+uint64_t nes_hash(NesCore *nes) {
+  return nes->state ? hash_machine(nes->state) : 0;
+}
+
+uint64_t nes_frame(NesCore *nes) {
+  return nes->state ? nes->state->cpu_state->cycles / CYCLES_PER_FRAME : 0;
+}
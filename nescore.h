@@ -0,0 +1,90 @@
+#pragma once
+
+// the embeddable core. everything but the glfw frontend, behind a small c
+// api, so harnesses can link it (libnescore.a or libnescore.so, from
+// ./make.sh lib) and drive it in-process instead of through a subprocess.
+// nothing in here needs any of the core's other headers.
+//
+//   NesCore *nes = nes_create();
+//   nes_load_rom(nes, image, size);
+//   while (nes_run_frame(nes)) {
+//     nes_set_input(nes, 0, buttons);
+//     const uint8_t *zero_page = nes_ram_page(nes, 0);
+//     ...
+//   }
+//   nes_destroy(nes);
+//
+// every pointer handed out points straight into the machine, nothing is
+// copied. they stay valid until the next call that runs or changes it.
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct NesCore NesCore;
+
+// button bits for nes_set_input, the same as the core's.
+enum {
+  NES_BUTTON_A = 1 << 0,
+  NES_BUTTON_B = 1 << 1,
+  NES_BUTTON_SELECT = 1 << 2,
+  NES_BUTTON_START = 1 << 3,
+  NES_BUTTON_UP = 1 << 4,
+  NES_BUTTON_DOWN = 1 << 5,
+  NES_BUTTON_LEFT = 1 << 6,
+  NES_BUTTON_RIGHT = 1 << 7,
+};
+
+NesCore *nes_create(void);
+void nes_destroy(NesCore *nes);
+
+// an ines image. it's copied, so the caller can free theirs straight away.
+// 1 on success. loading again starts a fresh machine.
+int nes_load_rom(NesCore *nes, const uint8_t *image, size_t size);
+
+// what's held on port 0 or 1 for the frames that follow.
+void nes_set_input(NesCore *nes, int port, uint8_t buttons);
+
+// one frame. 0 once the cpu has halted (or there's no rom), 1 otherwise.
+int nes_run_frame(NesCore *nes);
+
+// memory comes in 256 byte pages, and that's the unit it's lent out in.
+// page 0 is the zero page, 0-7 are the 2kb of work ram. read only, writing
+// through these would skip the copy-on-write the core relies on.
+const uint8_t *nes_ram_page(NesCore *nes, uint8_t page);
+uint8_t nes_peek(NesCore *nes, uint16_t address);
+
+// 256x240, 0x00RRGGBB. there's no ppu in the core yet, so this is NULL and
+// the sizes are 0.
+const uint32_t *nes_framebuffer(NesCore *nes, int *width, int *height);
+// the mono float samples the last frame made, at the given rate (always
+// NES_SAMPLE_RATE for now). about 800 a frame. NULL and 0 with no rom.
+#define NES_SAMPLE_RATE 48000
+const float *nes_audio(NesCore *nes, size_t *count, int *sample_rate);
+
+// the observation stage, for learning agents: the last 4 frames, oldest
+// first, each turned to luma, max pooled with the frame before it and area
+// averaged down to 84x84. built in the core, fixed point and simd, as each
+// frame finishes. off until it's turned on, it costs time every frame.
+#define NES_OBSERVATION_WIDTH 84
+#define NES_OBSERVATION_HEIGHT 84
+#define NES_OBSERVATION_STACK 4
+#define NES_OBSERVATION_SIZE                                                   \
+  (NES_OBSERVATION_STACK * NES_OBSERVATION_WIDTH * NES_OBSERVATION_HEIGHT)
+
+// turning it on starts an empty stack, as does loading a rom.
+void nes_set_observation(NesCore *nes, int enabled);
+// the stack into out, NES_OBSERVATION_SIZE bytes. 0 (and out untouched) if
+// the stage is off or hasn't seen a frame, which without a ppu is always.
+int nes_observation(NesCore *nes, uint8_t *out);
+
+// the machine hash, see hash_machine. cheap enough to call every frame.
+uint64_t nes_hash(NesCore *nes);
+uint64_t nes_frame(NesCore *nes); // frames since power on.
+
+#ifdef __cplusplus
+}
+#endif
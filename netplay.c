@@ -0,0 +1,218 @@
+#include "netplay.h"
+
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#define netplay_magic 0x504E454E // "NENP"
+
+NetplayState *netplay_state = NULL;
+
+static struct sockaddr_in remote_address;
+
+// ring slot for a frame.
+#define SLOT(frame) ((frame) % NETPLAY_HISTORY)
+
+NetplayState *make_netplay_state(u8 player) {
+  NetplayState *ns = (NetplayState *)malloc(sizeof(NetplayState));
+  memset(ns, 0, sizeof(NetplayState));
+  ns->socket = -1;
+  ns->player = player;
+  ns->confirmed_remote = -1;
+  ns->hashed_frame = -1;
+  ns->remote_hash_frame = -1;
+  ns->snapshots = (SaveState *)malloc(NETPLAY_HISTORY * sizeof(SaveState));
+  return ns;
+}
+
+void clean_netplay_state(NetplayState *ns) {
+  if (ns->socket >= 0)
+    close(ns->socket);
+  free(ns->snapshots);
+  free(ns);
+}
+
+static double now_ms() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000.0 + ts.tv_nsec / 1e6;
+}
+
+/// SIMULATION
+// run frame, snapshotting the start of it first so we can come back.
+static void simulate(NetplayState *ns, EmuState *state, int frame) {
+  save_state(state, &ns->snapshots[SLOT(frame)]);
+
+  u8 remote = 0; // nothing heard yet, guess nothing held.
+  if (frame <= ns->confirmed_remote)
+    remote = ns->remote[SLOT(frame)];
+  else if (ns->confirmed_remote >= 0) // the guess, they're still holding it.
+    remote = ns->remote[SLOT(ns->confirmed_remote)];
+  ns->predicted[SLOT(frame)] = remote;
+
+  state->input.buttons[ns->player] = ns->local[SLOT(frame)];
+  state->input.buttons[!ns->player] = remote;
+  cpu_run_frame(state);
+}
+
+// compare our hash and theirs once we both have the same frame.
+static void check_desync(NetplayState *ns) {
+  int frame = ns->remote_hash_frame;
+  if (ns->remote_hash_checked || frame < 0 || frame > ns->hashed_frame ||
+      frame <= ns->hashed_frame - NETPLAY_HISTORY)
+    return;
+
+  if (ns->hashes[SLOT(frame)] != ns->remote_hash) {
+    ns->desyncs++;
+    printf("Netplay desync detected at frame %d (%016llX vs %016llX).\n",
+           frame, (unsigned long long)ns->hashes[SLOT(frame)],
+           (unsigned long long)ns->remote_hash);
+  }
+  ns->remote_hash_checked = 1; // don't report it twice.
+}
+
+/// THE WIRE
+static void send_inputs(NetplayState *ns, int newest) {
+  NetplayPacket packet;
+  packet.magic = netplay_magic;
+  packet.frame = newest;
+  for (int i = 0; i < NETPLAY_REDUNDANCY; i++)
+    packet.inputs[i] = (newest - i >= 0) ? ns->local[SLOT(newest - i)] : 0;
+  packet.hash_frame = ns->hashed_frame;
+  packet.hash = (ns->hashed_frame >= 0) ? ns->hashes[SLOT(ns->hashed_frame)]
+                                        : 0;
+
+  sendto(ns->socket, &packet, sizeof(packet), 0,
+         (struct sockaddr *)&remote_address, sizeof(remote_address));
+}
+
+// drain the socket. returns the first frame we simulated with a wrong
+// guess, or -1 if every guess held up.
+static int receive_inputs(NetplayState *ns) {
+  int first_wrong = -1;
+  NetplayPacket packet;
+
+  while (recv(ns->socket, &packet, sizeof(packet), 0) == sizeof(packet)) {
+    if (packet.magic != netplay_magic)
+      continue;
+
+    // take the inputs in order, as long as they carry on from what we have.
+    for (int i = NETPLAY_REDUNDANCY - 1; i >= 0; i--) {
+      int frame = packet.frame - i;
+      if (frame != ns->confirmed_remote + 1)
+        continue;
+
+      ns->remote[SLOT(frame)] = packet.inputs[i];
+      ns->confirmed_remote = frame;
+
+      if (frame < ns->frame && ns->predicted[SLOT(frame)] != packet.inputs[i] &&
+          first_wrong < 0)
+        first_wrong = frame;
+    }
+
+    if (packet.hash_frame > ns->remote_hash_frame) {
+      ns->remote_hash_frame = packet.hash_frame;
+      ns->remote_hash = packet.hash;
+      ns->remote_hash_checked = 0;
+    }
+  }
+
+  return first_wrong;
+}
+
+/// MODULE FUNCTIONS
+u8 netplay_init(u8 player, u16 local_port, u16 remote_port) {
+  netplay_state = make_netplay_state(player);
+
+  netplay_state->socket = socket(AF_INET, SOCK_DGRAM, 0);
+  if (netplay_state->socket < 0) {
+    printf("Failed to open the netplay socket.\n");
+    return 0;
+  }
+  fcntl(netplay_state->socket, F_SETFL, O_NONBLOCK);
+
+  struct sockaddr_in local_address;
+  memset(&local_address, 0, sizeof(local_address));
+  local_address.sin_family = AF_INET;
+  local_address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  local_address.sin_port = htons(local_port);
+
+  if (bind(netplay_state->socket, (struct sockaddr *)&local_address,
+           sizeof(local_address)) < 0) {
+    printf("Failed to bind the netplay socket to port %u.\n", local_port);
+    return 0;
+  }
+
+  memset(&remote_address, 0, sizeof(remote_address));
+  remote_address.sin_family = AF_INET;
+  remote_address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  remote_address.sin_port = htons(remote_port);
+
+  printf("Netplay: player %u on port %u, remote on port %u.\n", player + 1,
+         local_port, remote_port);
+  return 1;
+}
+
+u8 netplay_update(EmuState *state, u8 local_buttons) {
+  NetplayState *ns = netplay_state;
+
+  int first_wrong = receive_inputs(ns);
+
+  if (first_wrong >= 0) { // roll back, and play the frames out again.
+    double start = now_ms();
+
+    load_state(state, &ns->snapshots[SLOT(first_wrong)]);
+    for (int frame = first_wrong; frame < ns->frame; frame++)
+      simulate(ns, state, frame);
+
+    double elapsed = now_ms() - start;
+    if (elapsed > ns->worst_rollback_ms)
+      ns->worst_rollback_ms = elapsed;
+    ns->rollbacks++;
+    ns->resimulated += ns->frame - first_wrong;
+  }
+
+  // hash every frame that's now fully confirmed. the snapshot at the start
+  // of frame + 1 is the machine at the end of frame.
+  while (ns->hashed_frame < ns->confirmed_remote &&
+         ns->hashed_frame + 2 < ns->frame) {
+    ns->hashed_frame++;
+    ns->hashes[SLOT(ns->hashed_frame)] =
+        hash_state(&ns->snapshots[SLOT(ns->hashed_frame + 1)]);
+  }
+  check_desync(ns);
+
+  if (ns->frame - ns->confirmed_remote > NETPLAY_MAX_ROLLBACK) {
+    // too far ahead to roll back safely, wait for the remote to catch up.
+    // keep resending so a lost packet can't leave us both waiting.
+    ns->stalls++;
+    if (ns->frame > 0)
+      send_inputs(ns, ns->frame - 1);
+    return 0;
+  }
+
+  ns->local[SLOT(ns->frame)] = local_buttons;
+  send_inputs(ns, ns->frame);
+
+  simulate(ns, state, ns->frame);
+  ns->frame++;
+
+  return 1;
+}
+
+void netplay_report() {
+  NetplayState *ns = netplay_state;
+  printf("Netplay: %d frames, %llu rollbacks resimulating %llu frames "
+         "(worst %.2fms), %llu stalls, %llu desyncs.\n",
+         ns->frame, (unsigned long long)ns->rollbacks,
+         (unsigned long long)ns->resimulated, ns->worst_rollback_ms,
+         (unsigned long long)ns->stalls, (unsigned long long)ns->desyncs);
+}
+
+void netplay_clean() { clean_netplay_state(netplay_state); }
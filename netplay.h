@@ -0,0 +1,64 @@
+#pragma once
+
+#include "cpu.h"
+#include "defines.h"
+#include "state.h"
+
+// two player rollback netplay over udp. every frame we send our input (and
+// a window of the ones before it, so a lost packet doesn't matter) and run
+// ahead on a guess of the remote input, which is just whatever they held
+// last. when their real input shows up and doesn't match the guess, we load
+// the snapshot from the start of the first wrong frame and resimulate back
+// up to the present. both sides hash the machine on every frame whose
+// inputs are confirmed, and swap the hashes to catch desyncs.
+
+#define NETPLAY_MAX_ROLLBACK 8 // frames we're allowed to run past the remote.
+#define NETPLAY_REDUNDANCY 16  // inputs carried by every packet.
+#define NETPLAY_HISTORY 32     // ring size for inputs, snapshots and hashes.
+
+typedef struct NetplayPacket {
+  u32 magic;
+  int frame; // the newest frame in inputs, inputs[i] is for frame - i.
+  u8 inputs[NETPLAY_REDUNDANCY];
+  int hash_frame; // the sender's newest hashed frame, -1 for none yet.
+  u64 hash;
+} NetplayPacket;
+
+typedef struct NetplayState {
+  int socket;
+  u8 player; // which port we play on, the remote gets the other one.
+
+  int frame;            // the next frame to simulate.
+  int confirmed_remote; // every remote input up to here is known.
+  int hashed_frame;     // every confirmed frame up to here has been hashed.
+
+  u8 local[NETPLAY_HISTORY];
+  u8 remote[NETPLAY_HISTORY];    // the remote's real inputs, once confirmed.
+  u8 predicted[NETPLAY_HISTORY]; // what we simulated the remote as holding.
+  SaveState *snapshots;          // the machine at the start of each frame.
+
+  u64 hashes[NETPLAY_HISTORY]; // ours, for frames hashed_frame and below.
+  int remote_hash_frame;
+  u64 remote_hash;
+  u8 remote_hash_checked;
+
+  // stats, for netplay_report.
+  u64 rollbacks;
+  u64 resimulated;
+  double worst_rollback_ms;
+  u64 stalls;
+  u64 desyncs;
+} NetplayState;
+
+// NULL unless netplay_init was called.
+extern NetplayState *netplay_state;
+
+// bind 127.0.0.1:local_port and talk to the other instance on remote_port.
+// 1 on success.
+u8 netplay_init(u8 player, u16 local_port, u16 remote_port);
+// advance one frame with our buttons, rolling back first if the remote
+// proved us wrong. returns 0 if we're too far ahead of the remote and had
+// to wait this frame out instead.
+u8 netplay_update(EmuState *state, u8 local_buttons);
+void netplay_report();
+void netplay_clean();
@@ -0,0 +1,263 @@
+#include "nsf.h"
+#include "apu.h"
+#include "audio.h"
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define NSF_PATH_MAX 1024
+
+static double now_seconds() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/// THE FILE
+static u16 get16(const u8 *bytes) { return bytes[0] | bytes[1] << 8; }
+
+static void get_string(char *out, const u8 *bytes) {
+  memcpy(out, bytes, 32);
+  out[32] = '\0'; // a full 32 byte field has no terminator of its own.
+}
+
+u8 nsf_parse(NsfFile *nsf, const u8 *image, u32 size) {
+  if (size <= NSF_HEADER || memcmp(image, "NESM\x1a", 5) != 0) {
+    printf("Not an nsf, the magic number doesn't match.\n");
+    return 0;
+  }
+
+  memset(nsf, 0, sizeof(NsfFile));
+  nsf->data = image + NSF_HEADER;
+  nsf->size = size - NSF_HEADER;
+  nsf->songs = image[6];
+  nsf->start = image[7];
+  nsf->load = get16(image + 0x08);
+  nsf->init = get16(image + 0x0A);
+  nsf->play = get16(image + 0x0C);
+  get_string(nsf->name, image + 0x0E);
+  get_string(nsf->artist, image + 0x2E);
+  get_string(nsf->copyright, image + 0x4E);
+  nsf->speed = get16(image + 0x6E);
+  if (nsf->speed == 0) // some rippers leave it out, meaning the usual.
+    nsf->speed = 16639;
+  memcpy(nsf->banks, image + 0x70, 8);
+  for (int i = 0; i < 8; i++)
+    nsf->bankswitched |= nsf->banks[i] != 0;
+  nsf->chips = image[0x7B];
+
+  if (nsf->songs == 0) {
+    printf("The nsf has no tracks.\n");
+    return 0;
+  }
+  // without banks the data goes in as is, and only the rom's half of the
+  // address space is the player's to fill.
+  if (!nsf->bankswitched && nsf->load < 0x8000) {
+    printf("The nsf loads at $%04X, below the rom at $8000.\n", nsf->load);
+    return 0;
+  }
+  if (nsf->chips)
+    printf("The nsf uses expansion audio ($%02X), only the 2a03's channels "
+           "will be heard.\n",
+           nsf->chips);
+  return 1;
+}
+
+/// THE MACHINE
+void nsf_switch_bank(EmuState *state, u8 slot, u8 bank) {
+  const NsfFile *nsf = state->nsf;
+  // the data as 4kb banks, the first one starting the load address's offset
+  // into its bank early, with zeroes before the data and after the end.
+  long start = (long)bank * 0x1000 - (nsf->load & 0x0FFF);
+  for (int p = 0; p < 0x1000 / PAGE_SIZE; p++) {
+    u8 *page = page_for_write(state, 0x80 + slot * 0x10 + p);
+    for (int i = 0; i < PAGE_SIZE; i++) {
+      long at = start + p * PAGE_SIZE + i;
+      page[i] = (at >= 0 && at < nsf->size) ? nsf->data[at] : 0;
+    }
+  }
+}
+
+// sets the cpu off into a routine as if a jsr had called it from just
+// before the trap, so its rts lands on the trap.
+static void start_routine(EmuState *state, u16 address) {
+  push16(state, NSF_TRAP - 1);
+  state->cpu_state->pc = address;
+}
+
+// runs until the routine's returned or the cycles are up. 1 if it returned.
+static u8 run_until(EmuState *state, u64 stop) {
+  CPUState *cs = state->cpu_state;
+  while (cs->pc != NSF_TRAP && cs->cycles < stop && !cs->shutting_down)
+    handle_instruction(state);
+  return cs->pc == NSF_TRAP;
+}
+
+u8 nsf_load_track(EmuState *state, const NsfFile *nsf, u8 track) {
+  CPUState *cs = state->cpu_state;
+  state->nsf = nsf;
+
+  if (nsf->bankswitched) {
+    for (int slot = 0; slot < 8; slot++)
+      nsf_switch_bank(state, slot, nsf->banks[slot]);
+  } else {
+    for (u32 i = 0; i < nsf->size && nsf->load + i <= 0xFFFF; i++)
+      poke(state, nsf->load + i, nsf->data[i]);
+  }
+
+  // the apu the way a player hands it over: silent, the four tone channels
+  // on and the frame irq off.
+  for (u16 address = 0x4000; address <= 0x4013; address++)
+    write_byte(state, address, 0);
+  write_byte(state, 0x4015, 0x00);
+  write_byte(state, 0x4015, 0x0F);
+  write_byte(state, 0x4017, 0x40);
+
+  cs->a = track - 1;
+  cs->x = 0; // ntsc.
+  start_routine(state, nsf->init);
+  return run_until(state, cs->cycles + NSF_INIT_CYCLES);
+}
+
+/// RENDERING
+static u8 render_track(const NsfFile *nsf, u8 track, double seconds,
+                       const char *path) {
+  double start_time = now_seconds();
+  EmuState *state = make_emu_state();
+  CPUState *cs = state->cpu_state;
+  AudioBuffer *audio = make_audio_buffer(AUDIO_SAMPLE_RATE);
+  state->audio = audio;
+
+  WavFile *wav = wav_open(path, AUDIO_SAMPLE_RATE);
+  u8 ok = wav != NULL;
+  if (ok && !nsf_load_track(state, nsf, track)) {
+    printf("Track %d: init never returned.\n", track);
+    ok = 0;
+  }
+  // whatever init made isn't part of the track.
+  apu_end_frame(state);
+  audio->count = 0;
+
+  double period = nsf->speed * (APU_CLOCK / 1e6); // cycles between calls.
+  u64 start = cs->cycles, next_play = start, calls = 0;
+  u64 want = (u64)(seconds * AUDIO_SAMPLE_RATE), written = 0;
+
+  while (ok && written < want) {
+    if (cs->cycles >= next_play) {
+      // a play that's still going when the next one's due just carries on,
+      // and that call is skipped. a real player does the same.
+      if (cs->pc == NSF_TRAP)
+        start_routine(state, nsf->play);
+      next_play = start + (u64)(++calls * period);
+    }
+
+    // at most a frame at a time, so the apu's buffer never overflows. once
+    // play has returned there's nothing to run until the next call.
+    u64 stop = cs->cycles + CYCLES_PER_FRAME;
+    if (next_play < stop)
+      stop = next_play;
+    if (run_until(state, stop) && cs->cycles < stop)
+      cs->cycles = stop;
+    if (cs->shutting_down) {
+      printf("Track %d: the cpu halted (a brk or a bad opcode) at $%04X.\n",
+             track, cs->pc);
+      ok = 0;
+    }
+
+    apu_end_frame(state);
+    u32 count = audio->count;
+    if (count > want - written)
+      count = want - written;
+    wav_write(wav, audio->samples, count);
+    written += count;
+    audio->count = 0;
+  }
+
+  if (wav)
+    ok = wav_close(wav) && ok;
+  clean_emu_state(state);
+  clean_audio_buffer(audio);
+
+  double elapsed = now_seconds() - start_time;
+  if (ok)
+    printf("Track %d: %.1fs of sound in %.3fs (%.0fx realtime), %s.\n", track,
+           seconds, elapsed, seconds / elapsed, path);
+  return ok;
+}
+
+// the tracks are all the same length, so there's no point to stealing like
+// the batch runner does. workers just count their way through them.
+typedef struct Render {
+  const NsfFile *nsf;
+  double seconds;
+  const char *prefix;
+  _Atomic int next; // 1 based.
+  _Atomic int failed;
+} Render;
+
+static void *render_thread(void *arg) {
+  Render *r = (Render *)arg;
+  int track;
+
+  while ((track = atomic_fetch_add(&r->next, 1)) <= r->nsf->songs) {
+    char path[NSF_PATH_MAX];
+    snprintf(path, sizeof(path), "%s%02d.wav", r->prefix, track);
+    if (!render_track(r->nsf, track, r->seconds, path))
+      atomic_fetch_add(&r->failed, 1);
+  }
+  return NULL;
+}
+
+u8 nsf_render(const char *path, double seconds, const char *prefix,
+              int workers) {
+  FILE *file = fopen(path, "rb");
+  if (file == NULL) {
+    printf("Failed to open the nsf %s.\n", path);
+    return 0;
+  }
+  fseek(file, 0, SEEK_END);
+  long size = ftell(file);
+  rewind(file);
+  u8 *image = (u8 *)malloc(size);
+  u8 ok = fread(image, 1, size, file) == (size_t)size;
+  fclose(file);
+
+  NsfFile nsf;
+  if (!ok)
+    printf("Could not read the nsf %s.\n", path);
+  ok = ok && nsf_parse(&nsf, image, size);
+  if (!ok) {
+    free(image);
+    return 0;
+  }
+
+  if (workers <= 0)
+    workers = sysconf(_SC_NPROCESSORS_ONLN);
+  if (workers > nsf.songs)
+    workers = nsf.songs;
+  printf("%s, by %s. %d tracks, %.1fs each, on %d workers.\n", nsf.name,
+         nsf.artist, nsf.songs, seconds, workers);
+
+  Render r = {&nsf, seconds, prefix, 1, 0};
+  pthread_t *threads = (pthread_t *)calloc(workers, sizeof(pthread_t));
+  double start = now_seconds();
+  for (int i = 0; i < workers; i++)
+    pthread_create(&threads[i], NULL, render_thread, &r);
+  for (int i = 0; i < workers; i++)
+    pthread_join(threads[i], NULL);
+  double elapsed = now_seconds() - start;
+
+  printf("Rendered %d tracks (%.0fs of sound) in %.2fs, %.0fx realtime, %d "
+         "failed.\n",
+         nsf.songs, nsf.songs * seconds, elapsed,
+         nsf.songs * seconds / elapsed, (int)r.failed);
+
+  free(threads);
+  free(image);
+  return r.failed == 0;
+}
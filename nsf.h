@@ -0,0 +1,57 @@
+#pragma once
+
+#include "cpu.h"
+#include "defines.h"
+
+// nsf music, rendered headless to wav. an nsf is the sound driver and music
+// data ripped out of a game, with an init routine (A = the track, X = 0 for
+// ntsc) and a play routine the player calls once a frame. there's no ppu to
+// wait on and nothing to look at, so between play calls the cpu has nothing
+// to do: we skip straight to the next one and let the apu catch up lazily.
+// that's most of why it goes so much faster than realtime.
+//
+//   ./nes --nsf music.nsf seconds out_prefix [workers]
+//
+// writes out_prefix01.wav, out_prefix02.wav, ... one per track, each on its
+// own machine. tracks are all the same length, so workers just take the next
+// one off a counter. bank switching ($5FF8-$5FFF) works, expansion chips
+// (vrc6, fds, n163...) don't, their channels are just missing.
+
+#define NSF_HEADER 0x80
+// where init and play return to. nothing can run from the apu's registers,
+// so the cpu reaching it means the routine is done.
+#define NSF_TRAP 0x4100
+// init gets this long to return before the track is given up on.
+#define NSF_INIT_CYCLES (60 * CYCLES_PER_FRAME)
+
+typedef struct NsfFile {
+  const u8 *data; // after the header, borrowed.
+  u32 size;
+
+  u16 load;
+  u16 init;
+  u16 play;
+  u8 songs;
+  u8 start; // 1 based, like the header.
+  u32 speed; // microseconds between play calls, ntsc.
+  u8 banks[8]; // the 4kb banks at $8000-$FFFF to start each track with.
+  u8 bankswitched;
+  u8 chips; // the expansion chip bits, unsupported.
+
+  char name[33];
+  char artist[33];
+  char copyright[33];
+} NsfFile;
+
+// checks the header. 0, with a message, if it isn't an nsf we can play.
+u8 nsf_parse(NsfFile *nsf, const u8 *image, u32 size);
+// a fresh machine with the nsf mapped in and track's init run. 0 if init
+// never returned.
+u8 nsf_load_track(EmuState *state, const NsfFile *nsf, u8 track);
+// a write to $5FF8 + slot, called by the bus when there's an nsf loaded.
+void nsf_switch_bank(EmuState *state, u8 slot, u8 bank);
+
+// every track, seconds long each. workers of 0 means one per core. 1 if
+// every track rendered.
+u8 nsf_render(const char *path, double seconds, const char *prefix,
+              int workers);
@@ -0,0 +1,192 @@
+#include "observe.h"
+
+#include <emmintrin.h>
+#include <stdlib.h>
+#include <string.h>
+#include <tmmintrin.h>
+
+// the 2C02's colors, the usual ntsc measurement.
+static const u8 palette_rgb[64][3] = {
+    {84, 84, 84},    {0, 30, 116},    {8, 16, 144},    {48, 0, 136},
+    {68, 0, 100},    {92, 0, 48},     {84, 4, 0},      {60, 24, 0},
+    {32, 42, 0},     {8, 58, 0},      {0, 64, 0},      {0, 60, 0},
+    {0, 50, 60},     {0, 0, 0},       {0, 0, 0},       {0, 0, 0},
+    {152, 150, 152}, {8, 76, 196},    {48, 50, 236},   {92, 30, 228},
+    {136, 20, 176},  {160, 20, 100},  {152, 34, 32},   {120, 60, 0},
+    {84, 90, 0},     {40, 114, 0},    {8, 124, 0},     {0, 118, 40},
+    {0, 102, 120},   {0, 0, 0},       {0, 0, 0},       {0, 0, 0},
+    {236, 238, 236}, {76, 154, 236},  {120, 124, 236}, {176, 98, 236},
+    {228, 84, 236},  {236, 88, 180},  {236, 106, 100}, {212, 136, 32},
+    {160, 170, 0},   {116, 196, 0},   {76, 208, 32},   {56, 204, 108},
+    {56, 180, 204},  {60, 60, 60},    {0, 0, 0},       {0, 0, 0},
+    {236, 238, 236}, {168, 204, 236}, {188, 188, 236}, {212, 178, 236},
+    {236, 174, 236}, {236, 174, 212}, {236, 180, 176}, {228, 196, 144},
+    {204, 210, 120}, {180, 222, 120}, {168, 226, 144}, {152, 226, 180},
+    {160, 214, 228}, {160, 162, 160}, {0, 0, 0},       {0, 0, 0},
+};
+
+// the area one output pixel covers, in units where a source pixel is
+// outputs wide and an output pixel is sources wide. the overlaps are then
+// whole numbers, and every output's add up to sources.
+static void make_taps(ObserveTaps *taps, int outputs, int sources) {
+  for (int o = 0; o < outputs; o++) {
+    int start = o * sources, end = (o + 1) * sources;
+    taps[o].first = start / outputs;
+    taps[o].count = 0;
+    for (int s = taps[o].first; s * outputs < end; s++) {
+      int from = s * outputs > start ? s * outputs : start;
+      int to = (s + 1) * outputs < end ? (s + 1) * outputs : end;
+      taps[o].weights[taps[o].count++] = to - from;
+    }
+  }
+}
+
+ObserveState *make_observe_state() {
+  ObserveState *os = (ObserveState *)calloc(1, sizeof(ObserveState));
+
+  // bt.601, the same weights everyone's preprocessing uses.
+  for (int i = 0; i < 64; i++) {
+    const u8 *c = palette_rgb[i];
+    os->palette[i] = (299 * c[0] + 587 * c[1] + 114 * c[2] + 500) / 1000;
+  }
+
+  os->ssse3 = __builtin_cpu_supports("ssse3");
+  make_taps(os->rows, OBSERVE_HEIGHT, FRAME_HEIGHT);
+  make_taps(os->columns, OBSERVE_WIDTH, FRAME_WIDTH);
+  return os;
+}
+
+void clean_observe_state(ObserveState *os) { free(os); }
+
+void observe_reset(ObserveState *os) {
+  memset(os->luma, 0, sizeof(os->luma));
+  memset(os->stack, 0, sizeof(os->stack));
+  os->current = 0;
+  os->newest = 0;
+  os->pushed = 0;
+}
+
+/// THE PALETTE
+static void luma_scalar(const u8 *palette, const u8 *frame, u8 *out) {
+  for (int i = 0; i < FRAME_WIDTH * FRAME_HEIGHT; i++)
+    out[i] = palette[frame[i] & 0x3F];
+}
+
+// 16 pixels at a time. pshufb looks up 16 entries, so the palette goes in as
+// four quarters and the top two bits of the index pick which one counts.
+__attribute__((target("ssse3"))) static void
+luma_ssse3(const u8 *palette, const u8 *frame, u8 *out) {
+  __m128i quarters[4];
+  for (int q = 0; q < 4; q++)
+    quarters[q] = _mm_loadu_si128((const __m128i *)(palette + q * 16));
+  __m128i low = _mm_set1_epi8(0x0F);
+
+  for (int i = 0; i < FRAME_WIDTH * FRAME_HEIGHT; i += 16) {
+    __m128i index = _mm_loadu_si128((const __m128i *)(frame + i));
+    __m128i entry = _mm_and_si128(index, low);
+    __m128i quarter =
+        _mm_and_si128(_mm_srli_epi16(index, 4), _mm_set1_epi8(3));
+
+    __m128i luma = _mm_setzero_si128();
+    for (int q = 0; q < 4; q++) {
+      __m128i hit = _mm_cmpeq_epi8(quarter, _mm_set1_epi8(q));
+      luma = _mm_or_si128(
+          luma, _mm_and_si128(hit, _mm_shuffle_epi8(quarters[q], entry)));
+    }
+    _mm_storeu_si128((__m128i *)(out + i), luma);
+  }
+}
+
+/// THE DOWNSCALE
+// the vertical half, on the max of the two frames, 16 columns at a time.
+// the weights add up to FRAME_HEIGHT, so a sum tops out at 255 * 240 and
+// fits 16 bits.
+static void pool_rows(const ObserveTaps *taps, const u8 *now, const u8 *before,
+                      u16 *sums) {
+  for (int x = 0; x < FRAME_WIDTH; x += 16) {
+    __m128i low = _mm_setzero_si128(), high = _mm_setzero_si128();
+    for (int t = 0; t < taps->count; t++) {
+      int offset = (taps->first + t) * FRAME_WIDTH + x;
+      __m128i pixels =
+          _mm_max_epu8(_mm_loadu_si128((const __m128i *)(now + offset)),
+                       _mm_loadu_si128((const __m128i *)(before + offset)));
+      __m128i weight = _mm_set1_epi16(taps->weights[t]);
+      low = _mm_add_epi16(
+          low, _mm_mullo_epi16(_mm_unpacklo_epi8(pixels, _mm_setzero_si128()),
+                               weight));
+      high = _mm_add_epi16(
+          high, _mm_mullo_epi16(_mm_unpackhi_epi8(pixels, _mm_setzero_si128()),
+                                weight));
+    }
+    _mm_storeu_si128((__m128i *)(sums + x), low);
+    _mm_storeu_si128((__m128i *)(sums + x + 8), high);
+  }
+}
+
+// the horizontal half, down to one output row, 4 outputs at a time. pmaddwd
+// multiplies signed words, so the sums go in less 0x8000 and the weights
+// (which add up to FRAME_WIDTH) put back what that took off. the weights over
+// both axes then add up to FRAME_WIDTH * FRAME_HEIGHT, 15 << 12, which
+// divides back out with rounding as a shift and a multiply by 1/15.
+static void pool_columns(const ObserveTaps *taps, const u16 *sums, u8 *out) {
+  const __m128i bias = _mm_set1_epi16(0x8000);
+  const __m128i restore =
+      _mm_set1_epi32(0x8000 * FRAME_WIDTH + FRAME_WIDTH * FRAME_HEIGHT / 2);
+
+  for (int x = 0; x < OBSERVE_WIDTH; x += 4) {
+    __m128i p[4];
+    for (int k = 0; k < 4; k++) {
+      const ObserveTaps *t = &taps[x + k];
+      __m128i s = _mm_loadu_si128((const __m128i *)(sums + t->first));
+      __m128i w = _mm_loadu_si128((const __m128i *)t->weights);
+      p[k] = _mm_madd_epi16(_mm_xor_si128(s, bias), w);
+    }
+
+    // each p[k] into lane k.
+    __m128i t0 = _mm_add_epi32(_mm_unpacklo_epi32(p[0], p[1]),
+                               _mm_unpackhi_epi32(p[0], p[1]));
+    __m128i t1 = _mm_add_epi32(_mm_unpacklo_epi32(p[2], p[3]),
+                               _mm_unpackhi_epi32(p[2], p[3]));
+    __m128i sum = _mm_add_epi32(_mm_unpacklo_epi64(t0, t1),
+                                _mm_unpackhi_epi64(t0, t1));
+
+    // 34953 / 2^19 is 1/15 closely enough for anything under 2^16.
+    __m128i q = _mm_srli_epi32(_mm_add_epi32(sum, restore), 12);
+    q = _mm_packs_epi32(q, q);
+    q = _mm_srli_epi16(_mm_mulhi_epu16(q, _mm_set1_epi16(34953)), 3);
+    u32 four = _mm_cvtsi128_si32(_mm_packus_epi16(q, q));
+    memcpy(out + x, &four, 4);
+  }
+}
+
+void observe_push(ObserveState *os, const u8 *frame) {
+  os->current ^= 1;
+  u8 *now = os->luma[os->current];
+  const u8 *before = os->luma[os->current ^ 1];
+
+  if (os->ssse3)
+    luma_ssse3(os->palette, frame, now);
+  else
+    luma_scalar(os->palette, frame, now);
+
+  // the very first frame has nothing before it to pool with.
+  if (os->pushed == 0)
+    before = now;
+
+  os->newest = (os->newest + 1) % OBSERVE_STACK;
+  u8 *out = os->stack[os->newest];
+  u16 sums[FRAME_WIDTH + 8] = {0}; // room for the unused taps to read.
+  for (int y = 0; y < OBSERVE_HEIGHT; y++) {
+    pool_rows(&os->rows[y], now, before, sums);
+    pool_columns(os->columns, sums, out + y * OBSERVE_WIDTH);
+  }
+  os->pushed++;
+}
+
+void observe_stack(const ObserveState *os, u8 *out) {
+  const int size = OBSERVE_WIDTH * OBSERVE_HEIGHT;
+  for (int i = 0; i < OBSERVE_STACK; i++) {
+    int slot = (os->newest + 1 + i) % OBSERVE_STACK;
+    memcpy(out + i * size, os->stack[slot], size);
+  }
+}
@@ -0,0 +1,66 @@
+#pragma once
+
+#include "defines.h"
+
+// the observation stage, for learning agents that want small grayscale
+// stacks instead of full color frames. frames go in the way the ppu makes
+// them, 256x240 palette indices, and come out as the last OBSERVE_STACK
+// observations, each 84x84 bytes of luma. one observation is the palette
+// turned to luma, the max of that and the frame before (so sprites that
+// flicker on alternate frames are always there), and an exact area average
+// down to size.
+//
+// all fixed point. the pooling and the vertical half of the downscale are
+// sse2, the palette lookup ssse3 where the cpu has it. ./nes_bench observe
+// checks both lookups against a plain scalar reference, byte for byte.
+
+#define FRAME_WIDTH 256
+#define FRAME_HEIGHT 240
+
+#define OBSERVE_WIDTH 84
+#define OBSERVE_HEIGHT 84
+#define OBSERVE_STACK 4
+// bytes of a whole stack, what observe_stack writes.
+#define OBSERVE_SIZE (OBSERVE_STACK * OBSERVE_WIDTH * OBSERVE_HEIGHT)
+
+// the source pixels one output pixel covers along one axis, and how much
+// of each. the weights along an axis always add up to the same total. never
+// more than 5 of them, the rest are 0 so a whole vector can be used.
+typedef struct ObserveTaps {
+  u16 weights[8];
+  u16 first;
+  u8 count;
+} ObserveTaps;
+
+typedef struct ObserveState {
+  u8 palette[64]; // the luma of each palette entry.
+  // look the palette up with pshufb. on when the cpu has ssse3, the bench
+  // turns it off to check one against the other.
+  u8 ssse3;
+
+  // full size luma of this frame and the one before, for the max.
+  u8 luma[2][FRAME_WIDTH * FRAME_HEIGHT];
+  int current;
+
+  ObserveTaps rows[OBSERVE_HEIGHT];
+  ObserveTaps columns[OBSERVE_WIDTH];
+
+  // a ring of observations, newest at newest.
+  u8 stack[OBSERVE_STACK][OBSERVE_WIDTH * OBSERVE_HEIGHT];
+  int newest;
+  u64 pushed; // frames since the last reset.
+} ObserveState;
+
+ObserveState *make_observe_state();
+void clean_observe_state(ObserveState *os);
+
+// back to an empty stack (all zeros), for a new episode.
+void observe_reset(ObserveState *os);
+
+// one frame of FRAME_WIDTH * FRAME_HEIGHT palette indices. the emphasis bits
+// above the 6 bit index are ignored.
+void observe_push(ObserveState *os, const u8 *frame);
+
+// the stack into out, OBSERVE_SIZE bytes, oldest observation first. slots
+// nothing has been pushed into yet are zeros.
+void observe_stack(const ObserveState *os, u8 *out);
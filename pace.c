@@ -0,0 +1,157 @@
+#include "pace.h"
+#include "apu.h"
+#include "audio.h"
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+PaceState *pace_state = NULL;
+
+// the nes's own frame rate, 60.0988hz.
+#define NES_REFRESH ((double)APU_CLOCK / CYCLES_PER_FRAME)
+// a display further off than this from the nes would run the game too fast
+// or too slow to sync to, so it's paced at the nes's rate instead.
+#define PACE_MAX_SKEW 0.02
+
+static double now_seconds() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void sleep_until(double when) {
+  struct timespec ts;
+  ts.tv_sec = (time_t)when;
+  ts.tv_nsec = (long)((when - ts.tv_sec) * 1e9);
+  clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL);
+}
+
+PaceState *make_pace_state(double refresh, u8 vsync) {
+  PaceState *ps = (PaceState *)calloc(1, sizeof(PaceState));
+  if (refresh <= 0 || fabs(refresh / NES_REFRESH - 1) > PACE_MAX_SKEW) {
+    refresh = NES_REFRESH;
+    vsync = 0;
+  }
+  ps->refresh = refresh;
+  ps->period = 1 / refresh;
+  ps->sleeping = !vsync;
+  ps->fill = PACE_TARGET_FILL;
+  ps->shortest = 1e30;
+  return ps;
+}
+
+void clean_pace_state(PaceState *ps) { free(ps); }
+
+void pace_init(double refresh, u8 vsync) {
+  pace_state = make_pace_state(refresh, vsync);
+}
+
+/// FRAME TIMES
+static void record(PaceState *ps, double seconds) {
+  int bucket = seconds * 1000 / PACE_BUCKET_MS;
+  ps->histogram[bucket < PACE_BUCKETS ? bucket : PACE_BUCKETS - 1]++;
+
+  ps->frames++;
+  double delta = seconds - ps->mean;
+  ps->mean += delta / ps->frames;
+  ps->m2 += delta * (seconds - ps->mean);
+
+  if (seconds < ps->shortest)
+    ps->shortest = seconds;
+  if (seconds > ps->longest)
+    ps->longest = seconds;
+  if (seconds > ps->period * 1.5)
+    ps->late++;
+}
+
+// in ms, to the middle of the bucket it lands in.
+static double percentile(const PaceState *ps, double p) {
+  u64 want = (u64)ceil(p * ps->frames), seen = 0;
+  for (int b = 0; b < PACE_BUCKETS; b++) {
+    seen += ps->histogram[b];
+    if (seen >= want)
+      return (b + 0.5) * PACE_BUCKET_MS;
+  }
+  return PACE_BUCKETS * PACE_BUCKET_MS;
+}
+
+/// THE UPDATE
+void pace_update(EmuState *state) {
+  PaceState *ps = pace_state;
+  double now = now_seconds();
+
+  if (ps->sleeping) {
+    ps->deadline = ps->deadline > 0 ? ps->deadline + ps->period : now;
+    // too far behind to catch up (a breakpoint, a slow disk), so start over
+    // from here rather than racing through the backlog.
+    if (ps->deadline < now - ps->period)
+      ps->deadline = now;
+    sleep_until(ps->deadline);
+    now = now_seconds();
+  }
+
+  if (ps->last > 0)
+    record(ps, now - ps->last);
+  ps->last = now;
+
+  // the swap has been coming back well before the next refresh could have
+  // happened, so the driver isn't waiting for it. do it ourselves.
+  if (!ps->sleeping && ps->frames == 30 && ps->mean < ps->period * 0.75) {
+    printf("The swap isn't waiting for vsync, pacing with sleeps.\n");
+    ps->sleeping = 1;
+    ps->deadline = now;
+  }
+
+  // a wav has no clock of its own and takes everything as soon as it's
+  // pushed, so there's nothing to steer towards. it keeps the plain rate,
+  // the nes's own time with nothing folded in for the display.
+  if (audio_state == NULL || state->audio == NULL ||
+      audio_state->backend == AudioWav)
+    return;
+
+  // a plain proportional controller on the smoothed fill. any steady
+  // mismatch between the clocks ends up as a steady offset from the target,
+  // which the ring has room for.
+  double fill = audio_ring_fill(audio_state->ring);
+  ps->fill += 0.05 * (fill - ps->fill);
+  double error = (PACE_TARGET_FILL - ps->fill) / PACE_TARGET_FILL;
+  error = error > 1 ? 1 : error < -1 ? -1 : error;
+  ps->adjust = PACE_MAX_ADJUST * error;
+  if (ps->adjust < ps->min_adjust)
+    ps->min_adjust = ps->adjust;
+  if (ps->adjust > ps->max_adjust)
+    ps->max_adjust = ps->adjust;
+
+  // one emulated frame per refresh means NES_REFRESH / refresh as many
+  // frames' worth of sound a second as the nes would make. the resampler
+  // makes up the difference, and the adjustment goes on top.
+  double base = NES_REFRESH / ps->refresh;
+  resample_set_ratio(audio_state->resampler, base * (1 + ps->adjust));
+}
+
+void pace_report() {
+  PaceState *ps = pace_state;
+  if (ps->frames == 0)
+    return;
+
+  double stddev = ps->frames > 1 ? sqrt(ps->m2 / (ps->frames - 1)) : 0;
+  printf("Pacing: %llu frames at %.2fhz (%.2fms, %s). frame time mean "
+         "%.2fms, stddev %.2fms, min %.2fms, p50 %.2fms, p95 %.2fms, p99 "
+         "%.2fms, max %.2fms, %llu late.\n",
+         (unsigned long long)ps->frames, ps->refresh, ps->period * 1000,
+         ps->sleeping ? "sleeping" : "vsync", ps->mean * 1000,
+         stddev * 1000, ps->shortest * 1000, percentile(ps, 0.5),
+         percentile(ps, 0.95), percentile(ps, 0.99), ps->longest * 1000,
+         (unsigned long long)ps->late);
+  if (audio_state && audio_state->backend == AudioWav)
+    printf("Pacing: audio into a wav, at the plain rate.\n");
+  else if (audio_state)
+    printf("Pacing: audio rate adjusted between %+.3f%% and %+.3f%%, now "
+           "%+.3f%% with %.0f samples in the ring.\n",
+           ps->min_adjust * 100, ps->max_adjust * 100, ps->adjust * 100,
+           ps->fill);
+}
+
+void pace_clean() { clean_pace_state(pace_state); }
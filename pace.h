@@ -0,0 +1,57 @@
+#pragma once
+
+#include "cpu.h"
+#include "defines.h"
+
+// frame pacing and audio sync. the emulator runs one frame per refresh of
+// the display, and the swap waits for the vblank. the display isn't exactly
+// the nes's 60.0988hz, and the sound card's clock isn't exactly the cpu's,
+// so over time the audio ring would slowly fill up (overruns, dropped sound)
+// or drain (underruns, crackle). instead the resampler's ratio (see
+// resample.h) is nudged, by at most PACE_MAX_ADJUST either way, to keep the
+// ring at PACE_TARGET_FILL. half a percent is far too little to hear as pitch.
+// only a backend with a clock (alsa, null) is steered. a wav drains the ring
+// as fast as it fills, and gets the nes's own rate untouched.
+//
+// when the driver ignores the swap interval, frames come back much faster
+// than the display refreshes. that's noticed after the first few, and from
+// then on we sleep to each frame's deadline ourselves.
+//
+// every frame's time is kept in a histogram, pace_report prints the spread.
+
+#define PACE_MAX_ADJUST 0.005
+#define PACE_TARGET_FILL 2048 // samples in the ring, ~43ms at 48khz.
+#define PACE_BUCKETS 256      // of the histogram, each PACE_BUCKET_MS wide.
+#define PACE_BUCKET_MS 0.25
+
+typedef struct PaceState {
+  double refresh; // hz.
+  double period;  // seconds.
+  u8 sleeping;    // pacing ourselves, the swap doesn't.
+  double deadline;
+  double last; // when the last frame ended, 0 before the first.
+
+  // the audio side.
+  double fill; // the ring's fill, smoothed.
+  double adjust;
+  double min_adjust, max_adjust;
+
+  // the frame times, in seconds.
+  u32 histogram[PACE_BUCKETS]; // the last bucket has everything longer.
+  u64 frames;
+  double mean, m2; // for the variance, welford's way.
+  double shortest, longest;
+  u64 late; // took more than one and a half refreshes, a frame was doubled.
+} PaceState;
+
+extern PaceState *pace_state;
+
+// refresh is the display's, 0 if it's not known (the nes's own rate is used).
+// vsync says whether the swap is expected to wait for the display.
+void pace_init(double refresh, u8 vsync);
+// call once per frame, after it's been presented and its audio pushed.
+// waits out the rest of the frame if we're pacing ourselves, and adjusts
+// the resampler's ratio.
+void pace_update(EmuState *state);
+void pace_report();
+void pace_clean();
@@ -0,0 +1,167 @@
+#include "profile.h"
+
+#include <ctype.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+ProfileState *profile_state = NULL;
+
+#define LABEL_LENGTH 48
+
+ProfileState *make_profile_state() {
+  ProfileState *ps = (ProfileState *)malloc(sizeof(ProfileState));
+  memset(ps, 0, sizeof(ProfileState));
+  return ps;
+}
+
+void clean_profile_state(ProfileState *ps) { free(ps); }
+
+void profile_init() { profile_state = make_profile_state(); }
+
+void profile_suspend(u8 suspended) {
+  if (profile_state != NULL)
+    profile_state->suspended = suspended;
+}
+
+/// LABELS
+// the .sasm files have no labels of their own, so the comment on each line
+// of code is the label for the bytes on it. .ORG addresses are offsets in
+// the rom file, the prg-rom starts after the 16 byte header and is mapped
+// at $8000.
+static u16 file_to_cpu(u32 offset) { return (u16)(offset - 0x10 + 0x8000); }
+
+static void clean_label(char *label) {
+  // flamegraph frames can't have ';' in them, and trim the ends.
+  char *start = label;
+  while (isspace((unsigned char)*start))
+    start++;
+  memmove(label, start, strlen(start) + 1);
+
+  size_t length = strlen(label);
+  while (length > 0 && isspace((unsigned char)label[length - 1]))
+    label[--length] = '\0';
+
+  for (char *c = label; *c; c++)
+    if (*c == ';')
+      *c = ',';
+}
+
+// fill labels (one per cpu address, LABEL_LENGTH each) from the source.
+static u8 read_labels(const char *sasm_path, char *labels) {
+  FILE *file = fopen(sasm_path, "r");
+  if (file == NULL)
+    return 0;
+
+  char line[256];
+  u32 offset = 0;
+  int line_number = 0;
+
+  while (fgets(line, sizeof(line), file) != NULL) {
+    line_number++;
+
+    char comment[LABEL_LENGTH] = "";
+    char *semicolon = strchr(line, ';');
+    if (semicolon != NULL) {
+      *semicolon = '\0';
+      strncpy(comment, semicolon + 1, LABEL_LENGTH - 1);
+      comment[LABEL_LENGTH - 1] = '\0';
+      clean_label(comment);
+    }
+
+    char *cursor = line;
+    while (isspace((unsigned char)*cursor))
+      cursor++;
+
+    if (strncasecmp(cursor, ".ORG", 4) == 0) {
+      char *dollar = strchr(cursor, '$');
+      if (dollar != NULL)
+        offset = strtoul(dollar + 1, NULL, 16);
+      continue;
+    }
+
+    // count the bytes on the line and label each of them.
+    char *token = strtok(cursor, " \t\r\n");
+    while (token != NULL) {
+      if (offset >= 0x10 && offset < 0x10 + 0x8000) {
+        char *label = labels + file_to_cpu(offset) * LABEL_LENGTH;
+        if (comment[0] != '\0')
+          snprintf(label, LABEL_LENGTH, "%s", comment);
+        else
+          snprintf(label, LABEL_LENGTH, "line %d", line_number);
+      }
+      offset++;
+      token = strtok(NULL, " \t\r\n");
+    }
+  }
+
+  fclose(file);
+  return 1;
+}
+
+/// OUTPUT
+static void print_top_opcodes(ProfileState *ps, u64 total) {
+  u8 done[256] = {0};
+
+  printf("Top opcodes by cycles:\n");
+  for (int rank = 0; rank < 10; rank++) {
+    int best = -1;
+    for (int op = 0; op < 256; op++)
+      if (!done[op] && ps->opcode_cycles[op] &&
+          (best < 0 || ps->opcode_cycles[op] > ps->opcode_cycles[best]))
+        best = op;
+    if (best < 0)
+      break;
+    done[best] = 1;
+
+    const char *name = instruction_table[best].name;
+    printf("  %02X %s %12llu cycles %5.1f%%\n", best, name ? name : "???",
+           (unsigned long long)ps->opcode_cycles[best],
+           100.0 * ps->opcode_cycles[best] / total);
+  }
+}
+
+void profile_write(EmuState *state, const char *path, const char *sasm_path) {
+  ProfileState *ps = profile_state;
+
+  char *labels = (char *)calloc(RAM_SIZE, LABEL_LENGTH);
+  if (sasm_path != NULL && !read_labels(sasm_path, labels))
+    printf("Couldn't read labels from %s, using addresses.\n", sasm_path);
+
+  FILE *out = fopen(path, "w");
+  if (out == NULL) {
+    printf("Failed to open %s for the profile.\n", path);
+    free(labels);
+    return;
+  }
+
+  u64 total = 0;
+  for (int pc = 0; pc < RAM_SIZE; pc++) {
+    if (ps->pc_cycles[pc] == 0)
+      continue;
+    total += ps->pc_cycles[pc];
+
+    // rom;label;opcode cycles. the opcode is whatever's at pc now, which is
+    // only wrong for self modifying code.
+    char address[8];
+    snprintf(address, sizeof(address), "$%04X", pc);
+    const char *label = labels[pc * LABEL_LENGTH] ? labels + pc * LABEL_LENGTH
+                                                  : address;
+    const char *name = instruction_table[peek(state, pc)].name;
+
+    fprintf(out, "rom;%s;%s %llu\n", label, name ? name : "???",
+            (unsigned long long)ps->pc_cycles[pc]);
+  }
+  fclose(out);
+  free(labels);
+
+  printf("Profile: %llu cycles written to %s.\n", (unsigned long long)total,
+         path);
+  if (total > 0)
+    print_top_opcodes(ps, total);
+}
+
+void profile_clean() {
+  clean_profile_state(profile_state);
+  profile_state = NULL;
+}
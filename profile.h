@@ -0,0 +1,43 @@
+#pragma once
+
+#include "cpu.h"
+#include "defines.h"
+
+// the guest profiler. with is_profile on, every instruction adds its cycles
+// to a per-pc and a per-opcode counter, and that's all it costs. with it
+// off, PROFILE is an empty macro. profile_write turns the counters into
+// folded stacks for flamegraph.pl, labelled from the rom's .sasm source
+// when there is one.
+
+typedef struct ProfileState {
+  u64 pc_cycles[RAM_SIZE];
+  u64 opcode_cycles[256];
+  u8 suspended; // see profile_suspend.
+} ProfileState;
+
+// NULL until profile_init.
+extern ProfileState *profile_state;
+
+// the counters aren't atomic, so only start it when one thread runs the
+// machines: main leaves it off for --search and --serve.
+void profile_init();
+// write folded stacks to path and print a summary. sasm_path can be NULL,
+// then everything is labelled by address.
+void profile_write(EmuState *state, const char *path, const char *sasm_path);
+void profile_clean();
+// while suspended nothing is counted, like trace_suspend. run-ahead's look
+// ahead frames aren't time the game spent.
+void profile_suspend(u8 suspended);
+
+static inline void profile_record(u16 pc, u8 opcode, u32 cycles) {
+  if (profile_state == NULL || profile_state->suspended)
+    return;
+  profile_state->pc_cycles[pc] += cycles;
+  profile_state->opcode_cycles[opcode] += cycles;
+}
+
+#if is_profile
+#define PROFILE(pc, opcode, cycles) profile_record(pc, opcode, cycles)
+#else
+#define PROFILE(pc, opcode, cycles) ((void)(pc), (void)(cycles))
+#endif
@@ -0,0 +1,171 @@
+#include "resample.h"
+
+#include <immintrin.h>
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+static const struct {
+  u32 taps;
+  u32 phases;
+  double beta;   // of the kaiser window.
+  double cutoff; // as a fraction of the lower nyquist.
+} qualities[3] = {
+    {8, 64, 5, 0.80},
+    {16, 128, 7, 0.88},
+    {32, 256, 9, 0.94},
+};
+
+/// THE KERNELS
+// the reference. gcc won't reorder a float sum without -ffast-math, so this
+// stays the plain left to right loop it looks like.
+static float dot_scalar(const float *input, const float *kernel, u32 taps) {
+  float sum = 0;
+  for (u32 i = 0; i < taps; i++)
+    sum += input[i] * kernel[i];
+  return sum;
+}
+
+// taps are always a multiple of 8, so two vectors a time.
+static float dot_sse(const float *input, const float *kernel, u32 taps) {
+  __m128 a = _mm_setzero_ps(), b = _mm_setzero_ps();
+  for (u32 i = 0; i < taps; i += 8) {
+    a = _mm_add_ps(a, _mm_mul_ps(_mm_loadu_ps(input + i),
+                                 _mm_load_ps(kernel + i)));
+    b = _mm_add_ps(b, _mm_mul_ps(_mm_loadu_ps(input + i + 4),
+                                 _mm_load_ps(kernel + i + 4)));
+  }
+  a = _mm_add_ps(a, b);
+  a = _mm_add_ps(a, _mm_movehl_ps(a, a));
+  a = _mm_add_ss(a, _mm_shuffle_ps(a, a, 1));
+  return _mm_cvtss_f32(a);
+}
+
+__attribute__((target("avx2,fma"))) static float
+dot_avx2(const float *input, const float *kernel, u32 taps) {
+  __m256 sum = _mm256_setzero_ps();
+  for (u32 i = 0; i < taps; i += 8)
+    sum = _mm256_fmadd_ps(_mm256_loadu_ps(input + i),
+                          _mm256_load_ps(kernel + i), sum);
+  __m128 a = _mm_add_ps(_mm256_castps256_ps128(sum),
+                        _mm256_extractf128_ps(sum, 1));
+  a = _mm_add_ps(a, _mm_movehl_ps(a, a));
+  a = _mm_add_ss(a, _mm_shuffle_ps(a, a, 1));
+  return _mm_cvtss_f32(a);
+}
+
+u8 resample_set_kernel(Resampler *r, ResampleKernel kind) {
+  switch (kind) {
+  case ResampleScalar:
+    r->dot = dot_scalar;
+    break;
+  case ResampleSse:
+    r->dot = dot_sse; // x86-64 always has sse2.
+    break;
+  case ResampleAvx2:
+    if (!__builtin_cpu_supports("avx2") || !__builtin_cpu_supports("fma"))
+      return 0;
+    r->dot = dot_avx2;
+    break;
+  }
+  r->kind = kind;
+  return 1;
+}
+
+/// THE FILTER
+static double bessel_i0(double x) {
+  double sum = 1, term = 1;
+  for (int k = 1; k < 32; k++) {
+    term *= (x / (2 * k)) * (x / (2 * k));
+    sum += term;
+  }
+  return sum;
+}
+
+Resampler *make_resampler(u32 in_rate, u32 out_rate, ResampleQuality quality) {
+  Resampler *r = (Resampler *)calloc(1, sizeof(Resampler));
+  r->taps = qualities[quality].taps;
+  r->phases = qualities[quality].phases;
+  r->kernel = (float *)aligned_alloc(32, r->phases * r->taps * sizeof(float));
+  r->step = (double)in_rate / out_rate;
+  r->ratio = 1;
+
+  // a sinc cut off under whichever nyquist is lower, kaiser windowed. phase
+  // p is for an output p / phases of the way from one input to the next,
+  // and each one sums to 1 so the gain doesn't ripple with the phase.
+  double beta = qualities[quality].beta;
+  double cutoff = qualities[quality].cutoff;
+  if (out_rate < in_rate)
+    cutoff *= (double)out_rate / in_rate;
+  double half = r->taps / 2;
+  for (u32 p = 0; p < r->phases; p++) {
+    float *phase = r->kernel + p * r->taps;
+    double sum = 0;
+    for (u32 t = 0; t < r->taps; t++) {
+      double x = t - (half - 1) - (double)p / r->phases;
+      double edge = x / half;
+      double window = 0;
+      if (fabs(edge) < 1)
+        window = bessel_i0(beta * sqrt(1 - edge * edge)) / bessel_i0(beta);
+      double sinc = x == 0 ? 1 : sin(M_PI * cutoff * x) / (M_PI * cutoff * x);
+      phase[t] = sinc * window;
+      sum += sinc * window;
+    }
+    for (u32 t = 0; t < r->taps; t++)
+      phase[t] /= sum;
+  }
+
+  if (!resample_set_kernel(r, ResampleAvx2))
+    resample_set_kernel(r, ResampleSse);
+  return r;
+}
+
+void clean_resampler(Resampler *r) {
+  free(r->kernel);
+  free(r);
+}
+
+void resample_set_ratio(Resampler *r, double ratio) { r->ratio = ratio; }
+
+/// THE BLOCKS
+u32 resample_block(Resampler *r, const float *in, u32 count, float *out,
+                   u32 capacity) {
+  const double step = r->step / r->ratio;
+  u32 made = 0;
+
+  while (count > 0) {
+    u32 room = RESAMPLE_MAX_TAPS + RESAMPLE_BLOCK - r->held;
+    u32 chunk = count < room ? count : room;
+    memcpy(r->history + r->held, in, chunk * sizeof(float));
+    r->held += chunk;
+    in += chunk;
+    count -= chunk;
+
+    // every output whose window is all here. the nearest phase can be the
+    // one for the next input over.
+    for (;;) {
+      u32 i = (u32)r->position;
+      u32 phase = (u32)((r->position - i) * r->phases + 0.5);
+      if (phase == r->phases) {
+        phase = 0;
+        i++;
+      }
+      if (i + r->taps > r->held)
+        break;
+      if (made < capacity)
+        out[made++] =
+            r->dot(r->history + i, r->kernel + phase * r->taps, r->taps);
+      r->position += step;
+    }
+
+    // nothing before the next output's window is needed again.
+    u32 done = (u32)r->position;
+    if (done > r->held)
+      done = r->held;
+    memmove(r->history, r->history + done,
+            (r->held - done) * sizeof(float));
+    r->held -= done;
+    r->position -= done;
+  }
+  return made;
+}
@@ -0,0 +1,64 @@
+#pragma once
+
+#include "defines.h"
+
+// a polyphase windowed sinc resampler, for getting the apu's samples to the
+// sound device's rate. the apu makes its band-limited steps at a rate a
+// comfortable way above the device's (AUDIO_SYNTH_RATE, see audio.h), and
+// this brings them down with a proper lowpass, at a ratio that can move a
+// little from block to block for pace.h's rate control.
+//
+// it works a block at a time, a frame's samples in and the device's out,
+// and keeps the tail it needs for the next block to itself. every output is
+// one dot product of the input around it with one phase of the filter, the
+// phase nearest the output's fraction of an input sample. the dot product
+// comes in three kernels: a plain scalar one, which is the reference, and
+// sse and avx2 ones, picked by what the cpu has. the vector ones add up in a
+// different order, so they match the reference to within float rounding,
+// not bit for bit. ./nes_bench resample checks that.
+
+#define RESAMPLE_MAX_TAPS 32
+#define RESAMPLE_BLOCK 4096 // input samples taken in at a time.
+
+typedef enum ResampleQuality {
+  ResampleLow,    // 8 taps, 64 phases. cheap, some aliasing near the top.
+  ResampleMedium, // 16 taps, 128 phases.
+  ResampleHigh,   // 32 taps, 256 phases.
+} ResampleQuality;
+
+typedef enum ResampleKernel {
+  ResampleScalar,
+  ResampleSse,
+  ResampleAvx2,
+} ResampleKernel;
+
+typedef struct Resampler {
+  u32 taps;
+  u32 phases;
+  float *kernel; // phases * taps, each phase 32 byte aligned.
+
+  ResampleKernel kind;
+  float (*dot)(const float *input, const float *kernel, u32 taps);
+
+  double step;     // input samples per output sample, at the nominal ratio.
+  double ratio;    // outputs per input, relative to nominal. see set_ratio.
+  double position; // of the next output, in input samples into history.
+
+  // the input not used up yet, oldest first.
+  float history[RESAMPLE_MAX_TAPS + RESAMPLE_BLOCK];
+  u32 held;
+} Resampler;
+
+Resampler *make_resampler(u32 in_rate, u32 out_rate, ResampleQuality quality);
+void clean_resampler(Resampler *r);
+
+// the fastest kernel the cpu has is picked on make, this is for comparing
+// them. 0 if the cpu can't run it.
+u8 resample_set_kernel(Resampler *r, ResampleKernel kind);
+// above 1 makes more output per input, below 1 less. for pace.h.
+void resample_set_ratio(Resampler *r, double ratio);
+
+// the block through, as many outputs as it makes up to capacity. ones past
+// capacity are skipped, so give it room for count / step and a few more.
+u32 resample_block(Resampler *r, const float *in, u32 count, float *out,
+                   u32 capacity);
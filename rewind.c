@@ -0,0 +1,242 @@
+#include "rewind.h"
+
+#include <emmintrin.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+RewindState *rewind_state = NULL;
+
+// a literal run ends once this many matching bytes show up, that's about
+// what a new token header costs.
+#define MIN_ZERO_RUN 4
+
+// packed size worst case: every token is at most two 3 byte varints, and
+// every token after the first covers at least MIN_ZERO_RUN bytes.
+#define PACKED_BOUND (sizeof(SaveState) * 3)
+
+RewindState *make_rewind_state(u32 capacity, u32 interval) {
+  RewindState *rs = (RewindState *)malloc(sizeof(RewindState));
+  // split the cap between the ring and an index with an entry for every
+  // REWIND_MIN_ENTRY bytes of it.
+  u64 per_entry = REWIND_MIN_ENTRY + sizeof(RewindEntry);
+  rs->max_entries = capacity / per_entry + 1;
+  u32 index = rs->max_entries * sizeof(RewindEntry);
+  rs->capacity = capacity > index ? capacity - index : 0;
+  rs->ring = (u8 *)malloc(rs->capacity);
+
+  rs->entries = (RewindEntry *)malloc(rs->max_entries * sizeof(RewindEntry));
+  rs->first = 0;
+  rs->count = 0;
+  rs->stored = 0;
+
+  rs->interval = interval ? interval : 1;
+  rs->frames_since = 0;
+
+  rs->latest = (SaveState *)malloc(sizeof(SaveState));
+  rs->scratch = (SaveState *)malloc(sizeof(SaveState));
+  rs->has_latest = 0;
+  rs->packed = (u8 *)malloc(PACKED_BOUND);
+  return rs;
+}
+
+void clean_rewind_state(RewindState *rs) {
+  free(rs->ring);
+  free(rs->entries);
+  free(rs->latest);
+  free(rs->scratch);
+  free(rs->packed);
+  free(rs);
+}
+
+/// PACKING
+// the format is a list of tokens, each one being
+//   varint skip, varint length, length bytes of (a ^ b).
+// skip is a run of bytes where a and b match, which is almost all of them
+// frame to frame.
+
+static u8 *put_varint(u8 *out, u32 value) {
+  while (value >= 0x80) {
+    *out++ = (u8)(value | 0x80);
+    value >>= 7;
+  }
+  *out++ = (u8)value;
+  return out;
+}
+
+static const u8 *get_varint(const u8 *in, u32 *value) {
+  u32 result = 0;
+  int shift = 0;
+  while (*in & 0x80) {
+    result |= (u32)(*in++ & 0x7F) << shift;
+    shift += 7;
+  }
+  *value = result | ((u32)*in++ << shift);
+  return in;
+}
+
+// how many bytes from pos on match between a and b. 16 at a time while we
+// can, this is where nearly all the time goes.
+static u32 match_run(const u8 *a, const u8 *b, u32 pos, u32 size) {
+  u32 start = pos;
+
+  while (pos + 16 <= size) {
+    __m128i va = _mm_loadu_si128((const __m128i *)(a + pos));
+    __m128i vb = _mm_loadu_si128((const __m128i *)(b + pos));
+    u32 mask = _mm_movemask_epi8(_mm_cmpeq_epi8(va, vb));
+    if (mask != 0xFFFF) // stop at the first mismatching byte.
+      return pos - start + __builtin_ctz(~mask);
+    pos += 16;
+  }
+
+  while (pos < size && a[pos] == b[pos])
+    pos++;
+
+  return pos - start;
+}
+
+// pack a ^ b into out, returning the packed size.
+static u32 pack_xor(const u8 *a, const u8 *b, u32 size, u8 *out) {
+  u8 *start = out;
+  u32 pos = 0;
+
+  while (pos < size) {
+    u32 skip = match_run(a, b, pos, size);
+    pos += skip;
+
+    // the literal runs until MIN_ZERO_RUN matching bytes in a row.
+    u32 end = pos;
+    u32 matching = 0;
+    while (end < size && matching < MIN_ZERO_RUN) {
+      matching = (a[end] == b[end]) ? matching + 1 : 0;
+      end++;
+    }
+    end -= matching;
+
+    out = put_varint(out, skip);
+    out = put_varint(out, end - pos);
+    for (; pos < end; pos++)
+      *out++ = a[pos] ^ b[pos];
+  }
+
+  return out - start;
+}
+
+// XOR a packed delta back into target.
+static void unpack_xor(u8 *target, const u8 *in, u32 packed_size) {
+  const u8 *end = in + packed_size;
+  u32 pos = 0;
+
+  while (in < end) {
+    u32 skip, length;
+    in = get_varint(in, &skip);
+    in = get_varint(in, &length);
+    pos += skip;
+    for (u32 i = 0; i < length; i++)
+      target[pos + i] ^= in[i];
+    in += length;
+    pos += length;
+  }
+}
+
+/// THE RING
+static void drop_oldest(RewindState *rs) {
+  rs->stored -= rs->entries[rs->first].size;
+  rs->first = (rs->first + 1) % rs->max_entries;
+  rs->count--;
+}
+
+static u8 overlaps(RewindEntry *e, u32 offset, u32 size) {
+  return e->offset < offset + size && offset < e->offset + e->size;
+}
+
+static void push_entry(RewindState *rs, const u8 *data, u32 size) {
+  if (size > rs->capacity)
+    return; // would never fit, just lose the history.
+
+  if (rs->count == rs->max_entries)
+    drop_oldest(rs);
+
+  u32 offset = 0;
+  if (rs->count > 0) {
+    RewindEntry *newest =
+        &rs->entries[(rs->first + rs->count - 1) % rs->max_entries];
+    offset = newest->offset + newest->size;
+
+    if (offset + size > rs->capacity) {
+      // wrap. everything past the newest entry is older than it, so all of
+      // that goes first.
+      while (rs->count > 0 && rs->entries[rs->first].offset >= offset)
+        drop_oldest(rs);
+      offset = 0;
+    }
+  }
+
+  while (rs->count > 0 && overlaps(&rs->entries[rs->first], offset, size))
+    drop_oldest(rs);
+
+  memcpy(rs->ring + offset, data, size);
+
+  RewindEntry *e = &rs->entries[(rs->first + rs->count) % rs->max_entries];
+  e->offset = offset;
+  e->size = size;
+  rs->count++;
+  rs->stored += size;
+}
+
+/// MODULE FUNCTIONS
+void rewind_init(u32 capacity, u32 interval) {
+  rewind_state = make_rewind_state(capacity, interval);
+}
+
+void rewind_update(EmuState *state) {
+  RewindState *rs = rewind_state;
+
+  if (++rs->frames_since < rs->interval)
+    return;
+  rs->frames_since = 0;
+
+  save_state(state, rs->scratch);
+
+  if (rs->has_latest) { // store the way back from the new one to the old.
+    u32 size = pack_xor((u8 *)rs->scratch, (u8 *)rs->latest,
+                        sizeof(SaveState), rs->packed);
+    push_entry(rs, rs->packed, size);
+  }
+
+  SaveState *swap = rs->latest;
+  rs->latest = rs->scratch;
+  rs->scratch = swap;
+  rs->has_latest = 1;
+}
+
+u8 rewind_step_back(EmuState *state) {
+  RewindState *rs = rewind_state;
+
+  if (rs->count == 0)
+    return 0;
+
+  RewindEntry *newest =
+      &rs->entries[(rs->first + rs->count - 1) % rs->max_entries];
+  unpack_xor((u8 *)rs->latest, rs->ring + newest->offset, newest->size);
+  rs->stored -= newest->size;
+  rs->count--;
+
+  rs->frames_since = 0;
+  // nothing runs here, so there's nothing to keep out of the trace or the
+  // profile. the clock does go back, the trace records carry all of it.
+  return load_state(state, rs->latest);
+}
+
+void rewind_report() {
+  RewindState *rs = rewind_state;
+  double seconds = (double)rs->count * rs->interval / 60.0;
+
+  printf("Rewind: %u snapshots, %.1f seconds of history in %llu/%u bytes",
+         rs->count, seconds, (unsigned long long)rs->stored, rs->capacity);
+  if (seconds > 0)
+    printf(" (%.0f bytes per second)", rs->stored / seconds);
+  printf(".\n");
+}
+
+void rewind_clean() { clean_rewind_state(rewind_state); }
@@ -0,0 +1,55 @@
+#pragma once
+
+#include "cpu.h"
+#include "defines.h"
+#include "state.h"
+
+// rewind history. every interval frames the whole machine is snapshotted,
+// XORed against the previous snapshot and run-length packed into a fixed
+// size byte ring. the newest snapshot is kept unpacked, and the deltas chain
+// backwards from it, so stepping back is one unpack + XOR per step. when the
+// ring is full the oldest deltas get dropped.
+//
+// the cap covers the index of deltas as well as their bytes. the index has
+// room for a delta every REWIND_MIN_ENTRY bytes of ring, which a game that
+// does anything at all beats. a machine sat in a tight loop packs smaller
+// (15-20 bytes a frame), and then the index fills first and the oldest
+// deltas go a little earlier than the bytes alone would have needed.
+#define REWIND_MIN_ENTRY 64
+
+typedef struct RewindEntry {
+  u32 offset; // into the ring.
+  u32 size;
+} RewindEntry;
+
+typedef struct RewindState {
+  u8 *ring;
+  u32 capacity; // bytes of packed history, what's left of the cap after
+                 // the index.
+
+  RewindEntry *entries;
+  u32 max_entries;
+  u32 first; // the oldest entry.
+  u32 count;
+  u64 stored; // total packed bytes currently in the ring.
+
+  u32 interval; // frames between snapshots.
+  u32 frames_since;
+
+  SaveState *latest; // the newest snapshot, unpacked.
+  SaveState *scratch;
+  u8 has_latest;
+  u8 *packed; // worst case sized buffer for packing one snapshot.
+} RewindState;
+
+extern RewindState *rewind_state;
+
+void rewind_init(u32 capacity, u32 interval);
+// call once per emulated frame, records when the interval comes around.
+void rewind_update(EmuState *state);
+// load the snapshot before the newest one. 1 if it moved, 0 if the history
+// is used up.
+u8 rewind_step_back(EmuState *state);
+// print how much history we're holding, and what it costs per second.
+void rewind_report();
+void rewind_clean();
@@ -2,10 +2,6 @@
 ## run all the tests in ./tests, after building them
 ## with the assembler.
 
-line() {
-	echo "-----------------------------------------------------------------"
-}
-
 cd tests
 
 ./build_tests.sh
@@ -13,12 +9,20 @@ cd tests
 cd ..
 
 # build before testing, no sense in testing an
-# out of date one
-make
+# out of date one. the runner is headless, and runs them all at once.
+./make.sh test
+
+status=0
+./nes_test $(find tests -name "*.bin") || status=1
+./nes_env || status=1
+
+# the checks that live in the bench, and fail it the same way: the audio
+# ring, its counters and the wav writer, both observation kernels against
+# the scalar reference, and the lockstep machines against running alone.
+# short runs, the timings don't matter here.
+./make.sh bench
+./nes_bench audio || status=1
+./nes_bench observe 100 || status=1
+./nes_bench lockstep 60 1 || status=1
 
-for file in $(find tests -name "*.bin"); do
-	line
-	echo -e "\e[32mRunning test $file...\e[0m"	# green text
-	./nes "$file" && echo "Finished testing $file, exited with success." | lolcat -F 0.5 || echo -e "\e[31m./nes process exited with nonzero status code.\e[0m"
-	line
-done
+exit $status
@@ -0,0 +1,54 @@
+#include "runahead.h"
+#include "profile.h"
+#include "trace.h"
+
+#include <stdlib.h>
+
+RunaheadState *runahead_state = NULL;
+
+RunaheadState *make_runahead_state(u32 frames) {
+  RunaheadState *rs = (RunaheadState *)malloc(sizeof(RunaheadState));
+  rs->frames = frames;
+  rs->real = (SaveState *)malloc(sizeof(SaveState));
+  return rs;
+}
+
+void clean_runahead_state(RunaheadState *rs) {
+  free(rs->real);
+  free(rs);
+}
+
+void runahead_init(u32 frames) {
+  runahead_state = make_runahead_state(frames);
+}
+
+void runahead_update(EmuState *state, void (*present)(EmuState *)) {
+  RunaheadState *rs = runahead_state;
+
+  if (rs->frames == 0) {
+    present(state);
+    return;
+  }
+
+  save_state(state, rs->real);
+
+  // the held buttons are part of the state, so the ahead frames see the
+  // same input the real one did. they make no sound, the real frames
+  // already did, and they're left out of the trace and the profile, which
+  // are of the real timeline.
+  AudioBuffer *audio = state->audio;
+  state->audio = NULL;
+  trace_suspend(1);
+  profile_suspend(1);
+  for (u32 i = 0; i < rs->frames; i++)
+    cpu_run_frame(state);
+  trace_suspend(0);
+  profile_suspend(0);
+
+  present(state);
+
+  load_state(state, rs->real);
+  state->audio = audio;
+}
+
+void runahead_clean() { clean_runahead_state(runahead_state); }
@@ -0,0 +1,23 @@
+#pragma once
+
+#include "cpu.h"
+#include "defines.h"
+#include "state.h"
+
+// run-ahead. games take a frame or more to react to input, so after the real
+// frame is emulated we snapshot, emulate `frames` more with the same input,
+// show the result of that and then snapshot back to the real timeline. the
+// ahead frames are thrown away, nothing they do (audio included) is kept.
+
+typedef struct RunaheadState {
+  u32 frames; // how far ahead to show, 0 is off.
+  SaveState *real; // where we come back to after looking ahead.
+} RunaheadState;
+
+extern RunaheadState *runahead_state;
+
+void runahead_init(u32 frames);
+// call after the real frame has run. present gets the machine as it'll be
+// `frames` frames from now, and then the real state is restored.
+void runahead_update(EmuState *state, void (*present)(EmuState *));
+void runahead_clean();
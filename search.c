@@ -0,0 +1,289 @@
+#include "search.h"
+#include "movie.h"
+#include "state.h"
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+// what a bot might press. not every combination, most of those are useless
+// and they multiply the branching factor.
+static const u8 search_actions[] = {
+    0,
+    ButtonA,
+    ButtonB,
+    ButtonStart,
+    ButtonUp,
+    ButtonDown,
+    ButtonLeft,
+    ButtonRight,
+    ButtonRight | ButtonA,
+    ButtonRight | ButtonB,
+    ButtonRight | ButtonA | ButtonB,
+    ButtonLeft | ButtonA,
+};
+
+#define ACTION_COUNT (sizeof(search_actions) / sizeof(search_actions[0]))
+
+typedef struct Node {
+  EmuState *state; // NULL once it's been dropped.
+  int parent;      // index into the step before.
+  u8 buttons;
+  int key;         // the objective, turned so that bigger is always better.
+  u64 hash;
+} Node;
+
+// how we got to each survivor, kept for every step so the winner can be
+// traced back to the start.
+typedef struct Step {
+  int parent;
+  u8 buttons;
+} Step;
+
+// every state hash we've seen, open addressing. 0 marks an empty slot.
+typedef struct Visited {
+  u64 *slots;
+  u64 capacity; // a power of two.
+  u64 count;
+} Visited;
+
+typedef struct Search {
+  SearchObjective objective;
+
+  Node *beam;
+  int beam_count;
+  Node *children; // ACTION_COUNT per beam node.
+
+  // the pool. everyone meets at start, expands beam nodes until they run
+  // out, and meets again at done.
+  pthread_t *threads;
+  int workers;
+  pthread_barrier_t start;
+  pthread_barrier_t done;
+  _Atomic int next;
+  u8 quit;
+} Search;
+
+static double now_seconds() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/// THE VISITED SET
+// 1 if the hash was new.
+static u8 visit(Visited *v, u64 hash) {
+  if (hash == 0)
+    hash = 1;
+
+  if (v->count * 2 >= v->capacity) { // grow and rehash.
+    Visited bigger = {(u64 *)calloc(v->capacity * 2, sizeof(u64)),
+                      v->capacity * 2, 0};
+    for (u64 i = 0; i < v->capacity; i++)
+      if (v->slots[i])
+        visit(&bigger, v->slots[i]);
+    free(v->slots);
+    *v = bigger;
+  }
+
+  u64 i = hash & (v->capacity - 1);
+  while (v->slots[i]) {
+    if (v->slots[i] == hash)
+      return 0;
+    i = (i + 1) & (v->capacity - 1);
+  }
+  v->slots[i] = hash;
+  v->count++;
+  return 1;
+}
+
+/// EXPANDING
+static int objective_key(SearchObjective objective, EmuState *state) {
+  int value = peek(state, objective.address);
+  return objective.maximize ? value : -value;
+}
+
+static void expand(Search *s, int index) {
+  EmuState *parent = s->beam[index].state;
+
+  for (u32 a = 0; a < ACTION_COUNT; a++) {
+    Node *child = &s->children[index * ACTION_COUNT + a];
+    child->state = clone_instance(parent);
+    child->parent = index;
+    child->buttons = search_actions[a];
+
+    EmuState *state = child->state;
+    state->input.buttons[0] = child->buttons;
+    state->input.buttons[1] = 0;
+    for (int f = 0; f < SEARCH_STEP_FRAMES; f++)
+      cpu_run_frame(state);
+
+    // the held buttons are replaced before every frame, they aren't part of
+    // where the machine is. leaving them in would keep every sibling apart.
+    state->input.buttons[0] = 0;
+    child->hash = hash_machine(state);
+    child->key = objective_key(s->objective, state);
+  }
+}
+
+static void *worker_thread(void *arg) {
+  Search *s = (Search *)arg;
+
+  for (;;) {
+    pthread_barrier_wait(&s->start);
+    if (s->quit)
+      break;
+
+    int index;
+    while ((index = atomic_fetch_add(&s->next, 1)) < s->beam_count)
+      expand(s, index);
+    pthread_barrier_wait(&s->done);
+  }
+
+  return NULL;
+}
+
+/// SELECTING
+static int compare_nodes(const void *a, const void *b) {
+  const Node *x = (const Node *)a;
+  const Node *y = (const Node *)b;
+  if (x->key != y->key)
+    return y->key - x->key; // best first.
+  // then the order they were made in, so a search always comes out the same.
+  if (x->parent != y->parent)
+    return x->parent - y->parent;
+  return x->buttons - y->buttons;
+}
+
+// dedupe the children into the next beam. returns how many survived.
+static int select_survivors(Search *s, Visited *visited, int child_count) {
+  int kept = 0;
+  for (int i = 0; i < child_count; i++) {
+    Node *child = &s->children[i];
+    // a halted machine isn't going anywhere, and a repeat is already covered.
+    if (child->state->cpu_state->shutting_down || !visit(visited, child->hash))
+      clean_emu_state(child->state);
+    else
+      s->children[kept++] = *child;
+  }
+
+  qsort(s->children, kept, sizeof(Node), compare_nodes);
+  for (int i = SEARCH_BEAM; i < kept; i++)
+    clean_emu_state(s->children[i].state);
+  return kept < SEARCH_BEAM ? kept : SEARCH_BEAM;
+}
+
+/// THE MOVIE
+static u8 write_movie(EmuState *start, Step **trail, int depth, int index,
+                      const char *path) {
+  u8 *buttons = (u8 *)malloc(depth + 1);
+  for (int d = depth; d > 0; d--) { // walk back up to the start.
+    buttons[d] = trail[d][index].buttons;
+    index = trail[d][index].parent;
+  }
+
+  // play it again for real, recording as we go.
+  EmuState *state = clone_instance(start);
+  u8 ok = movie_record_init(path, state, 1);
+  for (int d = 1; ok && d <= depth; d++) {
+    for (int f = 0; f < SEARCH_STEP_FRAMES; f++) {
+      state->input.buttons[0] = buttons[d];
+      state->input.buttons[1] = 0;
+      cpu_run_frame(state);
+      movie_record_update(state);
+    }
+  }
+  if (ok)
+    movie_record_clean();
+
+  clean_emu_state(state);
+  free(buttons);
+  return ok;
+}
+
+u8 search_run(EmuState *start, SearchObjective objective, u64 budget,
+              const char *movie_path) {
+  Search s = {0};
+  s.objective = objective;
+  s.beam = (Node *)calloc(SEARCH_BEAM, sizeof(Node));
+  s.children = (Node *)calloc(SEARCH_BEAM * ACTION_COUNT, sizeof(Node));
+
+  Visited visited = {(u64 *)calloc(1024, sizeof(u64)), 1024, 0};
+  Step **trail = (Step **)calloc(SEARCH_MAX_DEPTH + 1, sizeof(Step *));
+
+  s.beam[0] = (Node){clone_instance(start), -1, 0,
+                     objective_key(objective, start), 0};
+  s.beam_count = 1;
+
+  s.workers = sysconf(_SC_NPROCESSORS_ONLN);
+  if (s.workers < 1)
+    s.workers = 1;
+  s.threads = (pthread_t *)calloc(s.workers, sizeof(pthread_t));
+  pthread_barrier_init(&s.start, NULL, s.workers + 1);
+  pthread_barrier_init(&s.done, NULL, s.workers + 1);
+  for (int i = 0; i < s.workers; i++)
+    pthread_create(&s.threads[i], NULL, worker_thread, &s);
+
+  int best_key = s.beam[0].key, best_depth = 0, best_index = 0;
+  u64 frames = 0;
+  int depth = 0;
+  double started = now_seconds();
+
+  while (depth < SEARCH_MAX_DEPTH && frames < budget && s.beam_count > 0) {
+    atomic_store(&s.next, 0);
+    pthread_barrier_wait(&s.start);
+    pthread_barrier_wait(&s.done);
+
+    int child_count = s.beam_count * ACTION_COUNT;
+    frames += (u64)child_count * SEARCH_STEP_FRAMES;
+    for (int i = 0; i < s.beam_count; i++)
+      clean_emu_state(s.beam[i].state);
+
+    s.beam_count = select_survivors(&s, &visited, child_count);
+    memcpy(s.beam, s.children, s.beam_count * sizeof(Node));
+    depth++;
+
+    trail[depth] = (Step *)malloc(SEARCH_BEAM * sizeof(Step));
+    for (int i = 0; i < s.beam_count; i++)
+      trail[depth][i] = (Step){s.beam[i].parent, s.beam[i].buttons};
+
+    // sorted, so the front of the beam is this step's best. strictly better
+    // only, the shortest way to a score wins.
+    if (s.beam_count > 0 && s.beam[0].key > best_key) {
+      best_key = s.beam[0].key;
+      best_depth = depth;
+      best_index = 0;
+    }
+  }
+  double elapsed = now_seconds() - started;
+
+  s.quit = 1;
+  pthread_barrier_wait(&s.start);
+  for (int i = 0; i < s.workers; i++)
+    pthread_join(s.threads[i], NULL);
+
+  printf("Searched %d steps, %llu frames, %llu unique states in %.2fs (%.0f "
+         "frames/s on %d threads).\n",
+         depth, (unsigned long long)frames, (unsigned long long)visited.count,
+         elapsed, frames / elapsed, s.workers);
+  printf("Best: $%04X = %d after %d frames.\n", objective.address,
+         objective.maximize ? best_key : -best_key,
+         best_depth * SEARCH_STEP_FRAMES);
+
+  u8 ok = write_movie(start, trail, best_depth, best_index, movie_path);
+
+  for (int i = 0; i < s.beam_count; i++)
+    clean_emu_state(s.beam[i].state);
+  for (int d = 0; d <= depth; d++)
+    free(trail[d]);
+  free(trail);
+  free(visited.slots);
+  free(s.beam);
+  free(s.children);
+  free(s.threads);
+  pthread_barrier_destroy(&s.start);
+  pthread_barrier_destroy(&s.done);
+  return ok;
+}
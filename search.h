@@ -0,0 +1,30 @@
+#pragma once
+
+#include "cpu.h"
+#include "defines.h"
+
+// input search, for the qa bots. from a start state, try controller inputs
+// and keep whatever gets a byte of ram furthest in the direction we want
+// (a score, a position, a level counter). it's a beam search: every step,
+// each survivor tries every action in search_actions for SEARCH_STEP_FRAMES
+// frames, the children are deduplicated by state hash (against everything
+// seen so far, not just this step) and the best SEARCH_BEAM go on. survivors
+// are expanded across every core, each one on its own clone, so the only
+// memory a child costs is the pages it actually writes.
+//
+// the best line found is written out as a movie, which plays back with
+// ./nes rom --play.
+
+#define SEARCH_BEAM 64        // survivors kept each step.
+#define SEARCH_STEP_FRAMES 8  // frames each action is held for.
+#define SEARCH_MAX_DEPTH 4096 // steps, whatever the budget says.
+
+typedef struct SearchObjective {
+  u16 address;
+  u8 maximize; // or minimize.
+} SearchObjective;
+
+// run the search from start, which isn't touched, until budget frames have
+// been emulated in total. 1 if a movie was written.
+u8 search_run(EmuState *start, SearchObjective objective, u64 budget,
+              const char *movie_path);
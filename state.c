@@ -0,0 +1,250 @@
+#include "state.h"
+
+#include <emmintrin.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <string.h>
+
+static u8 check_header(u32 magic, u32 version) {
+  if (magic != save_state_magic) {
+    printf("Save-state magic does not match (%08X), not loading.\n", magic);
+    return 0;
+  }
+
+  if (version != save_state_version) {
+    printf("Save-state version %u does not match the core's version %u, not "
+           "loading.\n",
+           version, save_state_version);
+    return 0;
+  }
+
+  return 1;
+}
+
+u8 save_state(EmuState *state, SaveState *out) {
+  if (state == NULL || out == NULL)
+    return 0;
+
+  out->magic = save_state_magic;
+  out->version = save_state_version;
+
+  memcpy(&out->cpu, state->cpu_state, sizeof(CPUState));
+  memcpy(&out->input, &state->input, sizeof(InputState));
+  memcpy(&out->apu, &state->apu, sizeof(ApuState));
+  for (int page = 0; page < PAGE_COUNT; page++)
+    memcpy(out->ram + page * PAGE_SIZE, state->pages[page]->data, PAGE_SIZE);
+
+  memset(state->dirty, 0, sizeof(state->dirty));
+
+  return 1;
+}
+
+u8 load_state(EmuState *state, const SaveState *in) {
+  if (state == NULL || in == NULL)
+    return 0;
+
+  if (!check_header(in->magic, in->version))
+    return 0;
+
+  // copy into the existing allocations, so anyone holding a pointer to the
+  // cpu state stays valid.
+  memcpy(state->cpu_state, &in->cpu, sizeof(CPUState));
+  memcpy(&state->input, &in->input, sizeof(InputState));
+  memcpy(&state->apu, &in->apu, sizeof(ApuState));
+  // pages that already match are left alone, so a clone keeps sharing them.
+  for (int page = 0; page < PAGE_COUNT; page++) {
+    const u8 *data = in->ram + page * PAGE_SIZE;
+    if (memcmp(state->pages[page]->data, data, PAGE_SIZE) != 0)
+      memcpy(page_for_write(state, page), data, PAGE_SIZE);
+  }
+
+  memset(state->dirty, 0, sizeof(state->dirty));
+
+  return 1;
+}
+
+u8 save_delta(EmuState *state, DeltaState *out) {
+  if (state == NULL || out == NULL)
+    return 0;
+
+  out->magic = save_state_magic;
+  out->version = save_state_version;
+
+  memcpy(&out->cpu, state->cpu_state, sizeof(CPUState));
+  memcpy(&out->input, &state->input, sizeof(InputState));
+  memcpy(&out->apu, &state->apu, sizeof(ApuState));
+  memcpy(out->pages, state->dirty, sizeof(out->pages));
+
+  u32 count = 0;
+  for (int w = 0; w < DIRTY_WORDS; w++) {
+    u64 bits = state->dirty[w];
+    while (bits) { // walk only the set bits.
+      int page = w * 64 + __builtin_ctzll(bits);
+      memcpy(out->data[count++], state->pages[page]->data, PAGE_SIZE);
+      bits &= bits - 1;
+    }
+  }
+  out->page_count = count;
+
+  return 1;
+}
+
+u8 load_delta(EmuState *state, const SaveState *base, const DeltaState *in) {
+  if (state == NULL || base == NULL || in == NULL)
+    return 0;
+
+  if (!check_header(base->magic, base->version) ||
+      !check_header(in->magic, in->version))
+    return 0;
+
+  // pages we've dirtied that the delta doesn't carry go back to the base.
+  for (int w = 0; w < DIRTY_WORDS; w++) {
+    u64 bits = state->dirty[w] & ~in->pages[w];
+    while (bits) {
+      int page = w * 64 + __builtin_ctzll(bits);
+      memcpy(page_for_write(state, page), base->ram + page * PAGE_SIZE,
+             PAGE_SIZE);
+      bits &= bits - 1;
+    }
+  }
+
+  // then the delta's own pages, in the same order they were packed.
+  u32 index = 0;
+  for (int w = 0; w < DIRTY_WORDS; w++) {
+    u64 bits = in->pages[w];
+    while (bits) {
+      int page = w * 64 + __builtin_ctzll(bits);
+      memcpy(page_for_write(state, page), in->data[index++], PAGE_SIZE);
+      bits &= bits - 1;
+    }
+  }
+
+  memcpy(state->cpu_state, &in->cpu, sizeof(CPUState));
+  memcpy(&state->input, &in->input, sizeof(InputState));
+  memcpy(&state->apu, &in->apu, sizeof(ApuState));
+  memcpy(state->dirty, in->pages, sizeof(state->dirty));
+
+  return 1;
+}
+
+u32 delta_state_size(const DeltaState *delta) {
+  return offsetof(DeltaState, data) + delta->page_count * PAGE_SIZE;
+}
+
+/// HASHING
+// xxh3's trick: xor 16 bytes with a slice of the key, then multiply each
+// 64 bit lane's halves together, which sse2 can do (32x32 -> 64). any odd
+// looking constants do for the key.
+static const u64 hash_key[8] = {
+    0x9E3779B185EBCA87, 0xC2B2AE3D27D4EB4F, 0x165667B19E3779F9,
+    0x85EBCA77C2B2AE63, 0x27D4EB2F165667C5, 0xFF51AFD7ED558CCD,
+    0xC4CEB9FE1A85EC53, 0xD6E8FEB86659FD93,
+};
+
+static u64 mix64(u64 h) { // murmur3's finalizer.
+  h ^= h >> 33;
+  h *= 0xFF51AFD7ED558CCD;
+  h ^= h >> 33;
+  h *= 0xC4CEB9FE1A85EC53;
+  h ^= h >> 33;
+  return h;
+}
+
+// the page number goes in as the seed, so the same bytes at two addresses
+// don't cancel out when the pages are xored together.
+static u64 hash_page(const u8 *data, u64 seed) {
+  __m128i seeds = _mm_set1_epi64x(seed);
+  __m128i acc[2] = {seeds, _mm_set1_epi64x(~seed)};
+
+  for (int i = 0; i < PAGE_SIZE / 16; i++) {
+    __m128i d = _mm_loadu_si128((const __m128i *)(data + i * 16));
+    __m128i k = _mm_xor_si128(
+        _mm_loadu_si128((const __m128i *)&hash_key[(i & 3) * 2]), seeds);
+    __m128i dk = _mm_xor_si128(d, k);
+    __m128i product = _mm_mul_epu32(dk, _mm_srli_epi64(dk, 32));
+    // the data goes in as well, swapped, so a zero product can't lose it.
+    __m128i swapped = _mm_shuffle_epi32(d, _MM_SHUFFLE(1, 0, 3, 2));
+    acc[i & 1] = _mm_add_epi64(acc[i & 1], _mm_add_epi64(product, swapped));
+  }
+
+  u64 lanes[4];
+  _mm_storeu_si128((__m128i *)&lanes[0], acc[0]);
+  _mm_storeu_si128((__m128i *)&lanes[2], acc[1]);
+
+  u64 h = seed;
+  for (int i = 0; i < 4; i++)
+    h = mix64(h ^ lanes[i]);
+  return h;
+}
+
+// the part of the apu the guest can see through $4015, now or later: the
+// length counters and what halts them, the frame sequencer, the dmc's
+// fetching and both irq flags. the pulse, triangle and noise timers only
+// run when there's a buffer to make sound into, so they'd make the same
+// machine hash differently with sound and without. they're left out, along
+// with everything else that only changes what's heard.
+static u64 hash_apu(const ApuState *apu) {
+  const ApuDmc *d = &apu->dmc;
+  u64 lengths = apu->pulse[0].length | apu->pulse[1].length << 8 |
+                apu->triangle.length << 16 | (u64)apu->noise.length << 24 |
+                (u64)apu->pulse[0].envelope.loop << 32 |
+                (u64)apu->pulse[1].envelope.loop << 33 |
+                (u64)apu->triangle.control << 34 |
+                (u64)apu->noise.envelope.loop << 35 |
+                (u64)apu->enabled << 40 | (u64)apu->frame_irq << 48 |
+                (u64)apu->dmc_irq << 49;
+  u64 frame = (u64)(u32)apu->frame_cycle | (u64)apu->frame_step << 32 |
+              (u64)apu->five_step << 40 | (u64)apu->irq_inhibit << 48;
+  u64 dmc = d->address | (u64)d->remaining << 16 |
+            (u64)d->sample_address << 32 | (u64)d->sample_length << 48;
+  u64 output = d->countdown | (u64)d->bits << 32 |
+               (u64)d->buffer_full << 40 | (u64)d->silence << 41 |
+               (u64)d->irq_enabled << 42 | (u64)d->loop << 43 |
+               (u64)d->rate << 48;
+
+  u64 h = mix64(lengths);
+  h = mix64(h ^ frame);
+  h = mix64(h ^ dmc);
+  return mix64(h ^ output);
+}
+
+// fold the registers, the controllers and the apu in with the ram.
+static u64 finish_hash(u64 ram_hash, const CPUState *cpu,
+                       const InputState *input, const ApuState *apu) {
+  u64 regs = cpu->pc | (u64)cpu->sp << 16 | (u64)cpu->a << 24 |
+             (u64)cpu->x << 32 | (u64)cpu->y << 40 | (u64)cpu->status << 48 |
+             (u64)cpu->shutting_down << 56;
+  u64 pads = input->buttons[0] | input->buttons[1] << 8 |
+             input->shift[0] << 16 | (u64)input->shift[1] << 24 |
+             (u64)input->strobe << 32;
+
+  u64 h = mix64(ram_hash ^ regs);
+  h = mix64(h ^ cpu->cycles);
+  h = mix64(h ^ pads);
+  return mix64(h ^ hash_apu(apu));
+}
+
+u64 hash_state(const SaveState *snapshot) {
+  u64 ram_hash = 0;
+  for (int page = 0; page < PAGE_COUNT; page++)
+    ram_hash ^= hash_page(snapshot->ram + page * PAGE_SIZE, page);
+  return finish_hash(ram_hash, &snapshot->cpu, &snapshot->input,
+                     &snapshot->apu);
+}
+
+u64 hash_machine(EmuState *state) {
+  for (int w = 0; w < DIRTY_WORDS; w++) {
+    u64 bits = state->unhashed[w];
+    while (bits) {
+      int page = w * 64 + __builtin_ctzll(bits);
+      u64 hash = hash_page(state->pages[page]->data, page);
+      state->ram_hash ^= state->page_hashes[page] ^ hash;
+      state->page_hashes[page] = hash;
+      bits &= bits - 1;
+    }
+    state->unhashed[w] = 0;
+  }
+
+  return finish_hash(state->ram_hash, state->cpu_state, &state->input,
+                     &state->apu);
+}
@@ -0,0 +1,71 @@
+#pragma once
+
+#include "cpu.h"
+#include "defines.h"
+
+// save-states. a snapshot is a single flat struct, so saving and restoring
+// are a couple of memcpys and never touch the heap. the caller owns the
+// SaveState memory, keep one around and reuse it.
+
+#define save_state_magic 0x5453454E // "NEST", little endian.
+// bump this whenever the layout of SaveState (or anything it embeds, like
+// CPUState) changes. old blobs are rejected, not migrated.
+#define save_state_version 5
+
+typedef struct SaveState {
+  u32 magic;
+  u32 version;
+
+  CPUState cpu;
+  InputState input;
+  ApuState apu;
+  u8 ram[RAM_SIZE]; // the whole address space, the mapped prg-rom too.
+  // there's no ppu and no mapper in the core, so there's nothing of theirs
+  // to keep. the rom image and its header fields aren't kept either, so a
+  // snapshot goes into a machine that loaded the same rom.
+} SaveState;
+
+// a delta against a base SaveState. only the pages written since the base
+// are stored, packed at the front of data in ascending page order. the
+// struct is sized for the worst case so it can live on the stack or in a
+// preallocated slot, but only delta_state_size() bytes of it are meaningful,
+// and that's all anyone storing these needs to copy.
+typedef struct DeltaState {
+  u32 magic;
+  u32 version;
+
+  CPUState cpu;
+  InputState input;
+  ApuState apu;
+
+  u64 pages[DIRTY_WORDS]; // which pages are in data.
+  u32 page_count;
+  u8 data[PAGE_COUNT][PAGE_SIZE];
+} DeltaState;
+
+// 1 on success, 0 on failure.
+// both of these make the snapshot the new base: the dirty bitmap is cleared.
+u8 save_state(EmuState *state, SaveState *out);
+u8 load_state(EmuState *state, const SaveState *in);
+
+// store everything that changed since the base. doesn't touch the dirty
+// bitmap, so several deltas can be taken against the same base.
+u8 save_delta(EmuState *state, DeltaState *out);
+// restore base + delta. base must be the snapshot the emulator's current
+// dirty bitmap is relative to (the last one saved or loaded), which is what
+// makes this O(dirty pages) instead of a full copy. afterwards, the dirty
+// bitmap is the delta's, so the base stays valid.
+u8 load_delta(EmuState *state, const SaveState *base, const DeltaState *in);
+
+// how many bytes of the DeltaState are actually used.
+u32 delta_state_size(const DeltaState *delta);
+
+// a 64 bit hash of a snapshot, for comparing machines without shipping the
+// whole thing around. equal snapshots always hash equal. the apu goes in as
+// far as the guest can read it back, so sound or no sound hashes the same.
+u64 hash_state(const SaveState *snapshot);
+// the same hash, straight off a live machine. each page's hash is kept, and
+// only the pages written since the last call are hashed again, so calling
+// it every frame costs about as much as the frame wrote. doesn't touch the
+// dirty bitmap, unlike hashing through save_state.
+u64 hash_machine(EmuState *state);
@@ -0,0 +1,192 @@
+// the environment server's protocol, end to end. forks a server on a tiny
+// rom, then plays the client: connects over the seqpacket socket, takes the
+// hello and its memfd, maps the shared region and steps twice. the server's
+// stdout comes back over a pipe, which is also how we know it's listening.
+//
+//   nes_env
+//
+// the rom reads the a button into $10 and counts frames into $75 (once, then
+// it spins), so with reward:0x75 and done:0x75=1 every step is worth 1 and
+// ends the episode, and the second step only works if the env was reset.
+
+#define _GNU_SOURCE
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "../cpu.h"
+#include "../envserver.h"
+
+#define ENVS 2
+#define ROM_SIZE (0x10 + 0x4000)
+
+static const u8 program[] = {
+    0xA9, 0x01, 0x8D, 0x16, 0x40, // strobe the pads.
+    0xA9, 0x00, 0x8D, 0x16, 0x40,
+    0xAD, 0x16, 0x40, 0x29, 0x01, // the a button,
+    0x85, 0x10,                   // into $10.
+    0xE6, 0x75,                   // $75 counts up once,
+    0x4C, 0x13, 0x80,             // and that's it.
+};
+
+#define TIMEOUT 10 // seconds, for a server that's stuck or never says so.
+
+static pid_t server_pid = 0;
+static char path[64]; // the socket's.
+
+static void fail(const char *message) {
+  printf("FAILED: %s\n", message);
+  if (server_pid > 0)
+    kill(server_pid, SIGTERM);
+  unlink(path);
+  exit(1);
+}
+
+static void timed_out(int signal) {
+  (void)signal;
+  fail("timed out waiting on the server");
+}
+
+// a line of the server's output, 0 if it's gone.
+static u8 server_line(FILE *server, const char *expected) {
+  char line[256];
+  if (fgets(line, sizeof(line), server) == NULL)
+    return 0;
+  printf("server: %s", line);
+  return strncmp(line, expected, strlen(expected)) == 0;
+}
+
+// the hello, and the memfd that comes with it.
+static int receive_hello(int client) {
+  EnvMessage hello;
+  struct iovec iov = {&hello, sizeof(hello)};
+  char control[CMSG_SPACE(sizeof(int))];
+  struct msghdr message = {0};
+  message.msg_iov = &iov;
+  message.msg_iovlen = 1;
+  message.msg_control = control;
+  message.msg_controllen = sizeof(control);
+
+  if (recvmsg(client, &message, 0) != sizeof(hello) ||
+      hello.type != EnvHello)
+    return -1;
+  struct cmsghdr *cmsg = CMSG_FIRSTHDR(&message);
+  if (cmsg == NULL || cmsg->cmsg_type != SCM_RIGHTS)
+    return -1;
+  int memfd;
+  memcpy(&memfd, CMSG_DATA(cmsg), sizeof(int));
+  return memfd;
+}
+
+static void step(int client, u64 expected_step) {
+  EnvMessage message = {EnvStep, 1, 0}, reply;
+  if (send(client, &message, sizeof(message), 0) != sizeof(message) ||
+      recv(client, &reply, sizeof(reply), 0) != sizeof(reply))
+    fail("the step didn't go through");
+  if (reply.type != EnvStepped || reply.frames != 1 ||
+      reply.step != expected_step)
+    fail("the reply to the step is wrong");
+}
+
+static void check_envs(const u8 *base, const EnvShared *shared) {
+  const u8 *actions = base + shared->actions_offset;
+  const float *rewards = (const float *)(base + shared->rewards_offset);
+  const u8 *dones = base + shared->dones_offset;
+  const u32 *frames = (const u32 *)(base + shared->frames_offset);
+  for (int i = 0; i < ENVS; i++) {
+    const u8 *observation = base + shared->observations_offset +
+                            i * shared->observation_size;
+    if (rewards[i] != 1 || dones[i] != 1 || frames[i] != 1)
+      fail("an env's reward, done or frame count is wrong");
+    if (observation[0x75] != 1 || observation[0x10] != (actions[i] & 1))
+      fail("an env's observation is wrong");
+  }
+}
+
+int main() {
+  u8 *rom = (u8 *)calloc(1, ROM_SIZE);
+  memcpy(rom, "NES\x1a", 4);
+  rom[4] = 1;
+  memcpy(rom + 0x10, program, sizeof(program));
+  EmuState *start = make_emu_state();
+  if (!load_rom(start, rom, ROM_SIZE))
+    fail("the rom didn't load");
+
+  EnvPredicate predicates[2];
+  env_parse_predicate("reward:0x75", &predicates[0]);
+  env_parse_predicate("done:0x75=1", &predicates[1]);
+
+  snprintf(path, sizeof(path), "/tmp/nes_env_%d.sock", (int)getpid());
+  int output[2];
+  if (pipe(output) != 0)
+    fail("no pipe for the server's output");
+
+  server_pid = fork();
+  if (server_pid == 0) {
+    dup2(output[1], STDOUT_FILENO);
+    close(output[0]);
+    close(output[1]);
+    env_serve(start, path, ENVS, predicates, 2);
+    _exit(1); // only if it couldn't start.
+  }
+  close(output[1]);
+  FILE *server = fdopen(output[0], "r");
+  signal(SIGALRM, timed_out);
+  alarm(TIMEOUT);
+
+  // it's listening once it says so, and that has to get through the pipe.
+  if (!server_line(server, "Serving"))
+    fail("the server never said it was serving");
+
+  struct sockaddr_un address = {0};
+  address.sun_family = AF_UNIX;
+  strcpy(address.sun_path, path);
+  int client = socket(AF_UNIX, SOCK_SEQPACKET, 0);
+  if (connect(client, (struct sockaddr *)&address, sizeof(address)) != 0)
+    fail("couldn't connect");
+  if (!server_line(server, "Client connected."))
+    fail("the server never said the client connected");
+
+  int memfd = receive_hello(client);
+  if (memfd < 0)
+    fail("no hello, or no memfd with it");
+  EnvShared header;
+  if (pread(memfd, &header, sizeof(header), 0) != sizeof(header) ||
+      header.magic != env_magic || header.version != env_version ||
+      header.envs != ENVS || header.observation_size != ENV_OBSERVATION_SIZE)
+    fail("the shared region's header is wrong");
+  u8 *base = (u8 *)mmap(NULL, header.size, PROT_READ | PROT_WRITE,
+                        MAP_SHARED, memfd, 0);
+  if (base == MAP_FAILED)
+    fail("couldn't map the shared region");
+
+  // a held on one env and not the other, then the same the other way, so
+  // the second step has to have reset the envs to read it again.
+  u8 *actions = base + header.actions_offset;
+  actions[0] = 0x01;
+  actions[1] = 0x00;
+  step(client, 1);
+  check_envs(base, &header);
+  actions[0] = 0x00;
+  actions[1] = 0x01;
+  step(client, 2);
+  check_envs(base, &header);
+
+  close(client);
+  if (!server_line(server, "Client gone after 2 steps"))
+    fail("the server didn't see the client go");
+
+  kill(server_pid, SIGTERM);
+  waitpid(server_pid, NULL, 0);
+  unlink(path);
+  printf("The env server's protocol works: hello, memfd, 2 steps on %d "
+         "envs.\n",
+         ENVS);
+  return 0;
+}
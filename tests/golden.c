@@ -0,0 +1,268 @@
+// the golden log harness. runs a cpu validation rom (nestest, mostly) headless
+// from a fixed pc, and checks every instruction against a known good log
+// before it runs: pc, registers, flags and the cycle count. the log is
+// streamed a line at a time, so its size doesn't matter, and the first
+// divergence stops everything with the last few instructions on both sides.
+//
+//   nes_golden [--pc C000] [--cycles 7] [--status 24] nestest.nes nestest.log
+//
+// the defaults are nestest's automated mode.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "../cpu.h"
+#include "../trace.h"
+
+#define CONTEXT 8 // instructions of history shown on a divergence.
+#define LINE_MAX 256
+
+typedef struct Golden {
+  u16 pc;
+  u8 a;
+  u8 x;
+  u8 y;
+  u8 status;
+  u8 sp;
+  u8 has_cycles; // old logs only have ppu dots, nothing to compare against.
+  u64 cycles;
+} Golden;
+
+// the history ring, both sides kept in step.
+typedef struct History {
+  char golden[CONTEXT][LINE_MAX];
+  TraceRecord ours[CONTEXT];
+  u64 our_cycles[CONTEXT];
+  u64 count;
+} History;
+
+static double now_seconds() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int hex_digit(char c) {
+  if (c >= '0' && c <= '9')
+    return c - '0';
+  if (c >= 'A' && c <= 'F')
+    return c - 'A' + 10;
+  if (c >= 'a' && c <= 'f')
+    return c - 'a' + 10;
+  return -1;
+}
+
+// exactly digits hex digits at p, -1 if they aren't all there.
+static long parse_hex(const char *p, int digits) {
+  long value = 0;
+  for (int i = 0; i < digits; i++) {
+    int d = hex_digit(p[i]);
+    if (d < 0)
+      return -1;
+    value = (value << 4) | d;
+  }
+  return value;
+}
+
+// pull the fields out of one log line. the register block is fixed width
+// ("A:00 X:00 Y:00 P:24 SP:FD"), so once we've found it it's all offsets.
+static u8 parse_line(const char *line, Golden *g) {
+  long pc = parse_hex(line, 4);
+  const char *regs = strstr(line, "A:");
+  if (pc < 0 || regs == NULL || strncmp(regs + 20, "SP:", 3) != 0)
+    return 0;
+
+  long a = parse_hex(regs + 2, 2);
+  long x = parse_hex(regs + 7, 2);
+  long y = parse_hex(regs + 12, 2);
+  long p = parse_hex(regs + 17, 2);
+  long sp = parse_hex(regs + 23, 2);
+  if ((a | x | y | p | sp) < 0)
+    return 0;
+
+  g->pc = pc;
+  g->a = a;
+  g->x = x;
+  g->y = y;
+  g->status = p;
+  g->sp = sp;
+
+  // newer logs end with the cpu cycle, older ones put ppu dots in CYC: and
+  // follow it with SL:, which we can't check.
+  const char *cyc = strstr(regs, "CYC:");
+  g->has_cycles = cyc != NULL && strstr(cyc, "SL:") == NULL;
+  if (g->has_cycles)
+    g->cycles = strtoull(cyc + 4, NULL, 10);
+  return 1;
+}
+
+static u8 matches(const Golden *g, const CPUState *cs) {
+  return g->pc == cs->pc && g->a == cs->a && g->x == cs->x && g->y == cs->y &&
+         g->status == cs->status && g->sp == cs->sp &&
+         (!g->has_cycles || g->cycles == cs->cycles);
+}
+
+static void print_field(const char *name, long expected, long got, int width) {
+  printf("  %-3s expected %0*lX, got %0*lX%s\n", name, width, expected, width,
+         got, expected == got ? "" : "   <--");
+}
+
+static void report(const History *h, u64 line_number, const Golden *g,
+                   const CPUState *cs) {
+  printf("Diverged at line %llu.\n\n", (unsigned long long)line_number);
+
+  // the history includes the line that diverged, so it's the last one shown.
+  u64 first = h->count > CONTEXT ? h->count - CONTEXT : 0;
+  printf("golden:\n");
+  for (u64 i = first; i < h->count; i++)
+    printf("  %s\n", h->golden[i % CONTEXT]);
+
+  printf("ours:\n");
+  for (u64 i = first; i < h->count; i++) {
+    char text[128];
+    trace_format(text, sizeof(text), &h->ours[i % CONTEXT],
+                 h->our_cycles[i % CONTEXT]);
+    printf("  %s\n", text);
+  }
+
+  printf("\n");
+  print_field("PC", g->pc, cs->pc, 4);
+  print_field("A", g->a, cs->a, 2);
+  print_field("X", g->x, cs->x, 2);
+  print_field("Y", g->y, cs->y, 2);
+  print_field("P", g->status, cs->status, 2);
+  print_field("SP", g->sp, cs->sp, 2);
+  if (g->has_cycles)
+    printf("  CYC expected %llu, got %llu%s\n", (unsigned long long)g->cycles,
+           (unsigned long long)cs->cycles,
+           g->cycles == cs->cycles ? "" : "   <--");
+}
+
+static u8 *read_file(const char *path, u32 *size) {
+  FILE *file = fopen(path, "rb");
+  if (file == NULL)
+    return NULL;
+
+  fseek(file, 0, SEEK_END);
+  long length = ftell(file);
+  rewind(file);
+
+  u8 *data = (u8 *)malloc(length);
+  if (fread(data, 1, length, file) != (size_t)length) {
+    free(data);
+    data = NULL;
+  }
+  fclose(file);
+
+  *size = length;
+  return data;
+}
+
+static void usage(const char *name) {
+  printf("Usage: %s [--pc hex] [--cycles n] [--status hex] rom log\n", name);
+}
+
+int main(int argc, char *argv[]) {
+  u16 start_pc = 0xC000;
+  u64 start_cycles = 7; // the reset sequence.
+  u8 start_status = 0x24;
+
+  int first = 1;
+  for (; first + 1 < argc && strncmp(argv[first], "--", 2) == 0; first += 2) {
+    if (strcmp(argv[first], "--pc") == 0) {
+      start_pc = strtoul(argv[first + 1], NULL, 16);
+    } else if (strcmp(argv[first], "--cycles") == 0) {
+      start_cycles = strtoull(argv[first + 1], NULL, 10);
+    } else if (strcmp(argv[first], "--status") == 0) {
+      start_status = strtoul(argv[first + 1], NULL, 16);
+    } else {
+      usage(argv[0]);
+      return 2;
+    }
+  }
+  if (argc - first != 2) {
+    usage(argv[0]);
+    return 2;
+  }
+
+  u32 rom_size;
+  u8 *rom = read_file(argv[first], &rom_size);
+  if (rom == NULL) {
+    printf("Could not read %s.\n", argv[first]);
+    return 2;
+  }
+
+  FILE *log = fopen(argv[first + 1], "r");
+  if (log == NULL) {
+    printf("Could not open the golden log %s.\n", argv[first + 1]);
+    free(rom);
+    return 2;
+  }
+  // a big buffer, so the stream costs next to nothing per line.
+  setvbuf(log, NULL, _IOFBF, 1 << 20);
+
+  EmuState *state = make_emu_state();
+  if (!load_rom(state, rom, rom_size)) {
+    clean_emu_state(state);
+    free(rom);
+    fclose(log);
+    return 2;
+  }
+
+  CPUState *cs = state->cpu_state;
+  cs->pc = start_pc;
+  cs->cycles = start_cycles;
+  cs->status = start_status;
+
+  History *h = (History *)calloc(1, sizeof(History));
+  u64 line_number = 0;
+  int result = 0;
+  char *line;
+
+  double start = now_seconds();
+  while ((line = fgets(h->golden[h->count % CONTEXT], LINE_MAX, log))) {
+    line_number++;
+    line[strcspn(line, "\r\n")] = '\0';
+
+    Golden g = {0};
+    if (!parse_line(line, &g)) {
+      printf("Could not parse line %llu: %s\n",
+             (unsigned long long)line_number, line);
+      result = 2;
+      break;
+    }
+
+    u64 slot = h->count++ % CONTEXT;
+    trace_fill(&h->ours[slot], state, peek(state, cs->pc));
+    h->our_cycles[slot] = cs->cycles;
+
+    if (!matches(&g, cs)) {
+      report(h, line_number, &g, cs);
+      result = 1;
+      break;
+    }
+
+    if (cs->shutting_down) {
+      printf("The cpu shut down at line %llu, but the log goes on.\n",
+             (unsigned long long)line_number);
+      result = 1;
+      break;
+    }
+
+    handle_instruction(state);
+  }
+  double elapsed = now_seconds() - start;
+
+  if (result == 0)
+    printf("Matched all %llu lines.\n", (unsigned long long)line_number);
+  printf("%.2f Minstr/s over %.3f s.\n",
+         elapsed > 0 ? h->count / elapsed / 1e6 : 0, elapsed);
+
+  free(h);
+  clean_emu_state(state);
+  free(rom);
+  fclose(log);
+  return result;
+}
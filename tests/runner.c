@@ -0,0 +1,272 @@
+// the conformance runner. loads every test rom up front, then runs them
+// headless across a pool of threads, one machine per test. results come back
+// through the $6000 status protocol that most 6502/nes test roms speak:
+//
+//   $6000       status. $80 while running, $81 wants a reset (we can't do
+//               those, so it runs out its budget), anything below $80 is the
+//               final result code (0 is a pass).
+//   $6001-$6003 the signature $DE $B0 $61, so we know $6000 means something.
+//   $6004-      a nul terminated message.
+//
+// our own older roms don't speak it, they just BRK when they're done. a BRK
+// without the signature counts as a pass. anything still going when its
+// cycle budget runs out is a timeout.
+//
+// every test also checks the save-state deltas on the way. a snapshot is
+// taken at power on, and at the end whatever the test wrote goes through
+// save_delta into a second machine restored from that snapshot. the two have
+// to hash the same, or a page was missed by the dirty bitmap or the delta.
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "../cpu.h"
+#include "../state.h"
+
+#define STATUS_ADDR 0x6000
+#define MESSAGE_ADDR 0x6004
+#define MESSAGE_MAX 256
+
+#define STATUS_RUNNING 0x80
+
+typedef enum Verdict {
+  Pass,
+  Fail,
+  Timeout,
+  BadRom,
+} Verdict;
+
+static const char *verdict_names[] = {"PASS", "FAIL", "TIMEOUT", "BADROM"};
+
+typedef struct Test {
+  const char *path;
+  u8 *image;
+  u32 size;
+
+  Verdict verdict;
+  u8 code;
+  char message[MESSAGE_MAX];
+  u64 cycles;
+  double seconds;
+} Test;
+
+typedef struct Runner {
+  Test *tests;
+  int count;
+  u64 budget;
+
+  pthread_mutex_t lock;
+  int next; // the next test nobody has picked up yet.
+} Runner;
+
+static double now_seconds() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static u8 *read_file(const char *path, u32 *size) {
+  FILE *file = fopen(path, "rb");
+  if (file == NULL)
+    return NULL;
+
+  fseek(file, 0, SEEK_END);
+  long length = ftell(file);
+  rewind(file);
+
+  u8 *data = (u8 *)malloc(length);
+  if (fread(data, 1, length, file) != (size_t)length) {
+    free(data);
+    data = NULL;
+  }
+  fclose(file);
+
+  *size = length;
+  return data;
+}
+
+static u8 has_signature(const EmuState *state) {
+  return peek(state, STATUS_ADDR + 1) == 0xDE &&
+         peek(state, STATUS_ADDR + 2) == 0xB0 &&
+         peek(state, STATUS_ADDR + 3) == 0x61;
+}
+
+static void copy_message(Test *test, const EmuState *state) {
+  int i = 0;
+  for (; i < MESSAGE_MAX - 1 && peek(state, MESSAGE_ADDR + i); i++)
+    test->message[i] = peek(state, MESSAGE_ADDR + i);
+  test->message[i] = '\0';
+}
+
+// base + the delta of everything since, on a fresh machine, against the
+// machine itself. 1 if they agree.
+static u8 delta_round_trip(EmuState *state, const Test *test,
+                           const SaveState *base) {
+  DeltaState *delta = (DeltaState *)malloc(sizeof(DeltaState));
+  EmuState *copy = make_emu_state();
+  load_rom(copy, test->image, test->size);
+
+  u8 ok = save_delta(state, delta) && load_state(copy, base) &&
+          load_delta(copy, base, delta);
+  ok = ok && hash_machine(copy) == hash_machine(state);
+
+  clean_emu_state(copy);
+  free(delta);
+  return ok;
+}
+
+static void run_test(Test *test, u64 budget) {
+  double start = now_seconds();
+
+  EmuState *state = make_emu_state();
+  SaveState *base = (SaveState *)malloc(sizeof(SaveState));
+  if (!load_rom(state, test->image, test->size)) {
+    test->verdict = BadRom;
+  } else {
+    CPUState *cs = state->cpu_state;
+    test->verdict = Timeout;
+    save_state(state, base);
+
+    while (cs->cycles < budget) {
+      cpu_run_frame(state);
+
+      u8 status = peek(state, STATUS_ADDR);
+      if (has_signature(state) && status < STATUS_RUNNING) {
+        test->verdict = status == 0 ? Pass : Fail;
+        test->code = status;
+        break;
+      }
+
+      if (cs->shutting_down) {
+        // a BRK that never said it was running is one of ours, and a pass.
+        if (has_signature(state) && status >= STATUS_RUNNING) {
+          test->verdict = Fail;
+          test->code = status;
+        } else {
+          test->verdict = Pass;
+        }
+        break;
+      }
+    }
+
+    if (has_signature(state))
+      copy_message(test, state);
+    if (!delta_round_trip(state, test, base)) {
+      test->verdict = Fail;
+      snprintf(test->message, MESSAGE_MAX, "the delta round trip differs");
+    }
+    test->cycles = cs->cycles;
+  }
+
+  free(base);
+  clean_emu_state(state);
+  test->seconds = now_seconds() - start;
+}
+
+static void *worker(void *arg) {
+  Runner *runner = (Runner *)arg;
+
+  for (;;) {
+    pthread_mutex_lock(&runner->lock);
+    int index = runner->next++;
+    pthread_mutex_unlock(&runner->lock);
+
+    if (index >= runner->count)
+      return NULL;
+    run_test(&runner->tests[index], runner->budget);
+  }
+}
+
+static void usage(const char *name) {
+  printf("Usage: %s [--jobs n] [--budget cycles] rom...\n", name);
+}
+
+int main(int argc, char *argv[]) {
+  int jobs = sysconf(_SC_NPROCESSORS_ONLN);
+  // about half a minute of nes time.
+  u64 budget = 50000000;
+
+  int first = 1;
+  for (; first < argc && strncmp(argv[first], "--", 2) == 0; first += 2) {
+    if (first + 1 >= argc) {
+      usage(argv[0]);
+      return 2;
+    }
+    if (strcmp(argv[first], "--jobs") == 0) {
+      jobs = atoi(argv[first + 1]);
+    } else if (strcmp(argv[first], "--budget") == 0) {
+      budget = strtoull(argv[first + 1], NULL, 0);
+    } else {
+      usage(argv[0]);
+      return 2;
+    }
+  }
+
+  Runner runner = {0};
+  runner.count = argc - first;
+  runner.budget = budget;
+  if (runner.count <= 0) {
+    usage(argv[0]);
+    return 2;
+  }
+  if (jobs < 1)
+    jobs = 1;
+  if (jobs > runner.count)
+    jobs = runner.count;
+
+  // load everything before any thread starts, so the timings are just the
+  // emulation.
+  runner.tests = (Test *)calloc(runner.count, sizeof(Test));
+  for (int i = 0; i < runner.count; i++) {
+    Test *test = &runner.tests[i];
+    test->path = argv[first + i];
+    test->image = read_file(test->path, &test->size);
+    if (test->image == NULL) {
+      printf("Could not read %s.\n", test->path);
+      return 2;
+    }
+  }
+
+  pthread_mutex_init(&runner.lock, NULL);
+  pthread_t *threads = (pthread_t *)calloc(jobs, sizeof(pthread_t));
+
+  double start = now_seconds();
+  for (int i = 0; i < jobs; i++)
+    pthread_create(&threads[i], NULL, worker, &runner);
+  for (int i = 0; i < jobs; i++)
+    pthread_join(threads[i], NULL);
+  double elapsed = now_seconds() - start;
+
+  int counts[4] = {0};
+  double serial = 0;
+  for (int i = 0; i < runner.count; i++) {
+    Test *test = &runner.tests[i];
+    counts[test->verdict]++;
+    serial += test->seconds;
+
+    printf("%-8s %-32s %8.2f ms %12llu cycles", verdict_names[test->verdict],
+           test->path, test->seconds * 1e3, (unsigned long long)test->cycles);
+    if (test->verdict == Fail)
+      printf("  code $%02X", test->code);
+    if (test->message[0])
+      printf("  \"%s\"", test->message);
+    printf("\n");
+  }
+
+  printf("\n%d passed, %d failed, %d timed out, %d bad roms.\n", counts[Pass],
+         counts[Fail], counts[Timeout], counts[BadRom]);
+  printf("%.2f s wall on %d threads, %.2f s of test time.\n", elapsed, jobs,
+         serial);
+
+  for (int i = 0; i < runner.count; i++)
+    free(runner.tests[i].image);
+  free(runner.tests);
+  free(threads);
+  pthread_mutex_destroy(&runner.lock);
+
+  return counts[Pass] == runner.count ? 0 : 1;
+}
@@ -0,0 +1,228 @@
+#include "trace.h"
+
+#include <ctype.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+TraceState *trace_state = NULL;
+
+TraceState *make_trace_state() {
+  TraceState *ts = (TraceState *)malloc(sizeof(TraceState));
+  ts->ring = (TraceRecord *)malloc(TRACE_RING_SIZE * sizeof(TraceRecord));
+  atomic_init(&ts->head, 0);
+  atomic_init(&ts->tail, 0);
+  atomic_init(&ts->running, 0);
+  ts->suspended = 0;
+  ts->file = NULL;
+  return ts;
+}
+
+void clean_trace_state(TraceState *ts) {
+  free(ts->ring);
+  free(ts);
+}
+
+// write out everything between tail and head. 1 if there was anything.
+static u8 drain(TraceState *ts) {
+  u32 tail = atomic_load_explicit(&ts->tail, memory_order_relaxed);
+  u32 head = atomic_load_explicit(&ts->head, memory_order_acquire);
+  if (head == tail)
+    return 0;
+
+  while (tail != head) { // at most two contiguous runs, either side of the end.
+    u32 start = tail & (TRACE_RING_SIZE - 1);
+    u32 count = head - tail;
+    if (start + count > TRACE_RING_SIZE)
+      count = TRACE_RING_SIZE - start;
+
+    fwrite(&ts->ring[start], sizeof(TraceRecord), count, ts->file);
+    tail += count;
+    atomic_store_explicit(&ts->tail, tail, memory_order_release);
+  }
+
+  return 1;
+}
+
+static void *drain_thread(void *arg) {
+  TraceState *ts = (TraceState *)arg;
+  struct timespec nap = {0, 1000000}; // 1ms
+
+  while (atomic_load_explicit(&ts->running, memory_order_acquire)) {
+    if (!drain(ts))
+      nanosleep(&nap, NULL);
+  }
+
+  drain(ts); // whatever came in after we were told to stop.
+  return NULL;
+}
+
+u8 trace_init(const char *path) {
+  TraceState *ts = make_trace_state();
+
+  ts->file = fopen(path, "wb");
+  if (ts->file == NULL) {
+    printf("Failed to open %s for the trace.\n", path);
+    clean_trace_state(ts);
+    return 0;
+  }
+
+  atomic_store(&ts->running, 1);
+  if (pthread_create(&ts->thread, NULL, drain_thread, ts) != 0) {
+    printf("Failed to start the trace thread.\n");
+    fclose(ts->file);
+    clean_trace_state(ts);
+    return 0;
+  }
+
+  trace_state = ts;
+  return 1;
+}
+
+void trace_clean() {
+  TraceState *ts = trace_state;
+  if (ts == NULL)
+    return;
+
+  atomic_store(&ts->running, 0);
+  pthread_join(ts->thread, NULL);
+  fclose(ts->file);
+
+  trace_state = NULL;
+  clean_trace_state(ts);
+}
+
+void trace_suspend(u8 suspended) {
+  if (trace_state != NULL)
+    trace_state->suspended = suspended;
+}
+
+/// THE CONVERTER
+static int operand_count(AddrMode mode) {
+  switch (mode) {
+  case None:
+  case Accumulator:
+    return 0;
+  case Abs:
+  case AbsX:
+  case AbsY:
+  case Indirect:
+    return 2;
+  default:
+    return 1;
+  }
+}
+
+// the operand, the way nestest writes it.
+static void format_operand(char *out, size_t size, const TraceRecord *r,
+                           AddrMode mode) {
+  u8 lo = r->operands[0];
+  u16 word = lo | (r->operands[1] << 8);
+
+  switch (mode) {
+  case Immediate:
+    snprintf(out, size, "#$%02X", lo);
+    break;
+  case ZP:
+    snprintf(out, size, "$%02X", lo);
+    break;
+  case ZPX:
+    snprintf(out, size, "$%02X,X", lo);
+    break;
+  case ZPY:
+    snprintf(out, size, "$%02X,Y", lo);
+    break;
+  case Abs:
+    snprintf(out, size, "$%04X", word);
+    break;
+  case AbsX:
+    snprintf(out, size, "$%04X,X", word);
+    break;
+  case AbsY:
+    snprintf(out, size, "$%04X,Y", word);
+    break;
+  case Relative:
+    snprintf(out, size, "$%04X", (u16)(r->pc + 2 + (signed char)lo));
+    break;
+  case IndexedIndirect:
+    snprintf(out, size, "($%02X,X)", lo);
+    break;
+  case IndirectIndexed:
+    snprintf(out, size, "($%02X),Y", lo);
+    break;
+  case Indirect:
+    snprintf(out, size, "($%04X)", word);
+    break;
+  case Accumulator:
+    snprintf(out, size, "A");
+    break;
+  default:
+    out[0] = '\0';
+    break;
+  }
+}
+
+void trace_format(char *out, size_t size, const TraceRecord *r, u64 cycle) {
+  const Instruction *inst = &instruction_table[r->opcode];
+
+  char bytes[16];
+  int operands = inst->name ? operand_count(inst->mode) : 0;
+  if (operands == 0)
+    snprintf(bytes, sizeof(bytes), "%02X", r->opcode);
+  else if (operands == 1)
+    snprintf(bytes, sizeof(bytes), "%02X %02X", r->opcode, r->operands[0]);
+  else
+    snprintf(bytes, sizeof(bytes), "%02X %02X %02X", r->opcode, r->operands[0],
+             r->operands[1]);
+
+  char name[4] = "???";
+  if (inst->name)
+    for (int c = 0; c < 3; c++)
+      name[c] = toupper(inst->name[c]);
+
+  char operand[16] = "";
+  if (inst->name)
+    format_operand(operand, sizeof(operand), r, inst->mode);
+
+  snprintf(out, size,
+           "%04X  %-8s  %s %-27s A:%02X X:%02X Y:%02X P:%02X SP:%02X "
+           "CYC:%llu",
+           r->pc, bytes, name, operand, r->a, r->x, r->y, r->status, r->sp,
+           (unsigned long long)cycle);
+}
+
+u8 trace_to_text(const char *in_path, const char *out_path) {
+  FILE *in = fopen(in_path, "rb");
+  if (in == NULL) {
+    printf("Failed to open the trace %s.\n", in_path);
+    return 0;
+  }
+
+  FILE *out = fopen(out_path, "w");
+  if (out == NULL) {
+    printf("Failed to open %s for the text trace.\n", out_path);
+    fclose(in);
+    return 0;
+  }
+
+  TraceRecord *chunk = (TraceRecord *)malloc(4096 * sizeof(TraceRecord));
+  size_t count;
+
+  while ((count = fread(chunk, sizeof(TraceRecord), 4096, in)) > 0) {
+    for (size_t i = 0; i < count; i++) {
+      const TraceRecord *r = &chunk[i];
+      u64 cycle = (u64)r->cycle_high << 32 | r->cycle;
+
+      char line[128];
+      trace_format(line, sizeof(line), r, cycle);
+      fprintf(out, "%s\n", line);
+    }
+  }
+
+  free(chunk);
+  fclose(in);
+  fclose(out);
+  return 1;
+}
@@ -0,0 +1,100 @@
+#pragma once
+
+#include "cpu.h"
+#include "defines.h"
+
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+
+// the instruction trace. with is_trace on, every instruction drops a 16 byte
+// record into a lock-free single producer, single consumer ring, and a
+// background thread drains the ring into a binary file. with it off, the
+// TRACE hook is an empty macro and none of this is in the hot path at all.
+// trace_to_text turns the binary file into a nestest-style log.
+
+#define TRACE_RING_SIZE (1 << 16) // in records, keep it a power of two.
+
+typedef struct TraceRecord { // the machine just before the instruction runs.
+  u32 cycle;      // low 32 bits.
+  u16 cycle_high; // the next 16, the clock can go backwards (a load_state).
+  u16 pc;
+  u8 opcode;
+  u8 operands[2]; // the bytes after the opcode, used or not.
+  u8 a;
+  u8 x;
+  u8 y;
+  u8 status;
+  u8 sp;
+} TraceRecord;
+
+_Static_assert(sizeof(TraceRecord) == 16, "trace records are 16 bytes");
+
+typedef struct TraceState {
+  TraceRecord *ring;
+  // free running indices, masked into the ring. the emulator only ever
+  // writes head and the drain thread only ever writes tail.
+  _Atomic u32 head;
+  _Atomic u32 tail;
+  _Atomic u8 running;
+  u8 suspended; // the emulator's own, see trace_suspend.
+
+  FILE *file;
+  pthread_t thread;
+} TraceState;
+
+// NULL until trace_init.
+extern TraceState *trace_state;
+
+// start the drain thread, writing into path. 1 on success. there's one
+// producer, so only start it when one thread runs the machines: main leaves
+// it off for --search and --serve.
+u8 trace_init(const char *path);
+// drains whatever's left and stops the thread.
+void trace_clean();
+// while suspended nothing is recorded. for frames that run but aren't part
+// of the timeline, run-ahead's look ahead.
+void trace_suspend(u8 suspended);
+
+// one record as a nestest-style line, no newline. cycle is the full count.
+void trace_format(char *out, size_t size, const TraceRecord *r, u64 cycle);
+// binary trace in, nestest-style text out. 1 on success.
+u8 trace_to_text(const char *in_path, const char *out_path);
+
+// snapshot the machine just before it runs opcode.
+static inline void trace_fill(TraceRecord *r, EmuState *state, u8 opcode) {
+  CPUState *cs = state->cpu_state;
+  r->cycle = (u32)cs->cycles;
+  r->cycle_high = (u16)(cs->cycles >> 32);
+  r->pc = cs->pc;
+  r->opcode = opcode;
+  // straight from ram, going through the bus could set off side effects.
+  r->operands[0] = peek(state, cs->pc + 1);
+  r->operands[1] = peek(state, cs->pc + 2);
+  r->a = cs->a;
+  r->x = cs->x;
+  r->y = cs->y;
+  r->status = cs->status;
+  r->sp = cs->sp;
+}
+
+static inline void trace_record(EmuState *state, u8 opcode) {
+  TraceState *ts = trace_state;
+  if (ts == NULL || ts->suspended)
+    return;
+
+  u32 head = atomic_load_explicit(&ts->head, memory_order_relaxed);
+  // full, the drain thread is behind. wait for it rather than lose records.
+  while (head - atomic_load_explicit(&ts->tail, memory_order_acquire) >=
+         TRACE_RING_SIZE)
+    sched_yield();
+
+  trace_fill(&ts->ring[head & (TRACE_RING_SIZE - 1)], state, opcode);
+  atomic_store_explicit(&ts->head, head + 1, memory_order_release);
+}
+
+#if is_trace
+#define TRACE(state, opcode) trace_record(state, opcode)
+#else
+#define TRACE(state, opcode)
+#endif
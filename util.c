@@ -1,5 +1,7 @@
 #include "util.h"
 
+#include <string.h>
+
 u16 convertToLittleEndian16(u16 value) {
   u16 result = ((value & 0xFF) << 8) | ((value >> 8) & 0xFF);
   return result;
@@ -19,3 +21,22 @@ void mapArraySection(u8 *source, u8 *destination, int sourceStart,
     destination[destinationStart + i] = source[sourceStart + i];
   }
 }
+
+u64 hash_bytes(const void *data, size_t size) {
+  const u8 *bytes = (const u8 *)data;
+  u64 hash = 0xCBF29CE484222325;
+  size_t i = 0;
+
+  for (; i + 8 <= size; i += 8) {
+    u64 word;
+    memcpy(&word, bytes + i, 8);
+    hash ^= word;
+    hash *= 0x100000001B3;
+  }
+  for (; i < size; i++) {
+    hash ^= bytes[i];
+    hash *= 0x100000001B3;
+  }
+
+  return hash;
+}
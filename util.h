@@ -1,6 +1,10 @@
 #include "defines.h"
 
+#include <stddef.h>
+
 u16 convertToLittleEndian16(u16 value);
 u32 convertToLittleEndian(u32 value);
 void mapArraySection(u8 *source, u8 *destination, int sourceStart,
                      int destinationStart, int length);
+// 64 bit fnv-1a, a word at a time. not for anything adversarial.
+u64 hash_bytes(const void *data, size_t size);
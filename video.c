@@ -12,6 +12,7 @@ VideoState *video_state;
 VideoState *make_video_state() {
   VideoState *vs = (VideoState *)malloc(sizeof(VideoState));
   vs->window = NULL;
+  vs->status[0] = '\0';
   return vs;
 }
 
@@ -77,6 +78,9 @@ void video_init() {
 
   // Make the video_state->window's context current
   glfwMakeContextCurrent(video_state->window);
+  // the swap waits for the display's refresh, that's our frame clock. see
+  // pace.h.
+  glfwSwapInterval(1);
 
   // { // setup basic shaders.
   //   const char *vertexShaderSource = "#version 330 core\n"
@@ -114,6 +118,11 @@ void video_init() {
   // }
 }
 
+double video_refresh_rate() {
+  const GLFWvidmode *mode = glfwGetVideoMode(glfwGetPrimaryMonitor());
+  return (mode && mode->refreshRate > 0) ? mode->refreshRate : 0;
+}
+
 void video_update(u8 *is_running) {
   glfwSwapBuffers(video_state->window);
   glfwPollEvents();
@@ -121,9 +130,6 @@ void video_update(u8 *is_running) {
   if (glfwGetKey(video_state->window, GLFW_KEY_ESCAPE) == GLFW_PRESS)
     glfwSetWindowShouldClose(video_state->window, 1);
 
-  // Swap front and back buffers
-  glfwSwapBuffers(video_state->window);
-
   // actual drawing
   {
     glClearColor(0.0f, 0.0f, 0.0f, 1.0f);
@@ -154,12 +160,47 @@ void video_update(u8 *is_running) {
       glVertex2f(0.8f, 0.5f);      // Set pixel position
       glEnd();
     }
+
+    draw_text(video_state->status, 0, 0);
   }
 
-  printf("%d\n", glfwWindowShouldClose(video_state->window));
   *is_running = !glfwWindowShouldClose(video_state->window);
 }
 
+u8 video_key_held(int key) {
+  return glfwGetKey(video_state->window, key) == GLFW_PRESS;
+}
+
+u8 video_read_buttons() {
+  u8 buttons = 0;
+  if (video_key_held(GLFW_KEY_X))
+    buttons |= ButtonA;
+  if (video_key_held(GLFW_KEY_Z))
+    buttons |= ButtonB;
+  if (video_key_held(GLFW_KEY_RIGHT_SHIFT))
+    buttons |= ButtonSelect;
+  if (video_key_held(GLFW_KEY_ENTER))
+    buttons |= ButtonStart;
+  if (video_key_held(GLFW_KEY_UP))
+    buttons |= ButtonUp;
+  if (video_key_held(GLFW_KEY_DOWN))
+    buttons |= ButtonDown;
+  if (video_key_held(GLFW_KEY_LEFT))
+    buttons |= ButtonLeft;
+  if (video_key_held(GLFW_KEY_RIGHT))
+    buttons |= ButtonRight;
+  return buttons;
+}
+
+void video_present(EmuState *state) {
+  // there's no ppu to take a picture from yet, so show where the cpu is.
+  CPUState *cs = state->cpu_state;
+  snprintf(video_state->status, sizeof(video_state->status),
+           "frame %llu pc %04X a %02X x %02X y %02X",
+           (unsigned long long)(cs->cycles / CYCLES_PER_FRAME), cs->pc, cs->a,
+           cs->x, cs->y);
+}
+
 void video_clean() {
   glfwTerminate();
   clean_video_state(video_state);
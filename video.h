@@ -1,5 +1,6 @@
 #pragma once
 
+#include "cpu.h"
 #include "defines.h"
 #include <GL/glew.h>
 #include <GLFW/glfw3.h>
@@ -8,10 +9,21 @@ typedef struct VideoState {
   GLFWwindow *window;
   GLuint textures[128];
   // 128 texture glyphs, 8x8 font?
+
+  char status[64]; // a line about the presented frame, drawn over the top.
 } VideoState;
 
 extern VideoState *video_state;
 
 void video_init();
+// presents the last frame drawn, waiting for the display's refresh.
 void video_update(u8 *is_running);
+// of the primary display, in hz. 0 if it won't say.
+double video_refresh_rate();
+// is the key (a GLFW_KEY_*) held down right now?
+u8 video_key_held(int key);
+// the keyboard, as a mask of controller Buttons.
+u8 video_read_buttons();
+// take whatever we're showing next from this machine state.
+void video_present(EmuState *state);
 void video_clean();